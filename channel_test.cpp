@@ -0,0 +1,118 @@
+#include <sparkles/channel.hpp>
+
+#include <boost/test/unit_test.hpp>
+#include <chrono>
+#include <memory>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+namespace sparkles {
+namespace test {
+
+BOOST_AUTO_TEST_SUITE(channel_test)
+
+BOOST_AUTO_TEST_CASE( construct )
+{
+   BOOST_CHECK_THROW(channel<int>(0), ::std::invalid_argument);
+   channel<int> three(3);
+   BOOST_CHECK_EQUAL(three.capacity(), 4U);
+   channel<int> dflt;
+   BOOST_CHECK_EQUAL(dflt.capacity(), channel<int>::default_capacity);
+}
+
+BOOST_AUTO_TEST_CASE( send_receive )
+{
+   channel<int> ch(4);
+   int out = 0;
+   BOOST_CHECK(!ch.try_receive(out));
+   for (int i = 1; i <= 4; ++i) {
+      BOOST_CHECK(ch.try_send(int(i)));
+   }
+   BOOST_CHECK(!ch.try_send(5));
+   BOOST_CHECK(!ch.send_until(5, ::std::chrono::steady_clock::now() +
+                              ::std::chrono::milliseconds(5)));
+   BOOST_CHECK_EQUAL(ch.receive(), 1);
+   BOOST_CHECK(ch.try_receive(out));
+   BOOST_CHECK_EQUAL(out, 2);
+   ch.send(5);
+   int buffer[8];
+   BOOST_CHECK_EQUAL(ch.receive_batch(buffer, 8, false), 3U);
+   BOOST_CHECK_EQUAL(buffer[0], 3);
+   BOOST_CHECK_EQUAL(buffer[2], 5);
+   BOOST_CHECK_EQUAL(ch.receive_batch(buffer, 8, false), 0U);
+   BOOST_CHECK(!ch.receive_for(out, ::std::chrono::milliseconds(5)));
+}
+
+BOOST_AUTO_TEST_CASE( blocking_receive )
+{
+   channel< ::std::unique_ptr<int> > ch(2);
+   ::std::thread sender([&ch]() {
+         ::std::this_thread::sleep_for(::std::chrono::milliseconds(5));
+         for (int i = 0; i < 5; ++i) {
+            ch.send(::std::unique_ptr<int>(new int(i)));
+         }
+      });
+   ::std::unique_ptr<int> buffer[5];
+   ::std::size_t got = 0;
+   while (got < 5) {
+      got += ch.receive_batch(buffer + got, 5 - got, true);
+   }
+   sender.join();
+   for (int i = 0; i < 5; ++i) {
+      BOOST_CHECK_EQUAL(*buffer[i], i);
+   }
+}
+
+BOOST_AUTO_TEST_CASE( leftovers_destroyed )
+{
+   auto counted = ::std::make_shared<int>(0);
+   {
+      channel< ::std::shared_ptr<int> > ch(8);
+      for (int i = 0; i < 5; ++i) {
+         ch.send(counted);
+      }
+      ch.receive();
+      BOOST_CHECK_EQUAL(counted.use_count(), 5);
+   }
+   BOOST_CHECK_EQUAL(counted.use_count(), 1);
+}
+
+BOOST_AUTO_TEST_CASE( stress )
+{
+   const unsigned int senders = 4;
+   const unsigned long per_sender = 100000;
+   channel<unsigned long> ch(64);
+   ::std::vector< ::std::thread> threads;
+   for (unsigned int s = 0; s < senders; ++s) {
+      threads.emplace_back([&ch, s, per_sender]() {
+            for (unsigned long i = 0; i < per_sender; ++i) {
+               ch.send(s * per_sender + i);
+            }
+         });
+   }
+   // Each sender's values have to come out in the order they went in.
+   ::std::vector<unsigned long> next(senders, 0);
+   unsigned long buffer[32];
+   unsigned long received = 0;
+   bool in_order = true;
+   while (received < senders * per_sender) {
+      const ::std::size_t got = ch.receive_batch(buffer, 32, true);
+      for (::std::size_t i = 0; i < got; ++i) {
+         const unsigned long sender = buffer[i] / per_sender;
+         in_order = in_order && (buffer[i] % per_sender == next[sender]);
+         ++next[sender];
+      }
+      received += got;
+   }
+   for (auto &thread: threads) {
+      thread.join();
+   }
+   BOOST_CHECK(in_order);
+   BOOST_CHECK_EQUAL(received, senders * per_sender);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
+
+} // namespace test
+} // namespace sparkles
@@ -0,0 +1,81 @@
+#include <sparkles/chase_lev_deque.hpp>
+
+#include <boost/test/unit_test.hpp>
+#include <atomic>
+#include <thread>
+#include <vector>
+
+namespace sparkles {
+namespace test {
+
+BOOST_AUTO_TEST_SUITE(chase_lev_deque_test)
+
+BOOST_AUTO_TEST_CASE( ends )
+{
+   int items[5];
+   priv::chase_lev_deque<int *> deque(2);
+   BOOST_CHECK(deque.empty());
+   BOOST_CHECK(deque.pop() == nullptr);
+   BOOST_CHECK(deque.steal() == nullptr);
+   // More than it starts with room for, so it grows.
+   for (int &item: items) {
+      deque.push(&item);
+   }
+   BOOST_CHECK(!deque.empty());
+   BOOST_CHECK(deque.pop() == &items[4]);
+   BOOST_CHECK(deque.steal() == &items[0]);
+   BOOST_CHECK(deque.steal() == &items[1]);
+   BOOST_CHECK(deque.pop() == &items[3]);
+   BOOST_CHECK(deque.pop() == &items[2]);
+   BOOST_CHECK(deque.pop() == nullptr);
+   BOOST_CHECK(deque.steal() == nullptr);
+   BOOST_CHECK(deque.empty());
+}
+
+BOOST_AUTO_TEST_CASE( thieves )
+{
+   const int num_items = 100000;
+   const int num_thieves = 3;
+   ::std::vector<int> items(num_items, 0);
+   ::std::vector< ::std::atomic<int> > taken(num_items);
+   priv::chase_lev_deque<int *> deque(16);
+   ::std::atomic<bool> done(false);
+   ::std::vector< ::std::thread> thieves;
+   for (int i = 0; i < num_thieves; ++i) {
+      thieves.emplace_back([&]() {
+            while (!done.load()) {
+               if (int * const item = deque.steal()) {
+                  ++taken[item - items.data()];
+               }
+            }
+         });
+   }
+   // The owner pops some of its own as it goes, and the rest at the end.
+   for (int i = 0; i < num_items; ++i) {
+      deque.push(&items[i]);
+      if ((i % 3) == 0) {
+         if (int * const item = deque.pop()) {
+            ++taken[item - items.data()];
+         }
+      }
+   }
+   while (int * const item = deque.pop()) {
+      ++taken[item - items.data()];
+   }
+   done = true;
+   for (auto &thief: thieves) {
+      thief.join();
+   }
+   int wrong = 0;
+   for (const auto &count: taken) {
+      if (count.load() != 1) {
+         ++wrong;
+      }
+   }
+   BOOST_CHECK_EQUAL(wrong, 0);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
+
+} // namespace test
+} // namespace sparkles
@@ -1 +1,57 @@
-#include <sparkles/deferred.hpp>
+#include <sparkles/deferred_pool.hpp>
+#include <sparkles/remote_operation.hpp>
+
+namespace sparkles {
+
+namespace priv {
+
+thread_local const offload_target *current_offload_target = nullptr;
+
+namespace {
+
+typedef remote_operation<void> offload_remote_t;
+
+} // anonymous namespace
+
+offload_link::offload_link(const offload_target &target)
+     : pool_(target.pool)
+{
+   auto remote = offload_remote_t::create(*target.answerq);
+   done_ = ::std::move(remote.first);
+   promise_ = ::std::move(remote.second);
+}
+
+offload_link::~offload_link()
+{
+   // Let go of done_ first, so an unsent promise isn't broken noisily.
+   done_.reset();
+   promise_.reset();
+}
+
+void offload_link::post(::std::shared_ptr<offload_job> job)
+{
+   pool_->post([promise = ::std::static_pointer_cast<
+                   offload_remote_t::promise>(::std::move(promise_)),
+                job = ::std::move(job)]() {
+                  // Skip it if the operation was dropped in the meantime.
+                  if (promise->still_needed()) {
+                     job->run();
+                     promise->set_result();
+                  }
+               });
+}
+
+} // namespace priv
+
+parallel_graph::parallel_graph(thread_pool &pool, work_queue &answerq)
+     : target_{&pool, &answerq}, outer_(priv::current_offload_target)
+{
+   priv::current_offload_target = &target_;
+}
+
+parallel_graph::~parallel_graph()
+{
+   priv::current_offload_target = outer_;
+}
+
+} // namespace sparkles
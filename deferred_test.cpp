@@ -1,9 +1,15 @@
 #include "test_operations.hpp"
 
 #include <sparkles/errors.hpp>
-#include <sparkles/deferred.hpp>
+#include <sparkles/deferred_pool.hpp>
+#include <sparkles/event_loop.hpp>
+#include <sparkles/semaphore.hpp>
+#include <sparkles/thread_pool.hpp>
 
 #include <boost/test/unit_test.hpp>
+#include <chrono>
+#include <functional>
+#include <thread>
 
 namespace {
 
@@ -329,6 +335,170 @@ BOOST_AUTO_TEST_CASE( void_return_exception )
    BOOST_CHECK(op1_deleted);
 }
 
+namespace {
+
+//! A square that only works if the other one is running at the same time.
+::std::function<int(int)> meet_and_square(semaphore &mine, semaphore &theirs)
+{
+   return [&mine, &theirs](int x) {
+      mine.release();
+      if (!theirs.acquire_for(::std::chrono::seconds(10))) {
+         throw test_exception("The other branch never started.");
+      }
+      return x * x;
+   };
+}
+
+} // Anonymous namespace
+
+BOOST_AUTO_TEST_CASE( parallel_branches )
+{
+   finishedq_t q;
+   using ::sparkles::defer;
+   thread_pool pool(2);
+   work_queue wq;
+   event_loop loop(wq);
+   const ::std::thread::id origin = ::std::this_thread::get_id();
+   ::std::thread::id sum_ran_on = origin;
+   ::std::function<int(int, int)> sum = [&sum_ran_on](int a, int b) {
+      sum_ran_on = ::std::this_thread::get_id();
+      return a + b;
+   };
+
+   auto left_in = nodep_op<int>::create("left", q, nullptr);
+   auto right_in = nodep_op<int>::create("right", q, nullptr);
+   semaphore left_started, right_started;
+   operation<int>::ptr_t total;
+   BOOST_CHECK(parallel_graph::current() == nullptr);
+   {
+      parallel_graph parallel(pool, wq);
+      BOOST_CHECK(parallel_graph::current() != nullptr);
+      auto left = defer(meet_and_square(left_started, right_started))
+         .until(left_in);
+      auto right = defer(meet_and_square(right_started, left_started))
+         .until(right_in);
+      total = defer(sum).until(left, right);
+   }
+   BOOST_CHECK(parallel_graph::current() == nullptr);
+   left_in->set_result(3);
+   right_in->set_result(4);
+   // Both branches are off on the pool, waiting for each other.
+   BOOST_CHECK(!total->finished());
+   BOOST_REQUIRE(loop.run_for(total, ::std::chrono::seconds(20)));
+   BOOST_CHECK_EQUAL(total->result(), 25);
+   BOOST_CHECK(sum_ran_on != origin);
+}
+
+BOOST_AUTO_TEST_CASE( parallel_exceptions )
+{
+   finishedq_t q;
+   using ::sparkles::defer;
+   thread_pool pool(1);
+   work_queue wq;
+   event_loop loop(wq);
+   parallel_graph parallel(pool, wq);
+
+   // A bad argument finishes it right away, without bothering the pool.
+   auto bad_in = nodep_op<int>::create("bad", q, nullptr);
+   auto never = defer(multiply_int).until(bad_in, bad_in);
+   try {
+      throw test_exception("Just because I can.");
+   } catch (...) {
+      bad_in->set_bad_result(::std::current_exception());
+   }
+   BOOST_CHECK(never->finished());
+   BOOST_CHECK_THROW(never->result(), test_exception);
+
+   // What the function throws comes back from the pool.
+   auto in = nodep_op<int>::create("in", q, nullptr);
+   auto thrown = defer(throws_exception).until(in);
+   in->set_result(5);
+   BOOST_CHECK(!thrown->finished());
+   BOOST_REQUIRE(loop.run_for(thrown, ::std::chrono::seconds(10)));
+   BOOST_CHECK_THROW(thrown->result(), test_exception);
+}
+
+BOOST_AUTO_TEST_CASE( parallel_dropped )
+{
+   finishedq_t q;
+   using ::sparkles::defer;
+   thread_pool pool(1);
+   work_queue wq;
+   event_loop loop(wq);
+   parallel_graph parallel(pool, wq);
+   semaphore go;
+   bool ran = false;
+   // Keep the pool busy until the next one has been dropped.
+   pool.post([&go]() { go.acquire(); });
+   auto in = nodep_op<int>::create("in", q, nullptr);
+   ::std::function<void(int)> note = [&ran](int) { ran = true; };
+   auto dropped = defer(note).until(in);
+   in->set_result(1);
+   dropped.reset();
+   go.release();
+   // Something after it to wait for.
+   auto after = pool.submit(wq, []() {});
+   BOOST_REQUIRE(loop.run_for(after, ::std::chrono::seconds(10)));
+   BOOST_CHECK(!ran);
+}
+
+namespace {
+
+//! Counts how many times it's been copied, to check that nothing is copied.
+struct payload {
+   explicit payload(int *copies = nullptr) : copies_(copies) { }
+   payload(const payload &other) : copies_(other.copies_) { count(); }
+   payload(payload &&other) = default;
+   payload &operator =(const payload &other) {
+      copies_ = other.copies_;
+      count();
+      return *this;
+   }
+   payload &operator =(payload &&other) = default;
+
+   void count() {
+      if (copies_ != nullptr) {
+         ++*copies_;
+      }
+   }
+
+   int *copies_;
+};
+
+} // Anonymous namespace
+
+BOOST_AUTO_TEST_CASE( on_pool )
+{
+   finishedq_t q;
+   using ::sparkles::defer;
+   thread_pool pool(1);
+   work_queue wq;
+   event_loop loop(wq);
+   const ::std::thread::id origin = ::std::this_thread::get_id();
+   ::std::function<::std::thread::id(payload)> parse = [](payload) {
+      return ::std::this_thread::get_id();
+   };
+
+   int copies = 0;
+   auto bytes = nodep_op<payload>::create("bytes", q, nullptr);
+   auto parsed = defer(parse).on(pool, wq).until(bytes);
+   BOOST_CHECK(parallel_graph::current() == nullptr);
+   bytes->set_result(payload(&copies));
+   BOOST_CHECK(!parsed->finished());
+   BOOST_REQUIRE(loop.run_for(parsed, ::std::chrono::seconds(10)));
+   BOOST_CHECK(parsed->result() != origin);
+   // Once out of the operation, which others may still want it from, and
+   // moved from there on.
+   BOOST_CHECK_EQUAL(copies, 1);
+
+   // And it still works the usual way without on().
+   auto here = nodep_op<payload>::create("here", q, nullptr);
+   auto inline_parsed = defer(parse).until(here);
+   here->set_result(payload(&copies));
+   BOOST_REQUIRE(inline_parsed->finished());
+   BOOST_CHECK(inline_parsed->result() == origin);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
 
 } // namespace test
@@ -0,0 +1,68 @@
+#include <sparkles/event_loop.hpp>
+#include <algorithm>
+
+namespace sparkles {
+
+bool event_loop::run_until(const opbase_ptr_t &op)
+{
+   while (!op->finished() && !take_stop()) {
+      run_one(time_point::max());
+   }
+   return op->finished();
+}
+
+bool event_loop::run_until(const opbase_ptr_t &op, time_point deadline)
+{
+   while (!op->finished() && !take_stop()) {
+      if ((run_one(deadline) == 0) &&
+          (::std::chrono::steady_clock::now() >= deadline))
+      {
+         break;
+      }
+   }
+   return op->finished();
+}
+
+::std::size_t event_loop::run_until(time_point deadline)
+{
+   ::std::size_t ran = 0;
+   while (!take_stop()) {
+      const ::std::size_t ran_now = run_one(deadline);
+      if ((ran_now == 0) && (::std::chrono::steady_clock::now() >= deadline)) {
+         break;
+      }
+      ran += ran_now;
+   }
+   return ran;
+}
+
+::std::size_t event_loop::run_one(time_point deadline)
+{
+   if (!timers_.empty()) {
+      const ::std::size_t expired = timers_.expire();
+      if (expired > 0) {
+         return expired;
+      }
+      deadline = ::std::min(deadline, timers_.next_deadline());
+   }
+   if (deadline == time_point::max()) {
+      queue_.dequeue(true).value()();
+      return 1;
+   }
+   work_queue::possible_work_item_t item = queue_.dequeue_until(deadline);
+   if (!item) {
+      return 0;
+   }
+   item.value()();
+   return 1;
+}
+
+void event_loop::stop()
+{
+   stop_requested_.store(true, ::std::memory_order_release);
+   // Wake the loop up if it's waiting. If the queue is full the loop is busy
+   // and will notice soon enough without this.
+   queue_.try_enqueue([]() {}, true);
+}
+
+} // namespace sparkles
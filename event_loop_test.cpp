@@ -0,0 +1,105 @@
+// Required to make ::std::this_thread::sleep_for work.
+#define _GLIBCXX_USE_NANOSLEEP
+
+#include <sparkles/event_loop.hpp>
+#include <sparkles/remote_operation.hpp>
+#include <sparkles/timer_operation.hpp>
+
+#include <boost/test/unit_test.hpp>
+#include <chrono>
+#include <thread>
+
+namespace sparkles {
+namespace test {
+
+BOOST_AUTO_TEST_SUITE(event_loop_test)
+
+BOOST_AUTO_TEST_CASE( run_until_finished )
+{
+   work_queue wq;
+   event_loop loop(wq);
+   auto fred = remote_operation<int>::create(loop.queue());
+   int before = 0;
+   wq.enqueue([&before]() { ++before; });
+   ::std::thread fulfiller([&fred]() {
+         ::std::this_thread::sleep_for(::std::chrono::milliseconds(5));
+         fred.second->set_result(6);
+      });
+   BOOST_CHECK(loop.run_until(fred.first));
+   fulfiller.join();
+   BOOST_CHECK_EQUAL(before, 1);
+   BOOST_CHECK_EQUAL(fred.first->result(), 6);
+   // Already finished, so nothing is run.
+   wq.enqueue([&before]() { ++before; });
+   BOOST_CHECK(loop.run_until(fred.first));
+   BOOST_CHECK_EQUAL(before, 1);
+}
+
+BOOST_AUTO_TEST_CASE( run_for )
+{
+   using ::std::chrono::milliseconds;
+   using ::std::chrono::steady_clock;
+   work_queue wq;
+   event_loop loop(wq);
+   for (int i = 0; i < 3; ++i) {
+      wq.enqueue([]() {});
+   }
+   auto start = steady_clock::now();
+   BOOST_CHECK_EQUAL(loop.run_for(milliseconds(20)), 3U);
+   BOOST_CHECK(steady_clock::now() - start >= milliseconds(20));
+   auto fred = remote_operation<void>::create(wq);
+   start = steady_clock::now();
+   BOOST_CHECK(!loop.run_for(fred.first, milliseconds(20)));
+   BOOST_CHECK(steady_clock::now() - start >= milliseconds(20));
+   fred.second->set_result();
+   BOOST_CHECK(loop.run_for(fred.first, milliseconds(20)));
+}
+
+BOOST_AUTO_TEST_CASE( stop )
+{
+   work_queue wq;
+   event_loop loop(wq);
+   auto fred = remote_operation<int>::create(wq);
+   // A stop with nothing running stops the next run straight away.
+   loop.stop();
+   BOOST_CHECK(!loop.run_until(fred.first));
+   ::std::thread stopper([&loop]() {
+         ::std::this_thread::sleep_for(::std::chrono::milliseconds(5));
+         loop.stop();
+      });
+   BOOST_CHECK(!loop.run_until(fred.first));
+   stopper.join();
+   int ran = 0;
+   wq.enqueue([&loop, &ran]() { ++ran; loop.stop(); });
+   wq.enqueue([&ran]() { ++ran; });
+   loop.run_until(::std::chrono::steady_clock::time_point::max());
+   BOOST_CHECK_EQUAL(ran, 1);
+}
+
+BOOST_AUTO_TEST_CASE( timers )
+{
+   using ::std::chrono::milliseconds;
+   using ::std::chrono::steady_clock;
+   work_queue wq;
+   event_loop loop(wq);
+   const auto start = steady_clock::now();
+   auto soon = timer_operation::create(loop.timers(), start + milliseconds(10));
+   auto later = timer_operation::create(loop.timers(),
+                                        start + milliseconds(30));
+   // The loop wakes up for the timers even though the queue stays empty.
+   BOOST_CHECK(loop.run_until(soon));
+   BOOST_CHECK(steady_clock::now() - start >= milliseconds(10));
+   BOOST_CHECK(!later->finished());
+   BOOST_CHECK_EQUAL(loop.run_for(milliseconds(50)), 1U);
+   BOOST_CHECK(later->finished());
+   // A dropped timer never fires.
+   auto dropped = timer_operation::create(loop.timers(),
+                                          start + milliseconds(60));
+   dropped.reset();
+   BOOST_CHECK(loop.timers().empty());
+}
+
+BOOST_AUTO_TEST_SUITE_END()
+
+} // namespace test
+} // namespace sparkles
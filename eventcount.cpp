@@ -0,0 +1,94 @@
+#include <sparkles/eventcount.hpp>
+
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <ctime>
+#include <cerrno>
+#include <climits>
+#include <system_error>
+
+namespace {
+
+static_assert(sizeof(::std::atomic< ::std::uint32_t>) == sizeof(int),
+              "The futex word must be exactly an int.");
+
+int *futex_word(::std::atomic< ::std::uint32_t> &word)
+{
+   return reinterpret_cast<int *>(&word);
+}
+
+long futex(int *uaddr, int op, int val, const ::timespec *timeout,
+           unsigned int val3)
+{
+   return ::syscall(SYS_futex, uaddr, op, val, timeout, nullptr, val3);
+}
+
+// EAGAIN means the epoch moved before we got to sleep, EINTR is a signal.
+// Either way the caller rechecks its condition, so neither is an error.
+void check_wait_error(const char *what)
+{
+   if ((errno != EAGAIN) && (errno != EINTR) && (errno != ETIMEDOUT)) {
+      throw ::std::system_error(errno, ::std::system_category(), what);
+   }
+}
+
+} // anonymous namespace
+
+namespace sparkles {
+
+void eventcount::wait(key_t key)
+{
+   const long result = futex(futex_word(epoch_), FUTEX_WAIT_PRIVATE,
+                             static_cast<int>(key), nullptr, 0);
+   const int saved_errno = errno;
+   waiters_.fetch_sub(1, ::std::memory_order_seq_cst);
+   if (result != 0) {
+      errno = saved_errno;
+      check_wait_error("Waiting on an eventcount failed.");
+   }
+}
+
+bool eventcount::wait_until(key_t key,
+                            ::std::chrono::steady_clock::time_point deadline)
+{
+   using ::std::chrono::duration_cast;
+   using ::std::chrono::seconds;
+   using ::std::chrono::nanoseconds;
+   // The steady_clock is CLOCK_MONOTONIC, which is what FUTEX_WAIT_BITSET
+   // uses for absolute timeouts.
+   const auto since_epoch = deadline.time_since_epoch();
+   const auto secs = duration_cast<seconds>(since_epoch);
+   ::timespec abstime;
+   if (since_epoch.count() < 0) {
+      abstime.tv_sec = 0;
+      abstime.tv_nsec = 0;
+   } else {
+      abstime.tv_sec = static_cast< ::time_t>(secs.count());
+      abstime.tv_nsec = static_cast<long>(
+         duration_cast<nanoseconds>(since_epoch - secs).count()
+         );
+   }
+   const long result = futex(futex_word(epoch_),
+                             FUTEX_WAIT_BITSET_PRIVATE,
+                             static_cast<int>(key), &abstime,
+                             FUTEX_BITSET_MATCH_ANY);
+   const int saved_errno = errno;
+   waiters_.fetch_sub(1, ::std::memory_order_seq_cst);
+   if (result != 0) {
+      errno = saved_errno;
+      check_wait_error("Timed wait on an eventcount failed.");
+      if (saved_errno == ETIMEDOUT) {
+         return false;
+      }
+   }
+   return ::std::chrono::steady_clock::now() < deadline;
+}
+
+void eventcount::wake(unsigned int count) noexcept
+{
+   futex(futex_word(epoch_), FUTEX_WAKE_PRIVATE,
+         static_cast<int>((count > INT_MAX) ? INT_MAX : count), nullptr, 0);
+}
+
+} // namespace sparkles
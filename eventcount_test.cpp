@@ -0,0 +1,66 @@
+// Required to make ::std::this_thread::sleep_for work.
+#define _GLIBCXX_USE_NANOSLEEP
+
+#include <sparkles/eventcount.hpp>
+
+#include <boost/test/unit_test.hpp>
+#include <thread>
+#include <atomic>
+#include <chrono>
+
+namespace sparkles {
+namespace test {
+
+BOOST_AUTO_TEST_SUITE(eventcount_test)
+
+BOOST_AUTO_TEST_CASE( notify_nobody )
+{
+   eventcount ec;
+   BOOST_CHECK_NO_THROW(ec.notify_one());
+   BOOST_CHECK_NO_THROW(ec.notify_all());
+   ec.prepare_wait();
+   ec.cancel_wait();
+   BOOST_CHECK_NO_THROW(ec.notify_one());
+   // The key is stale now, so this must return right away.
+   BOOST_CHECK_NO_THROW(ec.wait(ec.prepare_wait() - 1));
+}
+
+BOOST_AUTO_TEST_CASE( wait_timeout )
+{
+   using ::std::chrono::milliseconds;
+   using ::std::chrono::steady_clock;
+   eventcount ec;
+   const auto start = steady_clock::now();
+   BOOST_CHECK(!ec.wait_until(ec.prepare_wait(), start + milliseconds(20)));
+   BOOST_CHECK(steady_clock::now() - start >= milliseconds(20));
+   BOOST_CHECK(!ec.wait_until(ec.prepare_wait(), start));
+}
+
+BOOST_AUTO_TEST_CASE( wake_waiter )
+{
+   eventcount ec;
+   ::std::atomic<bool> flag{false};
+   ::std::atomic<bool> done{false};
+   ::std::thread waiter([&ec, &flag, &done]() {
+         while (!flag.load()) {
+            const auto key = ec.prepare_wait();
+            if (flag.load()) {
+               ec.cancel_wait();
+               break;
+            }
+            ec.wait(key);
+         }
+         done.store(true);
+      });
+   ::std::this_thread::sleep_for(::std::chrono::milliseconds(20));
+   BOOST_CHECK(!done.load());
+   flag.store(true);
+   ec.notify_all();
+   waiter.join();
+   BOOST_CHECK(done.load());
+}
+
+BOOST_AUTO_TEST_SUITE_END()
+
+} // namespace test
+} // namespace sparkles
@@ -0,0 +1,301 @@
+#include "test_allocation.hpp"
+
+#include <sparkles/inplace_function.hpp>
+#include <sparkles/remote_operation.hpp>
+#include <sparkles/work_queue.hpp>
+
+#include <boost/test/unit_test.hpp>
+
+#include <atomic>
+#include <cstdlib>
+#include <functional>
+#include <memory>
+#include <new>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace {
+
+// Counts calls to the global operator new made by this thread while an
+// allocation_counter exists.
+thread_local unsigned long *allocation_count = nullptr;
+// How many allocation_failures exist on this thread.
+thread_local unsigned int failing_allocations = 0;
+
+// Every replaceable form of new and delete below goes through these, so
+// nothing allocated one way is freed another.
+void *counted_malloc(::std::size_t size) noexcept
+{
+   if (failing_allocations > 0) {
+      return nullptr;
+   }
+   if (allocation_count != nullptr) {
+      ++*allocation_count;
+   }
+   return ::std::malloc((size > 0) ? size : 1);
+}
+
+void *counted_new(::std::size_t size)
+{
+   void * const mem = counted_malloc(size);
+   if (mem == nullptr) {
+      throw ::std::bad_alloc();
+   }
+   return mem;
+}
+
+} // anonymous namespace
+
+void *operator new(::std::size_t size)
+{
+   return counted_new(size);
+}
+
+void *operator new[](::std::size_t size)
+{
+   return counted_new(size);
+}
+
+void *operator new(::std::size_t size, const ::std::nothrow_t &) noexcept
+{
+   return counted_malloc(size);
+}
+
+void *operator new[](::std::size_t size, const ::std::nothrow_t &) noexcept
+{
+   return counted_malloc(size);
+}
+
+void operator delete(void *mem) noexcept
+{
+   ::std::free(mem);
+}
+
+void operator delete[](void *mem) noexcept
+{
+   ::std::free(mem);
+}
+
+void operator delete(void *mem, ::std::size_t) noexcept
+{
+   ::std::free(mem);
+}
+
+void operator delete[](void *mem, ::std::size_t) noexcept
+{
+   ::std::free(mem);
+}
+
+void operator delete(void *mem, const ::std::nothrow_t &) noexcept
+{
+   ::std::free(mem);
+}
+
+void operator delete[](void *mem, const ::std::nothrow_t &) noexcept
+{
+   ::std::free(mem);
+}
+
+namespace sparkles {
+namespace test {
+
+allocation_failure::allocation_failure()
+{
+   ++failing_allocations;
+}
+
+allocation_failure::~allocation_failure()
+{
+   --failing_allocations;
+}
+
+allocation_counter::allocation_counter()
+     : count_(0), saved_(allocation_count)
+{
+   allocation_count = &count_;
+}
+
+allocation_counter::~allocation_counter()
+{
+   allocation_count = saved_;
+}
+
+namespace {
+
+// A callable that can't be copied and counts how many of it are alive.
+class move_only_counter {
+ public:
+   move_only_counter(int &calls, int &alive) : calls_(&calls), alive_(&alive) {
+      ++*alive_;
+   }
+   move_only_counter(move_only_counter &&other) noexcept
+        : calls_(other.calls_), alive_(other.alive_)
+   {
+      ++*alive_;
+   }
+   move_only_counter(const move_only_counter &) = delete;
+   ~move_only_counter() { --*alive_; }
+
+   void operator ()() { ++*calls_; }
+
+ private:
+   int *calls_;
+   int *alive_;
+};
+
+// Check that a promise delivery of a T fits in a work item and costs nothing
+// from the allocator once the queue has a node to reuse.
+template <typename T>
+void check_set_result_allocations(T value)
+{
+   work_queue wq;
+   {
+      // Give the queue a spare node.
+      auto warmup = remote_operation<T>::create(wq);
+      warmup.second->set_result(value);
+      wq.dequeue(true).value()();
+   }
+   auto fred = remote_operation<T>::create(wq);
+   T expected = value;
+   {
+      allocation_counter counter;
+      fred.second->set_result(::std::move(value));
+      BOOST_CHECK_EQUAL(counter.count(), 0U);
+   }
+   wq.dequeue(true).value()();
+   BOOST_CHECK(fred.first->finished());
+   BOOST_CHECK(fred.first->result() == expected);
+}
+
+} // anonymous namespace
+
+BOOST_AUTO_TEST_SUITE(inplace_function_test)
+
+BOOST_AUTO_TEST_CASE( construct_empty )
+{
+   inplace_function<void ()> empty;
+   BOOST_CHECK(!empty);
+   BOOST_CHECK_THROW(empty(), ::std::bad_function_call);
+   inplace_function<void ()> null_ptr{nullptr};
+   BOOST_CHECK(!null_ptr);
+   void (*nullfunc)() = nullptr;
+   inplace_function<void ()> null_func{nullfunc};
+   BOOST_CHECK(!null_func);
+}
+
+BOOST_AUTO_TEST_CASE( call_with_args )
+{
+   inplace_function<int (int, int)> add{[](int a, int b) { return a + b; }};
+   BOOST_REQUIRE(add);
+   BOOST_CHECK_EQUAL(add(2, 3), 5);
+   int total = 0;
+   inplace_function<void (int)> accumulate{[&total](int a) { total += a; }};
+   accumulate(4);
+   accumulate(5);
+   BOOST_CHECK_EQUAL(total, 9);
+}
+
+BOOST_AUTO_TEST_CASE( move_only_callable )
+{
+   int calls = 0;
+   int alive = 0;
+   {
+      inplace_function<void ()> f{move_only_counter(calls, alive)};
+      BOOST_CHECK_EQUAL(alive, 1);
+      f();
+      inplace_function<void ()> g{::std::move(f)};
+      BOOST_CHECK(!f);
+      BOOST_REQUIRE(g);
+      BOOST_CHECK_EQUAL(alive, 1);
+      g();
+      f = ::std::move(g);
+      BOOST_CHECK(!g);
+      f();
+      f = nullptr;
+      BOOST_CHECK(!f);
+      BOOST_CHECK_EQUAL(alive, 0);
+      f = move_only_counter(calls, alive);
+      f();
+   }
+   BOOST_CHECK_EQUAL(calls, 4);
+   BOOST_CHECK_EQUAL(alive, 0);
+}
+
+BOOST_AUTO_TEST_CASE( inline_or_heap )
+{
+   typedef inplace_function<int (), 32> small_func_t;
+   ::std::unique_ptr<int> owned{new int(7)};
+   char big[64] = { 3 };
+   auto small = [p = ::std::move(owned)]() { return *p; };
+   auto large = [big]() { return int(big[0]); };
+   BOOST_CHECK(small_func_t::fits_inline<decltype(small)>);
+   BOOST_CHECK(!small_func_t::fits_inline<decltype(large)>);
+   {
+      allocation_counter counter;
+      small_func_t f{::std::move(small)};
+      small_func_t g{::std::move(f)};
+      BOOST_CHECK_EQUAL(g(), 7);
+      BOOST_CHECK_EQUAL(counter.count(), 0U);
+   }
+   {
+      allocation_counter counter;
+      small_func_t f{large};
+      BOOST_CHECK_EQUAL(counter.count(), 1U);
+      small_func_t g{::std::move(f)};
+      g.swap(f);
+      BOOST_CHECK(!g);
+      BOOST_CHECK_EQUAL(f(), 3);
+      BOOST_CHECK_EQUAL(counter.count(), 1U);
+   }
+}
+
+BOOST_AUTO_TEST_CASE( queue_move_only_item )
+{
+   int calls = 0;
+   int alive = 0;
+   {
+      work_queue wq;
+      wq.enqueue(move_only_counter(calls, alive));
+      BOOST_CHECK_EQUAL(alive, 1);
+      wq.dequeue(false).value()();
+      BOOST_CHECK_EQUAL(alive, 0);
+      wq.enqueue(move_only_counter(calls, alive));
+   }
+   BOOST_CHECK_EQUAL(calls, 1);
+   BOOST_CHECK_EQUAL(alive, 0);
+}
+
+BOOST_AUTO_TEST_CASE( set_result_no_allocation )
+{
+   check_set_result_allocations<int>(6);
+   check_set_result_allocations<double>(6.5);
+   check_set_result_allocations< ::std::string>(
+      "A string long enough that it isn't stored inside itself.");
+   check_set_result_allocations< ::std::vector<int> >({1, 2, 3});
+   check_set_result_allocations< ::std::shared_ptr<int> >(
+      ::std::make_shared<int>(6));
+}
+
+BOOST_AUTO_TEST_CASE( set_result_void_no_allocation )
+{
+   work_queue wq;
+   {
+      auto warmup = remote_operation<void>::create(wq);
+      warmup.second->set_result();
+      wq.dequeue(true).value()();
+   }
+   auto fred = remote_operation<void>::create(wq);
+   {
+      allocation_counter counter;
+      fred.second->set_result();
+      BOOST_CHECK_EQUAL(counter.count(), 0U);
+   }
+   wq.dequeue(true).value()();
+   BOOST_CHECK(fred.first->finished());
+}
+
+BOOST_AUTO_TEST_SUITE_END()
+
+} // namespace test
+} // namespace sparkles
@@ -0,0 +1,57 @@
+#include <sparkles/latency_histogram.hpp>
+
+#include <boost/test/unit_test.hpp>
+#include <cstdint>
+
+namespace sparkles {
+namespace test {
+
+BOOST_AUTO_TEST_SUITE(latency_histogram_test)
+
+BOOST_AUTO_TEST_CASE( buckets )
+{
+   typedef latency_histogram lh;
+   for (::std::uint64_t v = 0; v < 16; ++v) {
+      BOOST_CHECK_EQUAL(lh::bucket_of(v), v);
+      BOOST_CHECK_EQUAL(lh::lowest_in(lh::bucket_of(v)), v);
+   }
+   // Every bucket starts where the last one ended.
+   for (unsigned int i = 1; i < lh::num_buckets; ++i) {
+      const ::std::uint64_t lowest = lh::lowest_in(i);
+      BOOST_CHECK_EQUAL(lh::bucket_of(lowest), i);
+      BOOST_CHECK_EQUAL(lh::bucket_of(lowest - 1), i - 1);
+   }
+   BOOST_CHECK_EQUAL(lh::bucket_of(UINT64_MAX), lh::num_buckets - 1);
+   // Values are never off by more than 1/16th.
+   const ::std::uint64_t big = 1000000007;
+   BOOST_CHECK(big - lh::lowest_in(lh::bucket_of(big)) < big / 16);
+}
+
+BOOST_AUTO_TEST_CASE( percentiles )
+{
+   latency_histogram hist;
+   BOOST_CHECK_EQUAL(hist.take_snapshot().count(), 0U);
+   BOOST_CHECK_EQUAL(hist.take_snapshot().value_at_percentile(50), 0U);
+   for (::std::uint64_t v = 1; v <= 100; ++v) {
+      hist.record(v);
+   }
+   hist.record(1000);
+   const latency_histogram::snapshot snap = hist.take_snapshot();
+   BOOST_CHECK_EQUAL(snap.count(), 101U);
+   BOOST_CHECK_EQUAL(snap.max(), 1000U);
+   BOOST_CHECK_EQUAL(snap.value_at_percentile(0), 1U);
+   BOOST_CHECK_EQUAL(snap.value_at_percentile(10), 11U);
+   // The median is 51, which shares a bucket with 50.
+   BOOST_CHECK_EQUAL(snap.value_at_percentile(50), 50U);
+   BOOST_CHECK_EQUAL(snap.value_at_percentile(100), 992U);
+   ::std::uint64_t total = 0;
+   for (const auto &b: snap.buckets()) {
+      total += b.count;
+   }
+   BOOST_CHECK_EQUAL(total, 101U);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
+
+} // namespace test
+} // namespace sparkles
@@ -0,0 +1,103 @@
+// A benchmark of how much a work_queue node costs a producer.
+//
+// 1 to N producer threads each enqueue a burst of items at once, then wait
+// while the one consumer drains them all, over and over. Only the time the
+// producers spend in enqueue is counted, so after the first burst nearly all
+// of it is getting a node and linking it in. Each run is done with the default
+// node cache limit, and with a limit of 0 where every node comes from the
+// allocator, to show what the caches save.
+//
+// Usage: node_cache_bench [max_producers [burst [rounds]]]
+
+#include <sparkles/work_queue.hpp>
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <thread>
+#include <vector>
+
+namespace {
+
+using ::sparkles::work_queue;
+typedef ::std::chrono::steady_clock clock_type;
+
+double run_once(unsigned int producers, unsigned long burst,
+                unsigned int rounds, ::std::size_t cache_limit)
+{
+   work_queue::config cfg;
+   cfg.node_cache_limit = cache_limit;
+   work_queue wq(cfg);
+   ::std::atomic<unsigned int> round{0};
+   ::std::atomic<long long> producing_ns{0};
+   unsigned long sum = 0;
+   auto produce = [&]() {
+      for (unsigned int r = 0; r < rounds; ++r) {
+         while (round.load() != r) {
+            ::std::this_thread::yield();
+         }
+         const auto start = clock_type::now();
+         for (unsigned long i = 0; i < burst; ++i) {
+            wq.enqueue([&sum]() { ++sum; });
+         }
+         const auto end = clock_type::now();
+         producing_ns.fetch_add(
+            ::std::chrono::duration_cast< ::std::chrono::nanoseconds>(
+               end - start).count());
+      }
+   };
+   ::std::vector< ::std::thread> threads;
+   for (unsigned int i = 0; i < producers; ++i) {
+      threads.emplace_back(produce);
+   }
+   const unsigned long per_round = burst * producers;
+   for (unsigned int r = 0; r < rounds; ++r) {
+      round.store(r);
+      // Every producer is done with this round once all of it is dequeued.
+      for (unsigned long i = 0; i < per_round; ++i) {
+         wq.dequeue(true).value()();
+      }
+   }
+   for (auto &thread: threads) {
+      thread.join();
+   }
+   const unsigned long expected = per_round * rounds;
+   if (sum != expected) {
+      ::std::fprintf(stderr, "Lost items! %lu != %lu\n", sum, expected);
+      ::std::exit(1);
+   }
+   return static_cast<double>(producing_ns.load()) / expected;
+}
+
+} // anonymous namespace
+
+int main(int argc, char *argv[])
+{
+   unsigned int max_producers = ::std::thread::hardware_concurrency();
+   unsigned long burst = 512;
+   unsigned int rounds = 200;
+   if (argc > 1) {
+      max_producers = ::std::strtoul(argv[1], nullptr, 10);
+   }
+   if (argc > 2) {
+      burst = ::std::strtoul(argv[2], nullptr, 10);
+   }
+   if (argc > 3) {
+      rounds = ::std::strtoul(argv[3], nullptr, 10);
+   }
+   if (max_producers < 1) {
+      max_producers = 1;
+   }
+   const ::std::size_t limit = work_queue::config{}.node_cache_limit;
+   ::std::printf("work_queue nodes: bursts of %lu items, %u rounds\n",
+                 burst, rounds);
+   ::std::printf("%10s %16s %16s\n", "producers",
+                 "cached ns/item", "uncached ns/item");
+   for (unsigned int producers = 1; producers <= max_producers; ++producers) {
+      const double cached = run_once(producers, burst, rounds, limit);
+      const double uncached = run_once(producers, burst, rounds, 0);
+      ::std::printf("%10u %16.1f %16.1f\n", producers, cached, uncached);
+   }
+   return 0;
+}
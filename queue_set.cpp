@@ -0,0 +1,86 @@
+#include <sparkles/queue_set.hpp>
+
+#include <algorithm>
+#include <utility>
+
+namespace sparkles {
+
+queue_set::~queue_set()
+{
+   for (const member &m: members_) {
+      m.queue_->detach_listener();
+   }
+}
+
+void queue_set::add(work_queue &wq, unsigned int priority)
+{
+   // Queues of the same priority keep the order they were added in.
+   const auto where = ::std::upper_bound(
+      members_.begin(), members_.end(), priority,
+      [](unsigned int p, const member &m) { return p < m.priority_; });
+   const auto added = members_.insert(where, member{&wq, priority});
+   try {
+      wq.attach_listener(&ready_);
+   } catch (...) {
+      members_.erase(added);
+      throw;
+   }
+}
+
+void queue_set::remove(work_queue &wq)
+{
+   const auto found = ::std::find_if(
+      members_.begin(), members_.end(),
+      [&wq](const member &m) { return m.queue_ == &wq; });
+   if (found != members_.end()) {
+      wq.detach_listener();
+      members_.erase(found);
+   }
+}
+
+queue_set::possible_work_item_t queue_set::try_dequeue()
+{
+   for (const member &m: members_) {
+      possible_work_item_t item = m.queue_->dequeue(false);
+      if (item) {
+         return item;
+      }
+   }
+   return {};
+}
+
+queue_set::possible_work_item_t queue_set::dequeue(bool block)
+{
+   possible_work_item_t item = try_dequeue();
+   while (block && !item) {
+      const eventcount::key_t key = ready_.prepare_wait();
+      item = try_dequeue();
+      if (item) {
+         ready_.cancel_wait();
+      } else {
+         ready_.wait(key);
+         item = try_dequeue();
+      }
+   }
+   return item;
+}
+
+queue_set::possible_work_item_t
+queue_set::dequeue_until(::std::chrono::steady_clock::time_point deadline)
+{
+   possible_work_item_t item = try_dequeue();
+   bool waiting = true;
+   while (waiting && !item) {
+      const eventcount::key_t key = ready_.prepare_wait();
+      item = try_dequeue();
+      if (item) {
+         ready_.cancel_wait();
+      } else {
+         waiting = ready_.wait_until(key, deadline);
+         item = try_dequeue();
+      }
+   }
+   return item;
+}
+
+} // namespace sparkles
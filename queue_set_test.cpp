@@ -0,0 +1,110 @@
+// Required to make ::std::this_thread::sleep_for work.
+#define _GLIBCXX_USE_NANOSLEEP
+
+#include <sparkles/queue_set.hpp>
+
+#include <boost/test/unit_test.hpp>
+#include <atomic>
+#include <chrono>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+namespace sparkles {
+namespace test {
+
+BOOST_AUTO_TEST_SUITE(queue_set_test)
+
+BOOST_AUTO_TEST_CASE( membership )
+{
+   work_queue control, bulk;
+   queue_set set;
+   BOOST_CHECK(!set.dequeue(false));
+   set.add(bulk, 1);
+   set.add(control);
+   BOOST_CHECK_EQUAL(set.size(), 2U);
+   {
+      queue_set other;
+      BOOST_CHECK_THROW(other.add(control), ::std::logic_error);
+      BOOST_CHECK_EQUAL(other.size(), 0U);
+   }
+   set.remove(bulk);
+   set.remove(bulk);
+   BOOST_CHECK_EQUAL(set.size(), 1U);
+   queue_set other;
+   BOOST_CHECK_NO_THROW(other.add(bulk));
+}
+
+BOOST_AUTO_TEST_CASE( priority_order )
+{
+   ::std::vector<int> order;
+   auto record = [&order](int which) -> work_queue::work_item_t {
+      return [&order, which]() { order.push_back(which); };
+   };
+   work_queue control, bulk, other_bulk;
+   queue_set set;
+   set.add(bulk, 1);
+   set.add(control, 0);
+   set.add(other_bulk, 1);
+   bulk.enqueue(record(10));
+   other_bulk.enqueue(record(20));
+   bulk.enqueue(record(11));
+   control.enqueue(record(0));
+   control.enqueue(record(1), true);
+   for (auto item = set.dequeue(false); item; item = set.dequeue(false)) {
+      item.value()();
+   }
+   BOOST_CHECK((order == ::std::vector<int>{1, 0, 10, 11, 20}));
+}
+
+BOOST_AUTO_TEST_CASE( timed_dequeue )
+{
+   using ::std::chrono::milliseconds;
+   using ::std::chrono::steady_clock;
+   work_queue wq;
+   queue_set set;
+   set.add(wq);
+   const auto start = steady_clock::now();
+   BOOST_CHECK(!set.dequeue_for(milliseconds(20)));
+   BOOST_CHECK(steady_clock::now() - start >= milliseconds(20));
+   wq.enqueue([]() {});
+   BOOST_CHECK(set.dequeue_for(milliseconds(20)));
+}
+
+BOOST_AUTO_TEST_CASE( wakes_up )
+{
+   constexpr int per_queue = 1 << 14;
+   ::std::atomic<int> executed{0};
+   work_queue::config lanes;
+   lanes.producer_lanes = true;
+   work_queue control, bulk(lanes);
+   queue_set set;
+   set.add(control);
+   set.add(bulk, 1);
+   ::std::thread control_producer([&control, &executed]() {
+         for (int i = 0; i < per_queue; ++i) {
+            control.enqueue([&executed]() { ++executed; });
+            if ((i % 1024) == 0) {
+               ::std::this_thread::sleep_for(::std::chrono::milliseconds(1));
+            }
+         }
+      });
+   ::std::thread bulk_producer([&bulk, &executed]() {
+         work_queue::producer_lane lane(bulk);
+         for (int i = 0; i < per_queue; ++i) {
+            lane.enqueue([&executed]() { ++executed; });
+         }
+      });
+   for (int i = 0; i < 2 * per_queue; ++i) {
+      set.dequeue(true).value()();
+   }
+   control_producer.join();
+   bulk_producer.join();
+   BOOST_CHECK_EQUAL(executed.load(), 2 * per_queue);
+   BOOST_CHECK(!set.dequeue(false));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
+
+} // namespace test
+} // namespace sparkles
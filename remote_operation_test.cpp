@@ -3,10 +3,12 @@
 // Required to make ::std::this_thread::yield work.
 #define _GLIBCXX_USE_SCHED_YIELD
 
+#include "test_allocation.hpp"
 #include "test_error.hpp"
 #include "test_operations.hpp"
 
 #include <sparkles/errors.hpp>
+#include <sparkles/deferred.hpp>
 #include <sparkles/remote_operation.hpp>
 #include <sparkles/work_queue.hpp>
 
@@ -14,6 +16,8 @@
 
 #include <system_error>
 #include <exception>
+#include <functional>
+#include <new>
 #include <stdexcept>
 #include <thread>
 #include <tuple>
@@ -458,6 +462,96 @@ BOOST_AUTO_TEST_CASE( int_inter_thread_cancel )
    BOOST_CHECK(!wq.dequeue(false));
 }
 
+BOOST_AUTO_TEST_CASE( owner_delivers_inline )
+{
+   work_queue wq;
+   wq.set_owner();
+   auto fred = remote_operation<int>::create(wq);
+   fred.second->set_result(6);
+   BOOST_CHECK(fred.first->finished());
+   BOOST_CHECK_EQUAL(fred.first->result(), 6);
+   BOOST_CHECK(!wq.dequeue(false));
+   // Other threads still go through the queue.
+   auto barney = remote_operation<void>::create(wq);
+   ::std::thread other([&barney]() { barney.second->set_result(); });
+   other.join();
+   BOOST_CHECK(!barney.first->finished());
+   wq.dequeue(true).value()();
+   BOOST_CHECK(barney.first->finished());
+   // And so does everything once the owner is cleared.
+   wq.clear_owner();
+   auto wilma = remote_operation<int>::create(wq);
+   wilma.second->set_result(7);
+   BOOST_CHECK(!wilma.first->finished());
+   wq.dequeue(true).value()();
+   BOOST_CHECK_EQUAL(wilma.first->result(), 7);
+}
+
+BOOST_AUTO_TEST_CASE( owner_delivery_reentry )
+{
+   work_queue wq;
+   wq.set_owner();
+   // A dependent that gets rid of the promise while it's being delivered.
+   auto fred = remote_operation<int>::create(wq);
+   auto fred_promise = fred.second;
+   fred.second.reset();
+   ::std::function<int(int)> forget = [&fred_promise](int x) {
+      fred_promise.reset();
+      return x;
+   };
+   auto forgot = defer(forget).until(fred.first);
+   fred_promise->set_result(6);
+   BOOST_CHECK(!fred_promise);
+   BOOST_REQUIRE(forgot->finished());
+   BOOST_CHECK_EQUAL(forgot->result(), 6);
+   // Destroying it mustn't have sent a broken_promise.
+   BOOST_CHECK(!wq.dequeue(false));
+
+   // And one that tries to set the result again.
+   auto barney = remote_operation<int>::create(wq);
+   auto barney_promise = barney.second;
+   ::std::function<int(int)> again = [&barney_promise](int x) {
+      barney_promise->set_result(x + 1);
+      return x;
+   };
+   auto twice = defer(again).until(barney.first);
+   barney_promise->set_result(7);
+   BOOST_CHECK_EQUAL(barney.first->result(), 7);
+   BOOST_REQUIRE(twice->finished());
+   BOOST_CHECK_THROW(twice->result(), invalid_result);
+   barney_promise.reset();
+   barney.second.reset();
+   BOOST_CHECK(!wq.dequeue(false));
+}
+
+BOOST_AUTO_TEST_CASE( failed_delivery_breaks_promise )
+{
+   work_queue wq;
+   auto fred = remote_operation<int>::create(wq);
+   bool threw = false;
+   {
+      // A new queue has no nodes to spare, so enqueue has to allocate one.
+      allocation_failure failing;
+      try {
+         fred.second->set_result(5);
+      } catch (const ::std::bad_alloc &) {
+         threw = true;
+      }
+   }
+   BOOST_REQUIRE(threw);
+   BOOST_CHECK(!fred.second->fulfilled());
+   BOOST_CHECK(fred.second->still_needed());
+   BOOST_CHECK(!wq.dequeue(false));
+   // The result was lost, so the operation hears about it when the promise
+   // goes away.
+   fred.second.reset();
+   auto broken = wq.dequeue(false);
+   BOOST_REQUIRE(broken);
+   broken.value()();
+   BOOST_REQUIRE(fred.first->finished());
+   BOOST_CHECK_THROW(fred.first->result(), broken_promise);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
 
 } // namespace test
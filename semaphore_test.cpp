@@ -31,6 +31,53 @@ BOOST_AUTO_TEST_CASE( try_acquire )
    BOOST_CHECK(!s.try_acquire());
 }
 
+BOOST_AUTO_TEST_CASE( release_many )
+{
+   semaphore s;
+   s.release(5);
+   BOOST_CHECK_EQUAL(s.getvalue(), 5);
+   BOOST_CHECK_EQUAL(s.try_acquire_up_to(2), 2U);
+   BOOST_CHECK_EQUAL(s.getvalue(), 3);
+   BOOST_CHECK_EQUAL(s.try_acquire_up_to(10), 3U);
+   BOOST_CHECK_EQUAL(s.try_acquire_up_to(10), 0U);
+   BOOST_CHECK(!s.try_acquire());
+   s.release(0);
+   BOOST_CHECK(!s.try_acquire());
+}
+
+BOOST_AUTO_TEST_CASE( timed_acquire )
+{
+   using ::std::chrono::milliseconds;
+   using ::std::chrono::steady_clock;
+   semaphore s(1);
+   BOOST_CHECK(s.acquire_for(milliseconds(0)));
+   const auto start = steady_clock::now();
+   BOOST_CHECK(!s.acquire_for(milliseconds(20)));
+   BOOST_CHECK(steady_clock::now() - start >= milliseconds(20));
+   BOOST_CHECK(!s.acquire_until(::std::chrono::system_clock::now() +
+                                milliseconds(5)));
+   BOOST_CHECK(!s.acquire_until(steady_clock::now() - milliseconds(5)));
+   s.release();
+   BOOST_CHECK(s.acquire_until(steady_clock::now() - milliseconds(5)));
+   ::std::thread releaser([&s]() {
+         ::std::this_thread::sleep_for(milliseconds(10));
+         s.release();
+      });
+   BOOST_CHECK(s.acquire_for(::std::chrono::seconds(10)));
+   releaser.join();
+   BOOST_CHECK_EQUAL(s.getvalue(), 0);
+}
+
+BOOST_AUTO_TEST_CASE( spin_budget )
+{
+   semaphore s(0, 0);
+   BOOST_CHECK_EQUAL(s.spin_budget(), 0U);
+   s.set_spin_budget(10);
+   BOOST_CHECK_EQUAL(s.spin_budget(), 10U);
+   BOOST_CHECK_EQUAL(semaphore().spin_budget(),
+                     semaphore::default_spin_budget);
+}
+
 BOOST_AUTO_TEST_CASE( ping_pong_one )
 {
    ::std::atomic<int> ping{1};
@@ -120,6 +167,30 @@ BOOST_AUTO_TEST_CASE( ping_pong_five )
    }
 }
 
+BOOST_AUTO_TEST_CASE( ping_pong_no_spin )
+{
+   semaphore ping_sem(0, 0);
+   semaphore pong_sem(1, 0);
+   int volley = 0;
+   auto ping_func = [&]() {
+      for (int i = 0; i < 10000; ++i) {
+         ping_sem.acquire();
+         ++volley;
+         pong_sem.release();
+      }
+   };
+   ::std::thread ping_thread(ping_func);
+   for (int i = 0; i < 10000; ++i) {
+      pong_sem.acquire();
+      BOOST_REQUIRE_EQUAL(volley, i);
+      ping_sem.release();
+   }
+   pong_sem.acquire();
+   BOOST_CHECK_EQUAL(volley, 10000);
+   BOOST_REQUIRE(ping_thread.joinable());
+   ping_thread.join();
+}
+
 BOOST_AUTO_TEST_SUITE_END()
 
 } // namespace test
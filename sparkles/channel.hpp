@@ -0,0 +1,237 @@
+#pragma once
+
+#include <sparkles/mpsc_queue.hpp>
+#include <sparkles/semaphore.hpp>
+#include <sparkles/topology.hpp>
+#include <atomic>
+#include <chrono>
+#include <climits>
+#include <cstddef>
+#include <memory>
+#include <new>
+#include <stdexcept>
+#include <thread>
+#include <type_traits>
+#include <utility>
+
+namespace sparkles {
+
+/*! \brief A bounded multiple writer, one reader queue of plain values.
+ *
+ * This is for sending data rather than work. A work_queue can carry data by
+ * wrapping each value in a lambda, but that costs an indirect call per value,
+ * and an allocation for anything that doesn't fit in a work item. A channel
+ * keeps each T directly in a slot of a ring that's allocated once, when the
+ * channel is constructed, on the receiver's NUMA node if it's given one.
+ *
+ * The threading model is the same as a work_queue's. Any number of threads may
+ * send at once, and only one may receive at a time. A full channel pushes
+ * back: send waits for room and try_send fails. A receiver can take one value
+ * at a time, or fill a buffer of its own with everything that's waiting, which
+ * costs one semaphore operation per batch instead of one per value.
+ *
+ * Two semaphores do the counting, one for values and one for free slots, so
+ * nothing spins except for the moment between a sender claiming a slot and
+ * filling it. Destroying the channel while anyone is using it is undefined
+ * behavior. Values still in it are destroyed.
+ *
+ * T has to be nothrow move constructible, a slot that's been claimed has to be
+ * filled.
+ */
+template <class T>
+class channel {
+   static_assert(::std::is_nothrow_move_constructible<T>::value,
+                 "A channel can only hold nothrow move constructible types.");
+ public:
+   typedef T value_type;
+
+   //! How many values a channel holds if not told otherwise.
+   static constexpr ::std::size_t default_capacity = 1024;
+
+   /*! \brief Make a channel that holds at least capacity values.
+    *
+    * The capacity is rounded up to a power of two. Throws
+    * ::std::invalid_argument if it's 0 or more than 2^30. The slots are put on
+    * numa_node if it isn't negative.
+    */
+   explicit channel(::std::size_t capacity = default_capacity,
+                    int numa_node = -1)
+        : head_(0), tail_(0), mask_(round_up(capacity) - 1),
+          slots_(mask_ + 1, numa_node),
+          spaces_(static_cast<unsigned int>(mask_ + 1))
+   {
+   }
+   channel(const channel &) = delete;
+   channel(channel &&) = delete;
+   const channel &operator =(const channel &) = delete;
+   const channel &operator =(channel &&) = delete;
+   ~channel() {
+      for (::std::size_t i = 0; i <= mask_; ++i) {
+         if (slots_[i].full_.load(::std::memory_order_acquire)) {
+            slots_[i].value()->~T();
+         }
+      }
+   }
+
+   //! How many values the channel can hold.
+   ::std::size_t capacity() const { return mask_ + 1; }
+
+   //! Send a value, waiting for room if the channel is full.
+   void send(T value) {
+      spaces_.acquire();
+      put(::std::move(value));
+   }
+
+   /*! \brief Send a value if there's room right now.
+    *
+    * \return true if it was sent. value is left alone if it wasn't.
+    */
+   bool try_send(T &&value) {
+      if (!spaces_.try_acquire()) {
+         return false;
+      }
+      put(::std::move(value));
+      return true;
+   }
+
+   //! Like try_send, but wait until deadline for room.
+   bool send_until(T &&value,
+                   ::std::chrono::steady_clock::time_point deadline) {
+      if (!spaces_.acquire_until(deadline)) {
+         return false;
+      }
+      put(::std::move(value));
+      return true;
+   }
+
+   //! Receive a value, waiting for one if there aren't any.
+   T receive() {
+      items_.acquire();
+      T value(take());
+      spaces_.release();
+      return value;
+   }
+
+   /*! \brief Receive a value into out if there is one.
+    *
+    * \return true if a value was received.
+    */
+   bool try_receive(T &out) {
+      if (!items_.try_acquire()) {
+         return false;
+      }
+      out = take();
+      spaces_.release();
+      return true;
+   }
+
+   //! Like try_receive, but wait until deadline for a value.
+   bool receive_until(T &out,
+                      ::std::chrono::steady_clock::time_point deadline) {
+      if (!items_.acquire_until(deadline)) {
+         return false;
+      }
+      out = take();
+      spaces_.release();
+      return true;
+   }
+
+   //! Like receive_until, but with a timeout instead.
+   template <class Rep, class Period>
+   bool receive_for(T &out,
+                    const ::std::chrono::duration<Rep, Period> &timeout) {
+      return receive_until(
+         out, ::std::chrono::steady_clock::now() +
+         ::std::chrono::duration_cast< ::std::chrono::steady_clock::duration>(
+            timeout));
+   }
+
+   /*! \brief Move up to max values into buffer, oldest first.
+    *
+    * \param[out] buffer Where to put the values, by assignment.
+    * \param[in]  max    How many values buffer has room for.
+    * \param[in]  block  Wait until there's at least one value.
+    * \return How many values were received.
+    */
+   ::std::size_t receive_batch(T *buffer, ::std::size_t max, bool block) {
+      if (max == 0) {
+         return 0;
+      }
+      const unsigned int limit =
+         static_cast<unsigned int>((max > UINT_MAX) ? UINT_MAX : max);
+      unsigned int count = items_.try_acquire_up_to(limit);
+      if ((count == 0) && block) {
+         items_.acquire();
+         count = 1 + items_.try_acquire_up_to(limit - 1);
+      }
+      for (unsigned int i = 0; i < count; ++i) {
+         buffer[i] = take();
+      }
+      if (count > 0) {
+         spaces_.release(count);
+      }
+      return count;
+   }
+
+ private:
+   struct slot {
+      slot() : full_(false) {}
+
+      T *value() { return ::std::launder(reinterpret_cast<T *>(storage_)); }
+
+      ::std::atomic<bool> full_;
+      alignas(T) unsigned char storage_[sizeof(T)];
+   };
+
+   // The receiver's side.
+   alignas(priv::cache_line_size) ::std::size_t head_;
+   // The senders' side.
+   alignas(priv::cache_line_size) ::std::atomic< ::std::size_t> tail_;
+   // Shared, but never written after construction.
+   alignas(priv::cache_line_size) const ::std::size_t mask_;
+   const priv::numa_array<slot> slots_;
+   semaphore items_;
+   semaphore spaces_;
+
+   //! Fill the next slot. The caller has already claimed a space for it.
+   void put(T &&value) {
+      // Since the receiver empties slots in order, having a space means this
+      // slot has been emptied, even if the space freed up was another one.
+      slot &s = slots_[tail_.fetch_add(1, ::std::memory_order_relaxed) & mask_];
+      new (s.storage_) T(::std::move(value));
+      s.full_.store(true, ::std::memory_order_release);
+      items_.release();
+   }
+
+   /*! \brief Empty the next slot. The caller has already claimed a value.
+    *
+    * The value counted may be in a later slot, if a sender that claimed this
+    * one hasn't filled it yet. In that case, wait for it.
+    */
+   T take() {
+      slot &s = slots_[head_ & mask_];
+      while (!s.full_.load(::std::memory_order_acquire)) {
+         ::std::this_thread::yield();
+      }
+      T * const value = s.value();
+      T result(::std::move(*value));
+      value->~T();
+      s.full_.store(false, ::std::memory_order_relaxed);
+      ++head_;
+      return result;
+   }
+
+   static ::std::size_t round_up(::std::size_t capacity) {
+      if ((capacity == 0) || (capacity > (::std::size_t(1) << 30))) {
+         throw ::std::invalid_argument("A channel's capacity must be from 1 "
+                                       "to 2^30.");
+      }
+      ::std::size_t size = 1;
+      while (size < capacity) {
+         size <<= 1;
+      }
+      return size;
+   }
+};
+
+} // namespace sparkles
@@ -0,0 +1,166 @@
+#pragma once
+
+#include <sparkles/mpsc_queue.hpp>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <type_traits>
+#include <vector>
+
+namespace sparkles {
+namespace priv {
+
+/*! \brief A work stealing deque of pointers, after Chase and Lev.
+ *
+ * The thread that owns the deque pushes and pops at the bottom, last in, first
+ * out, and any number of other threads steal from the top, first in, first
+ * out. The owner's pop only contends with thieves when there's one item left,
+ * and a push only has to look at the top to see whether the array needs to
+ * grow.
+ *
+ * The memory ordering is the one from "Correct and Efficient Work-Stealing for
+ * Weak Memory Models" by Lê, Pop, Cohen and Zappa Nardelli.
+ *
+ * The array doubles when it's full. A thief may still be reading the old one,
+ * so old arrays are kept until the deque is destroyed. Since each is half the
+ * size of the next, that's never more than the current array's worth.
+ *
+ * Destroying the deque doesn't do anything with the pointers still in it.
+ */
+template <class T>
+class chase_lev_deque {
+   static_assert(::std::is_pointer<T>::value,
+                 "A chase_lev_deque only holds pointers.");
+ public:
+   //! Make a deque with room for at least capacity items before it grows.
+   explicit chase_lev_deque(::std::size_t capacity = 256)
+        : top_(0), bottom_(0), array_(nullptr)
+   {
+      ::std::size_t size = 2;
+      while (size < capacity) {
+         size <<= 1;
+      }
+      arrays_.emplace_back(new array(size));
+      array_.store(arrays_.back().get(), ::std::memory_order_relaxed);
+   }
+   chase_lev_deque(const chase_lev_deque &) = delete;
+   chase_lev_deque &operator =(const chase_lev_deque &) = delete;
+
+   //! Add an item at the bottom. Only the owner may call this.
+   void push(T item) {
+      const ::std::int64_t bottom = bottom_.load(::std::memory_order_relaxed);
+      const ::std::int64_t top = top_.load(::std::memory_order_acquire);
+      array *a = array_.load(::std::memory_order_relaxed);
+      if (bottom - top > static_cast< ::std::int64_t>(a->mask_)) {
+         a = grow(a, top, bottom);
+      }
+      a->put(bottom, item);
+      // The paper has a release fence and a relaxed store. A release store
+      // orders the same things here, and race detectors understand it.
+      bottom_.store(bottom + 1, ::std::memory_order_release);
+   }
+
+   /*! \brief Take the item at the bottom, the newest one, or nullptr if it's
+    * empty. Only the owner may call this.
+    */
+   T pop() {
+      const ::std::int64_t bottom =
+         bottom_.load(::std::memory_order_relaxed) - 1;
+      array * const a = array_.load(::std::memory_order_relaxed);
+      bottom_.store(bottom, ::std::memory_order_relaxed);
+      ::std::atomic_thread_fence(::std::memory_order_seq_cst);
+      ::std::int64_t top = top_.load(::std::memory_order_relaxed);
+      if (top > bottom) {
+         bottom_.store(bottom + 1, ::std::memory_order_relaxed);
+         return nullptr;
+      }
+      T item = a->get(bottom);
+      if (top == bottom) {
+         // The last item, which a thief may be after too.
+         if (!top_.compare_exchange_strong(top, top + 1,
+                                           ::std::memory_order_seq_cst,
+                                           ::std::memory_order_relaxed))
+         {
+            item = nullptr;
+         }
+         bottom_.store(bottom + 1, ::std::memory_order_relaxed);
+      }
+      return item;
+   }
+
+   /*! \brief Take the item at the top, the oldest one. Any thread may call
+    * this.
+    *
+    * Returns nullptr if the deque is empty, or if another thread took the item
+    * first.
+    */
+   T steal() {
+      ::std::int64_t top = top_.load(::std::memory_order_acquire);
+      ::std::atomic_thread_fence(::std::memory_order_seq_cst);
+      const ::std::int64_t bottom = bottom_.load(::std::memory_order_acquire);
+      if (top >= bottom) {
+         return nullptr;
+      }
+      array * const a = array_.load(::std::memory_order_acquire);
+      T item = a->get(top);
+      if (!top_.compare_exchange_strong(top, top + 1,
+                                        ::std::memory_order_seq_cst,
+                                        ::std::memory_order_relaxed))
+      {
+         return nullptr;
+      }
+      return item;
+   }
+
+   //! Does the deque look empty? Only a hint unless called by the owner.
+   bool empty() const { return size() == 0; }
+
+   //! About how many items there are. Only a hint unless called by the owner.
+   ::std::size_t size() const {
+      const ::std::int64_t bottom = bottom_.load(::std::memory_order_relaxed);
+      const ::std::int64_t top = top_.load(::std::memory_order_relaxed);
+      return (bottom > top) ? static_cast< ::std::size_t>(bottom - top) : 0;
+   }
+
+ private:
+   struct array {
+      explicit array(::std::size_t size)
+           : mask_(size - 1), slots_(new ::std::atomic<T>[size])
+      {
+      }
+
+      T get(::std::int64_t i) const {
+         return slots_[static_cast< ::std::size_t>(i) & mask_].load(
+            ::std::memory_order_relaxed);
+      }
+      void put(::std::int64_t i, T item) {
+         slots_[static_cast< ::std::size_t>(i) & mask_].store(
+            item, ::std::memory_order_relaxed);
+      }
+
+      const ::std::size_t mask_;
+      const ::std::unique_ptr< ::std::atomic<T>[]> slots_;
+   };
+
+   // The thieves' side.
+   alignas(cache_line_size) ::std::atomic< ::std::int64_t> top_;
+   // The owner's side.
+   alignas(cache_line_size) ::std::atomic< ::std::int64_t> bottom_;
+   ::std::atomic<array *> array_;
+   //! Every array there's been, the current one last. Owner only.
+   ::std::vector< ::std::unique_ptr<array> > arrays_;
+
+   array *grow(array *old, ::std::int64_t top, ::std::int64_t bottom) {
+      arrays_.emplace_back(new array((old->mask_ + 1) * 2));
+      array * const bigger = arrays_.back().get();
+      for (::std::int64_t i = top; i < bottom; ++i) {
+         bigger->put(i, old->get(i));
+      }
+      array_.store(bigger, ::std::memory_order_release);
+      return bigger;
+   }
+};
+
+} // namespace priv
+} // namespace sparkles
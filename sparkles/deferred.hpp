@@ -6,6 +6,7 @@
 #include <array>
 #include <vector>
 #include <iterator>
+#include <sparkles/forward_decls.hpp>
 #include <sparkles/operation.hpp>
 #include <sparkles/operation_base.hpp>
 #include <cstddef>
@@ -14,6 +15,51 @@ namespace sparkles {
 
 namespace priv {
 
+/*! \brief Where a deferred function is called when it isn't called inline.
+ *
+ * The call is posted to pool, and its result is delivered to answerq, which
+ * must be the queue of the thread the deferred operation belongs to.
+ */
+struct offload_target {
+   thread_pool *pool;
+   work_queue *answerq;
+};
+
+//! The target of the innermost parallel_graph on this thread, if any.
+extern thread_local const offload_target *current_offload_target;
+
+//! A call on its way to a thread_pool, with room for its result.
+class offload_job {
+ public:
+   virtual ~offload_job() = default;
+   //! Make the call, on the pool thread.
+   virtual void run() = 0;
+};
+
+/*! \brief Takes an offload_job to a thread_pool and says when it's back.
+ *
+ * done() is a remote_operation<void> for the answer queue, made up front so it
+ * can be a dependency from the start. post sends the job to the pool with its
+ * promise, and the job is skipped if nobody wants done() any more. It's
+ * defined in deferred.cpp, so this header doesn't need the pool or the queue.
+ */
+class offload_link {
+ public:
+   explicit offload_link(const offload_target &target);
+   offload_link(const offload_link &) = delete;
+   const offload_link &operator =(const offload_link &) = delete;
+   ~offload_link();
+
+   const operation<void>::ptr_t &done() const { return done_; }
+   void post(::std::shared_ptr<offload_job> job);
+
+ private:
+   thread_pool * const pool_;
+   operation<void>::ptr_t done_;
+   //! The remote_operation<void>::promise for done_.
+   ::std::shared_ptr<void> promise_;
+};
+
 template <typename T>
 struct is_op_ptr {
  private:
@@ -135,8 +181,23 @@ class suspended_call_base {
    typedef ::std::vector<opbase_ptr_t> deplist_t;
    typedef op_result<ResultType> op_result_t;
 
+   //! A call with its arguments already unwrapped, that can be made anywhere.
+   class bound_call {
+    public:
+      virtual ~bound_call() noexcept(true) = default;
+      //! Make the call (can only be called once).
+      virtual op_result_t operator()() = 0;
+   };
+   typedef ::std::unique_ptr<bound_call> bound_call_ptr_t;
+
    //! Call the suspended function (can only be called once).
    virtual op_result_t operator()() = 0;
+   /*! \brief Unwrap the arguments now for a call that's made later, maybe on
+    * another thread (can only be called once, instead of operator ()()).
+    *
+    * Throws whatever unwrapping an argument throws.
+    */
+   virtual bound_call_ptr_t bind() = 0;
    //! Fetch a dependency list based on the function argument list.
    virtual deplist_t fetch_deplist() const = 0;
    //! Throw if the given arg that's just finished throws.
@@ -164,6 +225,68 @@ class suspended_call_base {
    };
 };
 
+//! The tuple of plain argument values for a tuple of wrapped_types.
+template <typename TupleT>
+struct unwrapped_tuple;
+
+template <typename... WrappedTypes>
+struct unwrapped_tuple< ::std::tuple<WrappedTypes...> > {
+   typedef ::std::tuple<
+      typename ::std::decay<typename WrappedTypes::orig_type>::type...> type;
+};
+
+//! A suspended_call's function and its unwrapped arguments.
+template <typename ResultType, typename FuncT, typename ValuesT>
+class bound_call_impl : public suspended_call_base<ResultType>::bound_call {
+ public:
+   typedef typename suspended_call_base<ResultType>::op_result_t op_result_t;
+
+   bound_call_impl(FuncT func, ValuesT values)
+        : func_(::std::move(func)), values_(::std::move(values))
+   {
+   }
+
+   // The values are moved into the function, so this can only be called once.
+   op_result_t operator()() override {
+      typedef ::std::make_index_sequence< ::std::tuple_size<ValuesT>::value>
+         indices_t;
+      return call(indices_t());
+   }
+
+ private:
+   FuncT func_;
+   ValuesT values_;
+
+   template < ::std::size_t... I, typename U = ResultType>
+   typename ::std::enable_if< ::std::is_same<U, ResultType>::value
+                              && !::std::is_void<ResultType>::value,
+                              op_result_t>::type
+   call(::std::index_sequence<I...>) {
+      op_result_t result;
+      try {
+         result.set_result(func_(::std::move(::std::get<I>(values_))...));
+      } catch (...) {
+         result.set_bad_result(::std::current_exception());
+      }
+      return result;
+   }
+
+   template < ::std::size_t... I, typename U = ResultType>
+   typename ::std::enable_if< ::std::is_same<U, ResultType>::value
+                              && ::std::is_void<ResultType>::value,
+                              op_result_t>::type
+   call(::std::index_sequence<I...>) {
+      op_result_t result;
+      try {
+         func_(::std::move(::std::get<I>(values_))...);
+         result.set_result();
+      } catch (...) {
+         result.set_bad_result(::std::current_exception());
+      }
+      return result;
+   }
+};
+
 template <typename ResultType, typename FuncT, typename TupleT>
 class suspended_call : public suspended_call_base<ResultType> {
  public:
@@ -171,6 +294,8 @@ class suspended_call : public suspended_call_base<ResultType> {
    typedef typename suspended_call_base<ResultType>::op_result_t op_result_t;
    typedef typename suspended_call_base<ResultType>::deplist_t deplist_t;
    typedef typename suspended_call_base<ResultType>::opbase_ptr_t opbase_ptr_t;
+   typedef typename suspended_call_base<ResultType>::bound_call_ptr_t
+      bound_call_ptr_t;
 
    explicit suspended_call(FuncT func, TupleT args)
         : func_(::std::move(func)), args_(::std::move(args))
@@ -184,6 +309,10 @@ class suspended_call : public suspended_call_base<ResultType> {
       typedef call_helper< ::std::tuple_size<TupleT>::value> helper_t;
       return ::std::move(helper_t::engage(func_, args_));
    }
+   // Like operator ()(), this gives away the function.
+   bound_call_ptr_t bind() override {
+      return bind(::std::make_index_sequence<num_args>());
+   }
    deplist_t fetch_deplist() const override
    {
       typedef typename suspended_call_base<ResultType>::dep_vector_populator
@@ -202,9 +331,19 @@ class suspended_call : public suspended_call_base<ResultType> {
    }
 
  private:
+   typedef typename unwrapped_tuple<TupleT>::type values_t;
+   typedef bound_call_impl<ResultType, FuncT, values_t> bound_t;
+
    FuncT func_;
    TupleT args_;
 
+   template < ::std::size_t... I>
+   bound_call_ptr_t bind(::std::index_sequence<I...>) {
+      return bound_call_ptr_t(
+         new bound_t(::std::move(func_),
+                     values_t(::std::get<I>(args_).unwrap()...)));
+   }
+
    template <unsigned int N, unsigned int... I>
    struct call_helper {
       static op_result_t engage(FuncT &func, TupleT &args) {
@@ -252,6 +391,14 @@ class suspended_call : public suspended_call_base<ResultType> {
    };
 };
 
+/*! \brief The operation for a deferred function call.
+ *
+ * If it's given an offload_target, the call is made on the target's pool
+ * instead of inline. Dependencies can't be added later, so the offload_link
+ * the call comes back through is made up front and its done() operation is
+ * one of the dependencies from the start. The call goes to the pool once the
+ * arguments are ready.
+ */
 template <typename ResultType>
 class op_deferred_func : public operation<ResultType>
 {
@@ -268,51 +415,107 @@ class op_deferred_func : public operation<ResultType>
    op_deferred_func(const this_is_private &,
                     ::std::unique_ptr<suspended_call_t> amber,
                     InputIterator dependencies_begin,
-                    const InputIterator &dependencies_end)
+                    const InputIterator &dependencies_end,
+                    ::std::unique_ptr<offload_link> link)
         : operation<ResultType>(dependencies_begin, dependencies_end),
-          amber_(::std::move(amber))
+          amber_(::std::move(amber)), link_(::std::move(link))
    {
    }
 
-   static ptr_t create(::std::unique_ptr<suspended_call_t> amber)
+   /*! \brief Make the operation for amber, called inline if target is
+    * nullptr, or on target's pool if it isn't.
+    */
+   static ptr_t create(::std::unique_ptr<suspended_call_t> amber,
+                       const offload_target *target = nullptr)
    {
       typedef op_deferred_func<ResultType> me_t;
       typedef typename suspended_call_t::deplist_t deplist_t;
       deplist_t deplist{ ::std::move(amber->fetch_deplist()) };
+      ::std::unique_ptr<offload_link> link;
+      if ((target != nullptr) && !deplist.empty()) {
+         link.reset(new offload_link(*target));
+         deplist.push_back(link->done());
+      }
       ptr_t newdeferred{
          ::std::make_shared<me_t>(this_is_private{}, ::std::move(amber),
-                                  deplist.begin(), deplist.end())
+                                  deplist.begin(), deplist.end(),
+                                  ::std::move(link))
             };
       me_t::register_as_dependent(newdeferred);
       return ::std::move(newdeferred);
    }
 
  private:
+   //! The call on its way to the pool, and its result once it's been made.
+   class job : public offload_job {
+    public:
+      explicit job(typename suspended_call_t::bound_call_ptr_t call)
+           : call_(::std::move(call))
+      {
+      }
+
+      void run() override {
+         result_ = (*call_)();
+         call_.reset();
+      }
+
+      op_result<ResultType> result_;
+
+    private:
+      typename suspended_call_t::bound_call_ptr_t call_;
+   };
+
    ::std::unique_ptr<suspended_call_t> amber_;
+   //! How an offloaded call gets to the pool and back, or nullptr.
+   ::std::unique_ptr<offload_link> link_;
+   ::std::shared_ptr<job> job_;
 
    virtual void i_dependency_finished(const opbase_ptr_t &dep) {
-      if (!this->finished()) {
-         try {
-            // This will throw if the newly finished dependency would throw.
-            amber_->test_arg_throw(dep);
-            // No throwing happend, are any dependencies left unfinished?
-            if (
-               this->find_dependency_if([](const opbase_ptr_t &dep) {
-                     return !dep->finished();
-                  }) == nullptr
-               )
-            {
-               // If there are no unfinished depencies.
+      if (this->finished()) {
+         return;
+      } else if ((link_ != nullptr) && (dep == link_->done())) {
+         // The offloaded call is back, or the pool dropped it.
+         const op_result<void> done{link_->done()->raw_result()};
+         link_.reset();
+         if (done.is_exception()) {
+            this->set_bad_result(done.exception());
+         } else if (done.is_error()) {
+            this->set_bad_result(done.error());
+         } else {
+            this->set_raw_result(::std::move(job_->result_));
+         }
+         job_.reset();
+         return;
+      }
+      try {
+         // This will throw if the newly finished dependency would throw.
+         amber_->test_arg_throw(dep);
+         // No throwing happend, are any dependencies left unfinished?
+         const opbase_ptr_t done{link_ ? link_->done() : nullptr};
+         if (
+            this->find_dependency_if([&done](const opbase_ptr_t &dep) {
+                  return (dep != done) && !dep->finished();
+               }) == nullptr
+            )
+         {
+            // If there are no unfinished depencies.
+            if (link_ != nullptr) {
+               job_ = ::std::make_shared<job>(amber_->bind());
+               link_->post(job_);
+            } else {
                this->set_raw_result((*amber_)());
-               // The suspended call is no longer needed after it's called.
-               amber_.reset();
             }
-         } catch (...) {
-            this->set_bad_result(::std::current_exception());
-            // If an exception happened during argument evaluation, the
-            // suspended call will never be called.
+            // The suspended call is no longer needed after it's called.
             amber_.reset();
          }
+      } catch (...) {
+         this->set_bad_result(::std::current_exception());
+         // If an exception happened during argument evaluation, the
+         // suspended call will never be called. The link lets go of its
+         // remote_operation first, so the promise isn't broken noisily.
+         amber_.reset();
+         link_.reset();
+         job_.reset();
       }
    }
 };
@@ -328,10 +531,30 @@ class deferred {
    typedef ::std::function<ResultType(ArgTypes...)> wrapped_func_t;
 
    explicit deferred(const wrapped_func_t &func)
-        : func_(func)
+        : func_(func), target_{nullptr, nullptr}
    {
    }
 
+   /*! \brief Call the function on one of pool's threads instead of inline,
+    * whether or not there's a parallel_graph (see deferred_pool.hpp).
+    *
+    * answerq must be the queue of the thread that calls until(), and it and
+    * the pool must outlive the operation until() returns. When the arguments
+    * are ready they're unwrapped on that thread, and the values are moved to
+    * the pool thread with the function, not copied again. The result comes
+    * back to answerq, and the operation finishes when that thread's
+    * event_loop runs the delivery, so that thread never waits on the pool:
+    *
+    * \code
+    * auto parsed = defer(parse).on(pool, loop.queue()).until(bytes);
+    * \endcode
+    */
+   deferred on(thread_pool &pool, work_queue &answerq) const {
+      static_assert(offloadable, "A function that takes operations can't be "
+                    "called on another thread, since they belong to this one.");
+      return deferred(func_, offload_target{&pool, &answerq});
+   }
+
    operation_t until(typename wrapped_type<ArgTypes>::type... args) {
       typedef ::std::tuple<wrapped_type<ArgTypes>...> argtuple_t;
       typedef suspended_call<ResultType, wrapped_func_t, argtuple_t> suspcall_t;
@@ -340,11 +563,32 @@ class deferred {
          new suspcall_t(func_, ::std::move(saved_args))
             };
 
-      return op_deferred_func<ResultType>::create(::std::move(amber));
+      return op_deferred_func<ResultType>::create(::std::move(amber),
+                                                  target());
    }
 
  private:
+   //! Operations belong to their thread, so they can't be passed to another.
+   static constexpr bool offloadable =
+      !(wrapped_type<ArgTypes>::passthrough || ...);
+
    const wrapped_func_t func_;
+   //! Where on() said to call it, if it did.
+   const offload_target target_;
+
+   deferred(const wrapped_func_t &func, const offload_target &target)
+        : func_(func), target_(target)
+   {
+   }
+
+   //! Where to call it: where on() said, or the parallel_graph, or inline.
+   const offload_target *target() const {
+      if (target_.pool != nullptr) {
+         return &target_;
+      } else {
+         return offloadable ? current_offload_target : nullptr;
+      }
+   }
 };
 
 } // namespace priv
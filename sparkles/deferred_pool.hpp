@@ -0,0 +1,58 @@
+#pragma once
+
+#include <sparkles/deferred.hpp>
+#include <sparkles/thread_pool.hpp>
+#include <sparkles/work_queue.hpp>
+
+namespace sparkles {
+
+/*! \brief While one of these exists, the deferred operations made on this
+ * thread run their functions on a thread_pool.
+ *
+ * Normally a deferred function is called inline, by whatever set_finished
+ * call made its last argument ready, so a wide graph of them is evaluated one
+ * node at a time. Inside a parallel_graph, each node whose arguments are ready
+ * has its arguments unwrapped on this thread and the call posted to the pool
+ * as a task. The result comes back through answerq like the result of a
+ * remote_operation, and the node finishes when this thread's event_loop runs
+ * the delivery. So independent branches of the graph run at the same time,
+ * and nothing about the graph has to change:
+ *
+ * \code
+ * thread_pool pool;
+ * {
+ *    parallel_graph parallel(pool, loop.queue());
+ *    auto left = defer(crunch).until(left_input);
+ *    auto right = defer(crunch).until(right_input);
+ *    total = defer(add).until(left, right);
+ * }
+ * loop.run_until(total);
+ * \endcode
+ *
+ * What counts is whether a parallel_graph existed when the node was made, not
+ * when it's run. answerq must be a queue this thread runs, and it and the pool
+ * must outlive the nodes. Functions that take operations as arguments are
+ * always called inline, since operations belong to their thread.
+ *
+ * They nest, and the innermost one is the one that counts.
+ */
+class parallel_graph {
+ public:
+   parallel_graph(thread_pool &pool, work_queue &answerq);
+   parallel_graph(const parallel_graph &) = delete;
+   parallel_graph(parallel_graph &&) = delete;
+   const parallel_graph &operator =(const parallel_graph &) = delete;
+   const parallel_graph &operator =(parallel_graph &&) = delete;
+   ~parallel_graph();
+
+   //! Where the innermost parallel_graph on this thread runs things, if any.
+   static const priv::offload_target *current() {
+      return priv::current_offload_target;
+   }
+
+ private:
+   const priv::offload_target target_;
+   const priv::offload_target * const outer_;
+};
+
+} // namespace sparkles
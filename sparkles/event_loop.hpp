@@ -0,0 +1,131 @@
+#pragma once
+
+#include <sparkles/operation_base.hpp>
+#include <sparkles/timer_wheel.hpp>
+#include <sparkles/work_queue.hpp>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+
+namespace sparkles {
+
+/*! \brief Runs the items from a work_queue until there's a reason to stop.
+ *
+ * This is the usual way for the thread that owns a work_queue to wait for a
+ * remote_operation to finish, since the operation finishes when the work
+ * item that delivers its result is run:
+ *
+ * \code
+ * auto opandpromise = remote_operation<int>::create(loop.queue());
+ * // Hand the promise to another thread...
+ * loop.run_until(opandpromise.first);
+ * \endcode
+ *
+ * The loop also owns a timer_wheel, timers(), for timer_operations and
+ * anything else that should happen at a particular time on the loop's
+ * thread. Timers run from the run functions too, in between items.
+ *
+ * Every run function blocks in the queue when there's nothing to run, it never
+ * spins, and waits no longer than the next timer. They all return early if
+ * stop() is called, which is the only member function that may be called from
+ * another thread. Only one thread may run a
+ * given event_loop at a time, and it must be the only one reading from the
+ * queue unless the queue has multiple consumers.
+ *
+ * If an item throws, the exception propagates out of the run function and the
+ * loop may be run again afterwards.
+ */
+class event_loop {
+ public:
+   typedef operation_base::opbase_ptr_t opbase_ptr_t;
+   typedef ::std::chrono::steady_clock::time_point time_point;
+
+   /*! \brief Make a loop that runs items from wq, which must outlive it.
+    *
+    * Its timers() tick every timer_resolution.
+    */
+   explicit event_loop(work_queue &wq,
+                       timer_wheel::duration timer_resolution =
+                          ::std::chrono::milliseconds(1))
+        : queue_(wq), timers_(timer_resolution), stop_requested_(false)
+   {
+   }
+   event_loop(const event_loop &) = delete;
+   event_loop(event_loop &&) = delete;
+   const event_loop &operator =(const event_loop &) = delete;
+   const event_loop &operator =(event_loop &&) = delete;
+
+   //! The queue this loop runs.
+   work_queue &queue() const { return queue_; }
+
+   //! The timers this loop runs. Only for use on the loop's thread.
+   timer_wheel &timers() { return timers_; }
+
+   /*! \brief Run items until op is finished, or stop() is called.
+    *
+    * \return Whether op is finished.
+    */
+   bool run_until(const opbase_ptr_t &op);
+
+   /*! \brief Run items until op is finished, the deadline passes, or stop()
+    * is called.
+    *
+    * \return Whether op is finished.
+    */
+   bool run_until(const opbase_ptr_t &op, time_point deadline);
+
+   /*! \brief Run items until the deadline passes or stop() is called.
+    *
+    * \return How many items and timers were run.
+    */
+   ::std::size_t run_until(time_point deadline);
+
+   //! Like run_until(deadline), with a timeout instead.
+   template <class Rep, class Period>
+   ::std::size_t run_for(const ::std::chrono::duration<Rep, Period> &timeout) {
+      return run_until(deadline_after(timeout));
+   }
+
+   //! Like run_until(op, deadline), with a timeout instead.
+   template <class Rep, class Period>
+   bool run_for(const opbase_ptr_t &op,
+                const ::std::chrono::duration<Rep, Period> &timeout) {
+      return run_until(op, deadline_after(timeout));
+   }
+
+   /*! \brief Make the run function that's running return once the item it's
+    * running (if any) returns. Safe to call from any thread.
+    *
+    * If nothing is running, the next call to a run function returns right
+    * away. Each stop() stops one run.
+    */
+   void stop();
+
+ private:
+   work_queue &queue_;
+   timer_wheel timers_;
+   ::std::atomic<bool> stop_requested_;
+
+   /*! \brief Run any expired timers, or else one item, waiting no later than
+    * deadline or the next timer.
+    *
+    * \return How many things ran, 0 if the wait ended first.
+    */
+   ::std::size_t run_one(time_point deadline);
+
+   //! Has stop() been called? Clears the request if it has.
+   bool take_stop() {
+      return stop_requested_.load(::std::memory_order_relaxed) &&
+         stop_requested_.exchange(false, ::std::memory_order_acquire);
+   }
+
+   template <class Rep, class Period>
+   static time_point
+   deadline_after(const ::std::chrono::duration<Rep, Period> &timeout) {
+      return ::std::chrono::steady_clock::now() +
+         ::std::chrono::duration_cast< ::std::chrono::steady_clock::duration>(
+            timeout);
+   }
+};
+
+} // namespace sparkles
@@ -0,0 +1,115 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <climits>
+#include <cstdint>
+
+namespace sparkles {
+
+namespace priv {
+
+//! Tell the CPU we're in a spin loop so it can go easy on its sibling threads.
+inline void cpu_relax() noexcept
+{
+#if defined(__x86_64__) || defined(__i386__)
+   __builtin_ia32_pause();
+#elif defined(__aarch64__)
+   asm volatile("yield" ::: "memory");
+#endif
+}
+
+} // namespace priv
+
+/*! \brief Lets threads sleep until some condition they're checking changes,
+ * without costing the threads that change it anything if nobody's asleep.
+ *
+ * This is the waiting half of a condition variable with no mutex. A waiter
+ * does this:
+ *
+ * \code
+ * while (!condition()) {
+ *    auto key = ec.prepare_wait();
+ *    if (condition()) {
+ *       ec.cancel_wait();
+ *       break;
+ *    }
+ *    ec.wait(key);
+ * }
+ * \endcode
+ *
+ * And whoever makes the condition true calls notify_one() or notify_all()
+ * afterwards. If nobody is waiting, notifying is a fence and a load. The futex
+ * system call is only made when a waiter has actually gone to sleep (or is
+ * about to).
+ *
+ * This implementation is Linux specific because it uses futexes.
+ *
+ * \sa http://www.1024cores.net/home/lock-free-algorithms/eventcounts
+ */
+class eventcount {
+ public:
+   //! Identifies the moment a waiter checked its condition.
+   typedef ::std::uint32_t key_t;
+
+   eventcount() noexcept : epoch_(0), waiters_(0) {}
+   //! Can't be copy constructed.
+   eventcount(const eventcount &) = delete;
+   //! Can't be copy assigned.
+   eventcount &operator =(const eventcount &) = delete;
+
+   /*! \brief Announce an intention to wait. Must be followed by either
+    * cancel_wait() or one of the wait functions.
+    */
+   key_t prepare_wait() noexcept {
+      waiters_.fetch_add(1, ::std::memory_order_seq_cst);
+      const key_t key = epoch_.load(::std::memory_order_seq_cst);
+      // Pairs with the fence in notify(). A seq_cst RMW alone doesn't order
+      // the caller's relaxed recheck of its condition after it, so without
+      // this a weakly ordered CPU could miss the change and the notifier miss
+      // the waiter.
+      ::std::atomic_thread_fence(::std::memory_order_seq_cst);
+      return key;
+   }
+
+   //! The condition turned out to be true after prepare_wait, don't wait.
+   void cancel_wait() noexcept {
+      waiters_.fetch_sub(1, ::std::memory_order_seq_cst);
+   }
+
+   /*! \brief Sleep until someone notifies after the prepare_wait that returned
+    * key. May return early for no reason, so recheck the condition.
+    */
+   void wait(key_t key);
+
+   /*! \brief Like wait, but give up at deadline.
+    *
+    * \return false if deadline passed, true if woken (which may be
+    * spurious).
+    */
+   bool wait_until(key_t key, ::std::chrono::steady_clock::time_point deadline);
+
+   //! Wake up at most one waiting thread.
+   void notify_one() noexcept { notify(1); }
+   //! Wake up every waiting thread.
+   void notify_all() noexcept { notify(INT_MAX); }
+
+   //! Wake up at most count waiting threads.
+   void notify(unsigned int count) noexcept {
+      // Pairs with the fence in prepare_wait. Either the waiter sees the
+      // change to its condition, or this sees the waiter.
+      ::std::atomic_thread_fence(::std::memory_order_seq_cst);
+      if (waiters_.load(::std::memory_order_relaxed) != 0) {
+         epoch_.fetch_add(1, ::std::memory_order_seq_cst);
+         wake(count);
+      }
+   }
+
+ private:
+   ::std::atomic< ::std::uint32_t> epoch_;
+   ::std::atomic< ::std::uint32_t> waiters_;
+
+   void wake(unsigned int count) noexcept;
+};
+
+} // namespace sparkles
@@ -1,5 +1,7 @@
 #pragma once
 
+#include <cstddef>
+
 /*! \brief The namespace for the Sparkles library.
  *
  * This library is intended to implement a way to have one asynchronous result
@@ -17,10 +19,30 @@ namespace priv {
 
 class operation_base;
 
+class eventcount;
+
 class semaphore;
 
 class work_queue;
 
+class queue_set;
+
+class timer_wheel;
+
+class timer_operation;
+
+class topology;
+
+class worker_thread;
+
+class thread_pool;
+
+template <class T>
+class channel;
+
+template <typename Signature, ::std::size_t Capacity, ::std::size_t Alignment>
+class inplace_function;
+
 template <typename T>
 class op_result;
 
@@ -0,0 +1,221 @@
+#pragma once
+
+#include <cstddef>
+#include <functional>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+namespace sparkles {
+
+namespace priv {
+
+/*! \brief The operations an inplace_function needs for whatever it holds.
+ *
+ * There's one of these for each type of callable held inline, and one for each
+ * type of callable that's too big and has to be held on the heap.
+ */
+template <typename R, typename... Args>
+struct inplace_function_ops {
+   //! Call the callable stored at storage.
+   R (*invoke)(void *storage, Args &&... args);
+   //! Move construct into dest from src, then destroy src.
+   void (*relocate)(void *dest, void *src) noexcept;
+   //! Destroy the callable stored at storage.
+   void (*destroy)(void *storage) noexcept;
+};
+
+} // namespace priv
+
+template <typename Signature,
+          ::std::size_t Capacity = 12 * sizeof(void *),
+          ::std::size_t Alignment = alignof(::std::max_align_t)>
+class inplace_function;
+
+/*! \brief A move-only replacement for ::std::function that keeps callables of
+ * up to Capacity bytes inside itself instead of on the heap.
+ *
+ * ::std::function requires what it holds to be copyable and only has room for
+ * a couple of pointers before it allocates. That's fine for most things, but
+ * it means every result sent back through a work_queue costs a trip to the
+ * allocator, and that the result can't be something move-only.
+ *
+ * This holds any callable that fits in Capacity bytes, has an alignment of no
+ * more than Alignment and can be moved without throwing directly in its own
+ * storage. Anything else is moved to the heap, so it's always possible to store
+ * a callable, it's just slower if it doesn't fit. Use fits_inline to check.
+ *
+ * Like ::std::function, calling an empty one throws ::std::bad_function_call
+ * and operator () is const even though the callable it calls may not be.
+ */
+template <typename R, typename... Args,
+          ::std::size_t Capacity, ::std::size_t Alignment>
+class inplace_function<R(Args...), Capacity, Alignment> {
+   typedef priv::inplace_function_ops<R, Args...> ops_t;
+
+ public:
+   typedef R result_type;
+
+   //! Can F be held without allocating?
+   template <class F>
+   static constexpr bool fits_inline =
+      (sizeof(F) <= Capacity) && (alignof(F) <= Alignment) &&
+      (Alignment % alignof(F) == 0) &&
+      ::std::is_nothrow_move_constructible<F>::value;
+
+   //! Construct an empty inplace_function.
+   inplace_function() noexcept : ops_(nullptr) {}
+   //! Construct an empty inplace_function.
+   inplace_function(::std::nullptr_t) noexcept : ops_(nullptr) {}
+
+   //! Construct from any callable with a compatible signature.
+   template <class F,
+             class D = typename ::std::decay<F>::type,
+             class = typename ::std::enable_if<
+                !::std::is_same<D, inplace_function>::value &&
+                ::std::is_invocable_r<R, D &, Args...>::value>::type>
+   inplace_function(F &&f) : ops_(nullptr) {
+      emplace<D>(::std::forward<F>(f));
+   }
+
+   //! Can't be copied, the whole point is to allow move-only callables.
+   inplace_function(const inplace_function &) = delete;
+   //! Can't be copied, the whole point is to allow move-only callables.
+   inplace_function &operator =(const inplace_function &) = delete;
+
+   //! The moved from inplace_function is left empty.
+   inplace_function(inplace_function &&other) noexcept : ops_(other.ops_) {
+      if (ops_ != nullptr) {
+         ops_->relocate(&storage_, &other.storage_);
+         other.ops_ = nullptr;
+      }
+   }
+
+   //! The moved from inplace_function is left empty.
+   inplace_function &operator =(inplace_function &&other) noexcept {
+      if (this != &other) {
+         reset();
+         if (other.ops_ != nullptr) {
+            other.ops_->relocate(&storage_, &other.storage_);
+            ops_ = other.ops_;
+            other.ops_ = nullptr;
+         }
+      }
+      return *this;
+   }
+
+   //! Destroy whatever is held, leaving this empty.
+   inplace_function &operator =(::std::nullptr_t) noexcept {
+      reset();
+      return *this;
+   }
+
+   //! Replace whatever is held with f.
+   template <class F,
+             class D = typename ::std::decay<F>::type,
+             class = typename ::std::enable_if<
+                !::std::is_same<D, inplace_function>::value &&
+                ::std::is_invocable_r<R, D &, Args...>::value>::type>
+   inplace_function &operator =(F &&f) {
+      reset();
+      emplace<D>(::std::forward<F>(f));
+      return *this;
+   }
+
+   ~inplace_function() { reset(); }
+
+   //! Does this hold a callable?
+   explicit operator bool() const noexcept { return ops_ != nullptr; }
+
+   //! Call the held callable, or throw ::std::bad_function_call if empty.
+   R operator ()(Args... args) const {
+      if (ops_ == nullptr) {
+         throw ::std::bad_function_call();
+      }
+      return ops_->invoke(&storage_, ::std::forward<Args>(args)...);
+   }
+
+   //! Exchange callables with other.
+   void swap(inplace_function &other) noexcept {
+      inplace_function tmp(::std::move(other));
+      other = ::std::move(*this);
+      *this = ::std::move(tmp);
+   }
+
+ private:
+   //! Operations for a callable stored directly in storage_.
+   template <class F>
+   struct inline_ops {
+      static R invoke(void *storage, Args &&... args) {
+         return (*static_cast<F *>(storage))(::std::forward<Args>(args)...);
+      }
+      static void relocate(void *dest, void *src) noexcept {
+         F &srcf = *static_cast<F *>(src);
+         new (dest) F(::std::move(srcf));
+         srcf.~F();
+      }
+      static void destroy(void *storage) noexcept {
+         static_cast<F *>(storage)->~F();
+      }
+      static constexpr ops_t ops{&invoke, &relocate, &destroy};
+   };
+
+   //! Operations for a callable on the heap with a pointer in storage_.
+   template <class F>
+   struct heap_ops {
+      static R invoke(void *storage, Args &&... args) {
+         return (**static_cast<F **>(storage))(::std::forward<Args>(args)...);
+      }
+      static void relocate(void *dest, void *src) noexcept {
+         new (dest) F *(*static_cast<F **>(src));
+      }
+      static void destroy(void *storage) noexcept {
+         delete *static_cast<F **>(storage);
+      }
+      static constexpr ops_t ops{&invoke, &relocate, &destroy};
+   };
+
+   const ops_t *ops_;
+   mutable typename ::std::aligned_storage<Capacity, Alignment>::type storage_;
+
+   static_assert(Capacity >= sizeof(void *),
+                 "Capacity must at least be big enough to hold a pointer.");
+   static_assert(Alignment >= alignof(void *),
+                 "Alignment must at least be enough for a pointer.");
+
+   template <class D, class F>
+   void emplace(F &&f) {
+      if constexpr (::std::is_pointer<D>::value ||
+                    ::std::is_member_pointer<D>::value) {
+         // Like ::std::function, a null function pointer makes an empty
+         // inplace_function.
+         if (f == nullptr) {
+            return;
+         }
+      }
+      if constexpr (fits_inline<D>) {
+         new (&storage_) D(::std::forward<F>(f));
+         ops_ = &inline_ops<D>::ops;
+      } else {
+         new (&storage_) D *(new D(::std::forward<F>(f)));
+         ops_ = &heap_ops<D>::ops;
+      }
+   }
+
+   void reset() noexcept {
+      if (ops_ != nullptr) {
+         ops_->destroy(&storage_);
+         ops_ = nullptr;
+      }
+   }
+};
+
+//! Exchange the callables held by two inplace_functions.
+template <typename Signature, ::std::size_t Capacity, ::std::size_t Alignment>
+void swap(inplace_function<Signature, Capacity, Alignment> &a,
+          inplace_function<Signature, Capacity, Alignment> &b) noexcept
+{
+   a.swap(b);
+}
+
+} // namespace sparkles
@@ -0,0 +1,127 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <vector>
+
+namespace sparkles {
+
+/*! \brief A histogram of non-negative integers with buckets whose width grows
+ * with the value, like an HdrHistogram.
+ *
+ * Values below 16 get a bucket each. Above that every power of two is split
+ * into 16 buckets, so any value is reported to within about 6% of what it
+ * really was, whether it's a few nanoseconds or several minutes. There are a
+ * fixed number of buckets, so recording never allocates.
+ *
+ * Any number of threads may record at once, each record is a couple of relaxed
+ * atomic operations. A snapshot taken while others are recording is not
+ * necessarily consistent, but every value it counts was really recorded.
+ */
+class latency_histogram {
+ public:
+   //! log2 of the number of buckets for each power of two.
+   static constexpr unsigned int sub_bucket_bits = 4;
+   static constexpr unsigned int sub_buckets = 1U << sub_bucket_bits;
+   static constexpr unsigned int num_buckets =
+      (64 - sub_bucket_bits + 1) * sub_buckets;
+
+   //! One non-empty bucket of a snapshot.
+   struct bucket {
+      //! The smallest value that lands in this bucket.
+      ::std::uint64_t lowest;
+      //! How many values landed in it.
+      ::std::uint64_t count;
+   };
+
+   //! The state of a histogram at some moment.
+   class snapshot {
+    public:
+      snapshot() : count_(0), max_(0) {}
+
+      //! How many values were recorded.
+      ::std::uint64_t count() const { return count_; }
+      //! The largest value recorded.
+      ::std::uint64_t max() const { return max_; }
+      //! The non-empty buckets, from smallest to largest.
+      const ::std::vector<bucket> &buckets() const { return buckets_; }
+
+      /*! \brief The lowest value of the bucket that contains the value at
+       * percentile (0 to 100), or 0 if nothing was recorded.
+       */
+      ::std::uint64_t value_at_percentile(double percentile) const {
+         const double wanted = (percentile / 100.0) * count_;
+         ::std::uint64_t seen = 0;
+         for (const bucket &b: buckets_) {
+            seen += b.count;
+            if (seen >= wanted) {
+               return b.lowest;
+            }
+         }
+         return buckets_.empty() ? 0 : buckets_.back().lowest;
+      }
+
+    private:
+      friend class latency_histogram;
+      ::std::uint64_t count_;
+      ::std::uint64_t max_;
+      ::std::vector<bucket> buckets_;
+   };
+
+   latency_histogram() noexcept : max_(0) {
+      for (auto &count: counts_) {
+         count.store(0, ::std::memory_order_relaxed);
+      }
+   }
+   latency_histogram(const latency_histogram &) = delete;
+   latency_histogram &operator =(const latency_histogram &) = delete;
+
+   //! Count value.
+   void record(::std::uint64_t value) noexcept {
+      counts_[bucket_of(value)].fetch_add(1, ::std::memory_order_relaxed);
+      ::std::uint64_t curmax = max_.load(::std::memory_order_relaxed);
+      while ((value > curmax) &&
+             !max_.compare_exchange_weak(curmax, value,
+                                         ::std::memory_order_relaxed))
+      {
+      }
+   }
+
+   //! Copy out the counts.
+   snapshot take_snapshot() const {
+      snapshot result;
+      for (unsigned int i = 0; i < num_buckets; ++i) {
+         const ::std::uint64_t count = counts_[i].load(::std::memory_order_relaxed);
+         if (count > 0) {
+            result.buckets_.push_back(bucket{lowest_in(i), count});
+            result.count_ += count;
+         }
+      }
+      result.max_ = max_.load(::std::memory_order_relaxed);
+      return result;
+   }
+
+   //! Which bucket value lands in.
+   static unsigned int bucket_of(::std::uint64_t value) noexcept {
+      if (value < sub_buckets) {
+         return static_cast<unsigned int>(value);
+      }
+      const unsigned int msb = 63 - __builtin_clzll(value);
+      const unsigned int shift = msb - sub_bucket_bits;
+      return (shift + 1) * sub_buckets +
+         static_cast<unsigned int>((value >> shift) & (sub_buckets - 1));
+   }
+
+   //! The smallest value that lands in bucket index.
+   static ::std::uint64_t lowest_in(unsigned int index) noexcept {
+      const unsigned int group = index / sub_buckets;
+      const ::std::uint64_t sub = index % sub_buckets;
+      return (group == 0) ? sub : (sub_buckets + sub) << (group - 1);
+   }
+
+ private:
+   ::std::atomic< ::std::uint64_t> counts_[num_buckets];
+   ::std::atomic< ::std::uint64_t> max_;
+};
+
+} // namespace sparkles
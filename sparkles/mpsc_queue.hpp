@@ -0,0 +1,122 @@
+#pragma once
+
+#include <atomic>
+
+namespace sparkles {
+namespace priv {
+
+//! Size of the cache line we try to keep producer and consumer data apart by.
+constexpr unsigned int cache_line_size = 64;
+
+/*! \brief The link every node in an intrusive_mpsc_queue must have.
+ *
+ * Derive your node type from this. The next_ pointer belongs to whatever
+ * container the node is currently in, so nodes may be moved between a queue
+ * and a free list without touching anything else.
+ */
+struct mpsc_node {
+   ::std::atomic<mpsc_node *> next_;
+
+   mpsc_node() : next_(nullptr) {}
+   mpsc_node(const mpsc_node &) = delete;
+   mpsc_node &operator =(const mpsc_node &) = delete;
+};
+
+/*! \brief Dmitry Vyukov's intrusive multiple producer, single consumer queue.
+ *
+ * push may be called from any number of threads at once and never waits for
+ * anything. It costs one atomic exchange and one store. pop may only be called
+ * from one thread at a time.
+ *
+ * The price of push never waiting is that there's a tiny window between a
+ * producer claiming its place in the queue and linking its node in. If pop
+ * catches a producer in that window it returns nullptr even though the queue
+ * isn't empty, and every node pushed after that one stays hidden until the
+ * producer finishes. Callers who know an item is there (because they've been
+ * counting) have to try again.
+ *
+ * A node returned from pop is no longer referenced by the queue or by any
+ * producer, so it can be reused or deleted immediately. This is what makes
+ * node reclamation safe without hazard pointers or epochs.
+ *
+ * \sa http://www.1024cores.net/home/lock-free-algorithms/queues/intrusive-mpsc-node-based-queue
+ */
+template <class Node>
+class intrusive_mpsc_queue {
+ public:
+   intrusive_mpsc_queue() : head_(&stub_), tail_(&stub_) {}
+   intrusive_mpsc_queue(const intrusive_mpsc_queue &) = delete;
+   intrusive_mpsc_queue &operator =(const intrusive_mpsc_queue &) = delete;
+
+   //! Add a node to the end of the queue. Safe from any thread.
+   void push(Node *node) { push_chain(node, node); }
+
+   /*! \brief Add a chain of nodes to the end of the queue all at once.
+    *
+    * The nodes from first to last must already be linked through their next_
+    * pointers. The chain becomes visible to the consumer as a unit, and costs
+    * the same as pushing a single node.
+    */
+   void push_chain(Node *first, Node *last) {
+      link_in(first, last);
+   }
+
+   /*! \brief Remove the node at the front of the queue, or return nullptr.
+    *
+    * Only one thread may call this at a time. A nullptr return means either
+    * the queue is empty or a producer is part way through a push.
+    */
+   Node *pop() {
+      using ::std::memory_order_acquire;
+      mpsc_node *tail = tail_;
+      mpsc_node *next = tail->next_.load(memory_order_acquire);
+      if (tail == &stub_) {
+         if (next == nullptr) {
+            return nullptr;
+         }
+         tail_ = tail = next;
+         next = next->next_.load(memory_order_acquire);
+      }
+      if (next != nullptr) {
+         tail_ = next;
+         return static_cast<Node *>(tail);
+      }
+      if (tail != head_.load(memory_order_acquire)) {
+         // A producer has swapped in a new head but not linked it yet.
+         return nullptr;
+      }
+      // tail is the last real node. Put the stub behind it so it can be
+      // handed out without leaving the queue without a node in it.
+      link_in(&stub_, &stub_);
+      next = tail->next_.load(memory_order_acquire);
+      if (next != nullptr) {
+         tail_ = next;
+         return static_cast<Node *>(tail);
+      }
+      return nullptr;
+   }
+
+   /*! \brief Is there nothing for pop to return?
+    *
+    * Only the consumer may call this. Like pop, it may say the queue is empty
+    * while a producer is part way through a push.
+    */
+   bool empty() const {
+      return (tail_ == &stub_) &&
+         (stub_.next_.load(::std::memory_order_acquire) == nullptr);
+   }
+
+ private:
+   alignas(cache_line_size) ::std::atomic<mpsc_node *> head_;
+   alignas(cache_line_size) mpsc_node *tail_;
+   mpsc_node stub_;
+
+   void link_in(mpsc_node *first, mpsc_node *last) {
+      last->next_.store(nullptr, ::std::memory_order_relaxed);
+      mpsc_node * const prev = head_.exchange(last, ::std::memory_order_acq_rel);
+      prev->next_.store(first, ::std::memory_order_release);
+   }
+};
+
+} // namespace priv
+} // namespace sparkles
@@ -0,0 +1,90 @@
+#pragma once
+
+#include <sparkles/work_queue.hpp>
+#include <sparkles/eventcount.hpp>
+#include <chrono>
+#include <vector>
+
+namespace sparkles {
+
+/*! \brief Lets one thread wait on several work_queues at once.
+ *
+ * A thread that owns, say, a queue of urgent control messages and a queue of
+ * bulk results can put both in a queue_set and call its dequeue, which returns
+ * an item from whichever queue has one, blocking until one does. Each member
+ * queue tells the set's eventcount when something is added to it, so waiting
+ * doesn't involve any polling.
+ *
+ * Every member has a priority, lower numbers being more urgent. dequeue always
+ * takes from the most urgent queue that has anything, and from queues of equal
+ * priority in the order they were added. The members' own priorities (out of
+ * band items and so on) still apply within each queue.
+ *
+ * Only one thread may use a queue_set at a time. A work_queue can only be in
+ * one set at a time, and must be removed from it (or the set destroyed) before
+ * the queue is destroyed. The members can be written to from any thread at any
+ * time, including while they're being added or removed.
+ */
+class queue_set {
+ public:
+   typedef work_queue::work_item_t work_item_t;
+   typedef work_queue::possible_work_item_t possible_work_item_t;
+
+   queue_set() = default;
+   queue_set(const queue_set &) = delete;
+   queue_set(queue_set &&) = delete;
+   const queue_set &operator =(const queue_set &) = delete;
+   const queue_set &operator =(queue_set &&) = delete;
+   //! Removes every queue from the set.
+   ~queue_set();
+
+   /*! \brief Add a queue to the set.
+    *
+    * Throws ::std::logic_error if the queue is already in a set.
+    */
+   void add(work_queue &wq, unsigned int priority = 0);
+
+   //! Remove a queue from the set, does nothing if it isn't in it.
+   void remove(work_queue &wq);
+
+   //! How many queues are in the set.
+   ::std::size_t size() const { return members_.size(); }
+
+   /*! \brief Dequeue an item from the most urgent member queue that has one.
+    *
+    * \param[in] block Wait until some member has an item.
+    * \return The item, if any. Always has a value if block is true.
+    */
+   possible_work_item_t dequeue(bool block);
+
+   /*! \brief Like dequeue(true), but give up at deadline.
+    *
+    * \return The item, or nothing if no member had one before deadline.
+    */
+   possible_work_item_t
+   dequeue_until(::std::chrono::steady_clock::time_point deadline);
+
+   //! Like dequeue_until, but with a timeout instead of a deadline.
+   template <class Rep, class Period>
+   possible_work_item_t
+   dequeue_for(const ::std::chrono::duration<Rep, Period> &timeout) {
+      using ::std::chrono::steady_clock;
+      return dequeue_until(
+         steady_clock::now() +
+         ::std::chrono::duration_cast<steady_clock::duration>(timeout)
+         );
+   }
+
+ private:
+   struct member {
+      work_queue *queue_;
+      unsigned int priority_;
+   };
+
+   eventcount ready_;
+   ::std::vector<member> members_;
+
+   possible_work_item_t try_dequeue();
+};
+
+} // namespace sparkles
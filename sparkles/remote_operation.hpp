@@ -111,7 +111,10 @@ class broken_promise : public ::std::runtime_error {
 /*! \brief The class that's used in the other thread to send back a result.
  *
  * When you have an answer for the other thread, use the set_result or
- * set_bad_result method to send it back.
+ * set_bad_result method to send it back. If the answer comes from the thread
+ * that owns the work_queue, and the queue knows it (see
+ * work_queue::set_owner), the remote_operation finishes before the method
+ * returns.
  *
  * You may only call one of those methods once.  If you call them again you will
  * get a bad_result exception.
@@ -193,12 +196,13 @@ class remote_operation<ResultType>::promise {
       if (still_needed()) {
          delivery outbound(dest_);
          outbound.set_bad_result(err);
-         wq_.enqueue(::std::move(outbound));
+         send(::std::move(outbound), claim());
       } else if (fulfilled()) {
          throw invalid_result("Attempt to set a result that's already been "
                               "set.");
+      } else {
+         fulfilled_ = true;
       }
-      fulfilled_ = true;
    }
 
    //! Fulfill this promise with an exception.
@@ -206,12 +210,13 @@ class remote_operation<ResultType>::promise {
       if (still_needed()) {
          delivery outbound(dest_);
          outbound.set_bad_result(exception);
-         wq_.enqueue(::std::move(outbound));
+         send(::std::move(outbound), claim());
       } else if (fulfilled()) {
          throw invalid_result("Attempt to set a result that's already been "
                               "set.");
+      } else {
+         fulfilled_ = true;
       }
-      fulfilled_ = true;
    }
 
    /*! \brief Fulfill this promise with a non-void result.
@@ -228,12 +233,13 @@ class remote_operation<ResultType>::promise {
       if (still_needed()) {
          delivery outbound(dest_);
          outbound.set_result(::std::move(res));
-         wq_.enqueue(::std::move(outbound));
+         send(::std::move(outbound), claim());
       } else if (fulfilled()) {
          throw invalid_result("Attempt to set a result that's already been "
                               "set.");
+      } else {
+         fulfilled_ = true;
       }
-      fulfilled_ = true;
    }
 
    /*! \brief Fulfill this promise with a void result.
@@ -250,38 +256,80 @@ class remote_operation<ResultType>::promise {
       if (still_needed()) {
          delivery outbound(dest_);
          outbound.set_result();
-         wq_.enqueue(::std::move(outbound));
+         send(::std::move(outbound), claim());
       } else if (fulfilled()) {
          throw invalid_result("Attempt to set a result that's already been "
                               "set.");
+      } else {
+         fulfilled_ = true;
       }
-      fulfilled_ = true;
    }
 
    void set_raw_result(const op_result<ResultType> &result) {
       if (still_needed()) {
-         wq_.enqueue(outbound(dest_, result));
+         delivery outbound(dest_, result);
+         send(::std::move(outbound), claim());
       } else if (fulfilled()) {
          throw invalid_result("Attempt to set a result that's already been "
                               "set.");
+      } else {
+         fulfilled_ = true;
       }
-      fulfilled_ = true;
    }
 
    void set_raw_result(op_result<ResultType> &&result) {
       if (still_needed()) {
-         wq_.enqueue(outbound(dest_, ::std::move(result)));
+         delivery outbound(dest_, ::std::move(result));
+         send(::std::move(outbound), claim());
       } else if (fulfilled()) {
          throw invalid_result("Attempt to set a result that's already been "
                               "set.");
+      } else {
+         fulfilled_ = true;
       }
-      fulfilled_ = true;
    }
  private:
    weak_op_ptr_t dest_;
    ::sparkles::work_queue &wq_;
    bool fulfilled_;
 
+   /*! \brief Mark the promise fulfilled and take the operation from it,
+    * before the delivery is sent.
+    *
+    * An inline delivery runs the operation's dependents right away, and they
+    * may set a result again, which has to throw, or destroy this promise,
+    * which mustn't send a broken_promise too.
+    */
+   weak_op_ptr_t claim() {
+      fulfilled_ = true;
+      return ::std::move(dest_);
+   }
+
+   /*! \brief Get a claimed delivery to the queue.
+    *
+    * If this is the queue's owner thread (see work_queue::set_owner) the
+    * delivery is made right away. That may destroy this promise, so nothing
+    * here touches it afterwards.
+    *
+    * Otherwise it's queued. If that throws the delivery is lost, so the claim
+    * is given back, and the operation gets a broken_promise when this is
+    * destroyed.
+    */
+   void send(::sparkles::work_queue::work_item_t outbound,
+             weak_op_ptr_t claimed) {
+      ::sparkles::work_queue &wq = wq_;
+      if (!wq.try_run_inline(outbound)) {
+         try {
+            wq.enqueue(::std::move(outbound));
+         } catch (...) {
+            // Nothing has run, so this promise is still here.
+            dest_ = ::std::move(claimed);
+            fulfilled_ = false;
+            throw;
+         }
+      }
+   }
+
    static void move_into(op_result<ResultType> &&result,
                          remote_operation<ResultType>::ptr_t lockeddest) {
       lockeddest->set_raw_result(::std::move(result));
@@ -1,25 +1,32 @@
 #pragma once
 
-#include <semaphore.h>
-#include <system_error>
-#include <cerrno>
+#include <sparkles/eventcount.hpp>
+#include <atomic>
+#include <chrono>
+#include <climits>
 
 namespace sparkles {
 
-/*! \brief A simple counting semaphore implemented with the Linux pthreads API.
+/*! \brief A counting semaphore that only makes system calls when a thread
+ * actually has to sleep.
  *
- * Unfortunately the base threading library doesn't have one of these.  It's
- * possible this could be implemented in terms of C++11s atomic operations, but
- * I didn't want to go through the effort.
+ * The count is a plain atomic integer. Threads that find it at zero spin for a
+ * little while (in case someone releases it very soon, which is common when
+ * two threads are handing work back and forth) and then sleep on an
+ * eventcount. Releasing the semaphore is an atomic add and, only if a thread
+ * is sleeping, a futex wake.
  *
- * They can also be emulated with condition variables, but that seems very
- * inefficient.
+ * The amount of spinning adapts to how often spinning works out. It's never
+ * more than the spin budget, which can be set to 0 to turn spinning off.
  *
- * But, the current implementation renders this Linux specific.
+ * The use of futexes renders this Linux specific.
 */
 class semaphore
 {
  public:
+   //! The spin budget used if none is given.
+   static constexpr unsigned int default_spin_budget = 128;
+
    //! Can't be copy constructed.
    semaphore(const semaphore &) = delete;
    //! Can't be move constructed.
@@ -29,64 +36,188 @@ class semaphore
    //! Can't be move assigned.
    const semaphore &operator =(semaphore &&) = delete;
    //! Construct from an integer initial count.
-   explicit semaphore(unsigned int val = 0) {
-      if (::sem_init(&sem_, 0, val) != 0) {
-         throw ::std::system_error(errno, ::std::system_category(),
-                                   "Unable to initialize semaphore.");
-      }
+   explicit semaphore(unsigned int val = 0,
+                      unsigned int spin_budget = default_spin_budget)
+        : count_(static_cast<int>(val)), spin_budget_(spin_budget),
+          spin_estimate_(0)
+   {
    }
    //! Destroy the semaphore
-   ~semaphore() { ::sem_destroy(&sem_); }
+   ~semaphore() = default;
 
    //! Increase the count by 1 (aka release the semaphore).
    void release() {
-      if (::sem_post(&sem_) != 0) {
-         throw ::std::system_error(errno, ::std::system_category(),
-                                   "Unable to release (or post to) semaphore.");
+      release(1);
+   }
+
+   //! Increase the count by count, waking up as many waiters as that allows.
+   void release(unsigned int count) {
+      if (count > 0) {
+         count_.fetch_add(static_cast<int>(count), ::std::memory_order_release);
+         waiters_.notify(count);
       }
    }
 
    //! Decrease the count by 1 and block if count is 0 until someome else posts.
    void acquire() {
-      if (::sem_wait(&sem_) != 0) {
-         throw ::std::system_error(errno, ::std::system_category(),
-                                   "Infinite wait for semaphore failed.");
+      if (try_acquire() || spin_acquire()) {
+         return;
+      }
+      for (;;) {
+         const eventcount::key_t key = waiters_.prepare_wait();
+         if (try_acquire()) {
+            waiters_.cancel_wait();
+            return;
+         }
+         waiters_.wait(key);
+         if (try_acquire()) {
+            return;
+         }
       }
    }
-   //! Decrease the count by 1 if it's > 0, and return true else return false
-   bool try_acquire() {
-      if (::sem_trywait(&sem_) == 0) {
+
+   /*! \brief Like acquire, but give up if the count doesn't become positive
+    * before the deadline.
+    *
+    * \return true if the count was decreased, false if the deadline passed.
+    */
+   bool acquire_until(::std::chrono::steady_clock::time_point deadline) {
+      if (try_acquire() || spin_acquire()) {
          return true;
-      } else {
-         if (errno == EAGAIN) {
+      }
+      for (;;) {
+         const eventcount::key_t key = waiters_.prepare_wait();
+         if (try_acquire()) {
+            waiters_.cancel_wait();
+            return true;
+         }
+         const bool woken = waiters_.wait_until(key, deadline);
+         if (try_acquire()) {
+            return true;
+         } else if (!woken) {
             return false;
-         } else {
-            throw ::std::system_error(errno, ::std::system_category(),
-                                      "Try wait for semaphore failed.");
          }
       }
    }
 
+   //! acquire_until for clocks other than ::std::chrono::steady_clock.
+   template <class Clock, class Duration>
+   bool acquire_until(const ::std::chrono::time_point<Clock, Duration> &deadline)
+   {
+      using ::std::chrono::steady_clock;
+      const auto remaining = deadline - Clock::now();
+      return acquire_until(
+         steady_clock::now() +
+         ::std::chrono::duration_cast<steady_clock::duration>(remaining)
+         );
+   }
+
+   /*! \brief Like acquire, but give up if the count doesn't become positive
+    * within timeout.
+    *
+    * \return true if the count was decreased, false if it timed out.
+    */
+   template <class Rep, class Period>
+   bool acquire_for(const ::std::chrono::duration<Rep, Period> &timeout) {
+      using ::std::chrono::steady_clock;
+      return acquire_until(
+         steady_clock::now() +
+         ::std::chrono::duration_cast<steady_clock::duration>(timeout)
+         );
+   }
+
+   //! Decrease the count by 1 if it's > 0, and return true else return false
+   bool try_acquire() {
+      int curval = count_.load(::std::memory_order_relaxed);
+      while (curval > 0) {
+         if (count_.compare_exchange_weak(curval, curval - 1,
+                                          ::std::memory_order_acquire,
+                                          ::std::memory_order_relaxed))
+         {
+            return true;
+         }
+      }
+      return false;
+   }
+
+   /*! \brief Decrease the count by as much as possible without going below 0
+    * or decreasing it by more than max_count.
+    *
+    * \return How much the count was decreased by.
+    */
+   unsigned int try_acquire_up_to(unsigned int max_count) {
+      int curval = count_.load(::std::memory_order_relaxed);
+      const int limit = static_cast<int>((max_count > INT_MAX) ? INT_MAX
+                                                                : max_count);
+      while (curval > 0) {
+         const int taken = (curval < limit) ? curval : limit;
+         if (count_.compare_exchange_weak(curval, curval - taken,
+                                          ::std::memory_order_acquire,
+                                          ::std::memory_order_relaxed))
+         {
+            return static_cast<unsigned int>(taken);
+         }
+      }
+      return 0;
+   }
+
    /*! \brief What's the current count which may already be out-of-date.
     *
     * This value can change at any moment. It's useful for debugging and
     * informational purposes, but relying on this function for anything serious
     * will create race conditions.
     */
-   int getvalue() {
-      int retval;
-      if (sem_getvalue(&sem_, &retval) != 0) {
-         throw ::std::system_error(errno, ::std::system_category(),
-                                   "Unable to get semaphore value.");
-      }
-      // Normalize allowed Posix behaviors to just returning 0 if the semaphore
-      // is contended and never return a negative value indicating how many
-      // waiters there are.
-      return (retval <= 0) ? 0 : retval;
+   int getvalue() const {
+      return count_.load(::std::memory_order_relaxed);
+   }
+
+   //! The most times acquire will check the count before going to sleep.
+   unsigned int spin_budget() const {
+      return spin_budget_.load(::std::memory_order_relaxed);
+   }
+   //! Change the most times acquire will check the count before sleeping.
+   void set_spin_budget(unsigned int spin_budget) {
+      spin_budget_.store(spin_budget, ::std::memory_order_relaxed);
    }
 
  private:
-   ::sem_t sem_;
+   ::std::atomic<int> count_;
+   eventcount waiters_;
+   ::std::atomic<unsigned int> spin_budget_;
+   //! A running average of how many spins it takes for spinning to work out.
+   ::std::atomic<unsigned int> spin_estimate_;
+
+   /*! \brief Spin for a while, hoping for a release.
+    *
+    * This is the same adaptive scheme glibc uses for its adaptive mutexes. The
+    * spin limit is twice the recent average number of spins it took to
+    * succeed, so if spinning rarely works the amount of spinning decays
+    * towards a small constant.
+    */
+   bool spin_acquire() {
+      const unsigned int budget = spin_budget();
+      if (budget == 0) {
+         return false;
+      }
+      const unsigned int estimate =
+         spin_estimate_.load(::std::memory_order_relaxed);
+      const unsigned int limit = (estimate * 2 + 10 < budget) ? estimate * 2 + 10
+                                                              : budget;
+      unsigned int spins = 0;
+      bool acquired = false;
+      while (!acquired && (spins < limit)) {
+         priv::cpu_relax();
+         ++spins;
+         acquired = (count_.load(::std::memory_order_relaxed) > 0) &&
+            try_acquire();
+      }
+      const int adjustment = (static_cast<int>(spins) -
+                              static_cast<int>(estimate)) / 8;
+      spin_estimate_.store(static_cast<unsigned int>(
+                              static_cast<int>(estimate) + adjustment),
+                           ::std::memory_order_relaxed);
+      return acquired;
+   }
 };
 
 }
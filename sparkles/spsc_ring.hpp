@@ -0,0 +1,111 @@
+#pragma once
+
+#include <sparkles/mpsc_queue.hpp>
+#include <sparkles/topology.hpp>
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <utility>
+
+namespace sparkles {
+namespace priv {
+
+/*! \brief A fixed size, wait-free, single producer, single consumer ring.
+ *
+ * One thread may call try_push while another calls try_pop. Each side owns one
+ * index and only reads the other's when its cached copy says the ring looks
+ * full (or empty), so in the steady state neither side touches the other's
+ * cache line at all.
+ *
+ * T must be default constructible and movable. Slots hold default constructed
+ * T's when they're empty, and items are moved in and out of them. The slots can
+ * be put on a particular NUMA node, usually the consumer's.
+ */
+template <class T>
+class spsc_ring {
+ public:
+   /*! \brief Make a ring that holds at least capacity items, with its slots
+    * on numa_node if that's not negative.
+    */
+   explicit spsc_ring(::std::size_t capacity, int numa_node = -1)
+        : head_(0), cached_tail_(0), tail_(0), cached_head_(0),
+          mask_(round_up(capacity) - 1), slots_(mask_ + 1, numa_node)
+   {
+   }
+   spsc_ring(const spsc_ring &) = delete;
+   spsc_ring &operator =(const spsc_ring &) = delete;
+
+   //! How many items the ring can hold.
+   ::std::size_t capacity() const { return mask_ + 1; }
+
+   /*! \brief Add an item, or return false if the ring is full.
+    *
+    * Only the producer may call this. item is only moved from if it's added.
+    */
+   bool try_push(T &item) {
+      const ::std::size_t tail = tail_.load(::std::memory_order_relaxed);
+      if (tail - cached_head_ > mask_) {
+         cached_head_ = head_.load(::std::memory_order_acquire);
+         if (tail - cached_head_ > mask_) {
+            return false;
+         }
+      }
+      slots_[tail & mask_] = ::std::move(item);
+      tail_.store(tail + 1, ::std::memory_order_release);
+      return true;
+   }
+
+   /*! \brief Move the oldest item into item, or return false if there isn't
+    * one.
+    *
+    * Only the consumer may call this.
+    */
+   bool try_pop(T &item) {
+      const ::std::size_t head = head_.load(::std::memory_order_relaxed);
+      if (head == cached_tail_) {
+         cached_tail_ = tail_.load(::std::memory_order_acquire);
+         if (head == cached_tail_) {
+            return false;
+         }
+      }
+      T &slot = slots_[head & mask_];
+      item = ::std::move(slot);
+      slot = T();
+      head_.store(head + 1, ::std::memory_order_release);
+      return true;
+   }
+
+   //! How many items are in the ring. Only meaningful to the consumer.
+   ::std::size_t size() const {
+      return tail_.load(::std::memory_order_acquire) -
+         head_.load(::std::memory_order_relaxed);
+   }
+
+   //! Is the ring empty? Only meaningful to the consumer.
+   bool empty() const {
+      return head_.load(::std::memory_order_relaxed) ==
+         tail_.load(::std::memory_order_acquire);
+   }
+
+ private:
+   // The consumer's side.
+   alignas(cache_line_size) ::std::atomic< ::std::size_t> head_;
+   ::std::size_t cached_tail_;
+   // The producer's side.
+   alignas(cache_line_size) ::std::atomic< ::std::size_t> tail_;
+   ::std::size_t cached_head_;
+   // Shared, but never written after construction.
+   alignas(cache_line_size) const ::std::size_t mask_;
+   const numa_array<T> slots_;
+
+   static ::std::size_t round_up(::std::size_t capacity) {
+      ::std::size_t size = 1;
+      while (size < capacity) {
+         size <<= 1;
+      }
+      return size;
+   }
+};
+
+} // namespace priv
+} // namespace sparkles
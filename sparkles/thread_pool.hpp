@@ -0,0 +1,260 @@
+#pragma once
+
+#include <sparkles/op_result.hpp>
+#include <sparkles/operation.hpp>
+#include <sparkles/remote_operation.hpp>
+#include <sparkles/eventcount.hpp>
+#include <sparkles/semaphore.hpp>
+#include <sparkles/work_queue.hpp>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <exception>
+#include <memory>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace sparkles {
+
+namespace priv {
+
+//! The result type of the operation for a task that returns T.
+template <typename T>
+struct task_result {
+   typedef T type;
+};
+
+//! A task can return an op_result to finish with an error_code.
+template <typename T>
+struct task_result<op_result<T> > {
+   typedef T type;
+};
+
+//! Call func and put what it returned in result, when it returns a value.
+template <typename ResultType, typename FuncT>
+typename ::std::enable_if<!::std::is_void<ResultType>::value &&
+                          !::std::is_same<decltype(::std::declval<FuncT &>()()),
+                                          op_result<ResultType> >::value,
+                          void>::type
+call_into(op_result<ResultType> &result, FuncT &func)
+{
+   result.set_result(func());
+}
+
+//! Call func and put what it returned in result, when it returns nothing.
+template <typename ResultType, typename FuncT>
+typename ::std::enable_if< ::std::is_void<ResultType>::value &&
+                          !::std::is_same<decltype(::std::declval<FuncT &>()()),
+                                          op_result<ResultType> >::value,
+                          void>::type
+call_into(op_result<ResultType> &result, FuncT &func)
+{
+   func();
+   result.set_result();
+}
+
+//! Call func and put what it returned in result, when it returns an op_result.
+template <typename ResultType, typename FuncT>
+typename ::std::enable_if< ::std::is_same<
+                              decltype(::std::declval<FuncT &>()()),
+                              op_result<ResultType> >::value,
+                           void>::type
+call_into(op_result<ResultType> &result, FuncT &func)
+{
+   result = func();
+}
+
+} // namespace priv
+
+/*! \brief A set of threads that run tasks and send their results back as
+ * operations.
+ *
+ * This is for getting CPU heavy work off a thread that's running an
+ * event_loop without blocking it:
+ *
+ * \code
+ * thread_pool pool;
+ * auto parsed = pool.submit(loop.queue(), [bytes]() { return parse(bytes); });
+ * loop.run_until(parsed);
+ * \endcode
+ *
+ * submit() makes a remote_operation for the caller's queue, and the task
+ * fulfills its promise when it has run. So the operation finishes on the
+ * caller's thread, when its event_loop runs the delivery, like any other
+ * remote_operation. Whatever the task throws becomes the operation's
+ * exception, and a task that returns an op_result<R> can finish it with an
+ * ::std::error_code instead.
+ *
+ * A task whose operation has been dropped by the time a thread gets to it is
+ * skipped, so giving up on a result also gives up on the work if it hasn't
+ * started yet.
+ *
+ * Tasks are scheduled by work stealing. Each thread has a deque of its own,
+ * and a task posted or submitted from one of the pool's threads goes on that
+ * thread's deque, where it's the next thing the thread runs. That keeps
+ * whatever the parent task just touched in cache, and a task that fans out
+ * into subtasks doesn't touch anything shared to do it. A thread with nothing
+ * of its own to do steals the oldest task from the deque of another thread,
+ * picked at random, which is usually the biggest piece of work left. Tasks
+ * from outside the pool go into a work_queue with multiple consumers that every
+ * thread checks before it steals. Threads that can't find anything wait on an
+ * eventcount, so a pool that's idle is asleep, and posting to a pool nobody is
+ * asleep in costs a fence and a load.
+ *
+ * So there's no particular order tasks start in, except that the tasks from
+ * outside the pool are taken from the queue in the order they were posted.
+ *
+ * A pool can have a fixed number of threads, or grow and shrink between
+ * config::min_threads and config::max_threads. A supervisor thread then looks
+ * at the pool every config::sample_interval. If there's a backlog of more than
+ * config::grow_backlog tasks per thread, and no thread is idle, twice in a
+ * row, it adds a thread. If nothing is waiting and some thread has been idle
+ * for config::idle_timeout, it lets one go. A thread only leaves when it's
+ * run out of tasks of its own, so that loses nothing. Threads come and go
+ * one at a time, and they're started and joined by the supervisor, so a burst
+ * of posts never waits for a thread to start and promise deliveries to other
+ * queues are never held up. metrics() tells how it's going.
+ *
+ * Tasks that haven't started when the pool is destroyed never run, and their
+ * operations finish with a broken_promise.
+ */
+class thread_pool {
+ public:
+   typedef work_queue::work_item_t work_item_t;
+
+   //! The result type of the operation submit returns for FuncT.
+   template <typename FuncT>
+   using result_of_t = typename priv::task_result<
+      decltype(::std::declval<typename ::std::decay<FuncT>::type &>()())>::type;
+
+   //! One thread per CPU, or just one if that can't be found out.
+   static unsigned int default_size();
+
+   //! Options for a pool whose size changes with the load.
+   struct config {
+      //! The fewest threads there are, and how many there are to start with.
+      unsigned int min_threads = 1;
+      //! The most threads there can be.
+      unsigned int max_threads = default_size();
+      //! How often the supervisor looks at the pool.
+      ::std::chrono::milliseconds sample_interval =
+         ::std::chrono::milliseconds(50);
+      //! How many waiting tasks per thread mean another thread is needed.
+      unsigned int grow_backlog = 2;
+      //! How long a thread is idle before it's let go.
+      ::std::chrono::milliseconds idle_timeout = ::std::chrono::seconds(5);
+   };
+
+   //! How the pool is doing, from metrics().
+   struct metrics_snapshot {
+      //! How many threads there are right now.
+      unsigned int current_threads;
+      //! How many threads the supervisor wants there to be.
+      unsigned int target_threads;
+      //! How many threads had nothing to do.
+      unsigned int idle_threads;
+      //! About how many tasks were waiting for a thread.
+      ::std::size_t backlog;
+   };
+
+   //! Start a pool with threads threads. Throws ::std::invalid_argument if 0.
+   explicit thread_pool(unsigned int threads = default_size());
+   /*! \brief Start a pool that grows and shrinks as cfg says.
+    *
+    * Throws ::std::invalid_argument if cfg.min_threads is 0 or more than
+    * cfg.max_threads. If they're the same there's no supervisor.
+    */
+   explicit thread_pool(const config &cfg);
+   thread_pool(const thread_pool &) = delete;
+   thread_pool(thread_pool &&) = delete;
+   const thread_pool &operator =(const thread_pool &) = delete;
+   const thread_pool &operator =(thread_pool &&) = delete;
+   //! Waits for the tasks that are running to finish, and drops the rest.
+   ~thread_pool();
+
+   //! How many threads there are right now.
+   unsigned int size() const {
+      return running_.load(::std::memory_order_relaxed);
+   }
+
+   //! A snapshot of how many threads there are and how busy they are.
+   metrics_snapshot metrics() const;
+
+   /*! \brief Run a task on one of the threads, and forget about it.
+    *
+    * If it throws, the program ends, like any other exception that escapes a
+    * thread.
+    */
+   void post(work_item_t task);
+
+   /*! \brief Run func on one of the threads, and deliver its result to
+    * answerq as the operation this returns.
+    *
+    * answerq must outlive the task, since that's where the result is sent, and
+    * it's also where a broken_promise goes if the pool is destroyed before the
+    * task starts.
+    */
+   template <typename FuncT>
+   typename operation<result_of_t<FuncT> >::ptr_t
+   submit(work_queue &answerq, FuncT &&func) {
+      typedef result_of_t<FuncT> result_t;
+      typedef typename ::std::decay<FuncT>::type func_t;
+      auto opandpromise = remote_operation<result_t>::create(answerq);
+      post([promise = ::std::move(opandpromise.second),
+            func = func_t(::std::forward<FuncT>(func))]() mutable {
+              if (!promise->still_needed()) {
+                 return;
+              }
+              op_result<result_t> result;
+              try {
+                 priv::call_into(result, func);
+              } catch (...) {
+                 result.set_bad_result(::std::current_exception());
+              }
+              promise->set_raw_result(::std::move(result));
+           });
+      return opandpromise.first;
+   }
+
+ private:
+   struct worker;
+
+   const config cfg_;
+   //! Tasks from outside the pool.
+   work_queue queue_;
+   //! Where idle threads wait for something to do.
+   eventcount idle_;
+   ::std::atomic<bool> done_;
+   //! One for each thread there may be, whether or not it's running.
+   ::std::vector< ::std::unique_ptr<worker> > workers_;
+   ::std::atomic<unsigned int> running_;
+   ::std::atomic<unsigned int> target_;
+   //! Released to stop the supervisor.
+   semaphore stop_supervisor_;
+   //! Samples in a row the supervisor has seen the pool short of threads.
+   unsigned int short_samples_;
+   ::std::thread supervisor_;
+
+   //! The worker the calling thread is, if it's one of a pool's.
+   static thread_local worker *current_;
+
+   static work_queue::config queue_config();
+   static config fixed(unsigned int threads);
+   void run(worker &me);
+   //! Find a task for me to run, in order of preference.
+   bool find_task(worker &me, work_item_t &task);
+   bool steal(worker &me, work_item_t &task);
+   //! Leave if there are more threads than the target.
+   bool retire();
+   //! Start a thread for a worker that isn't running, if there is one.
+   bool start_worker();
+   void supervise();
+   //! Look at the pool and maybe change the number of threads.
+   void sample();
+   //! Stop and join every thread.
+   void stop();
+};
+
+} // namespace sparkles
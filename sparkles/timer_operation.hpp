@@ -0,0 +1,58 @@
+#pragma once
+
+#include <sparkles/operation.hpp>
+#include <sparkles/timer_wheel.hpp>
+#include <memory>
+#include <stdexcept>
+
+namespace sparkles {
+
+/*! \brief An operation<void> that finishes when a deadline passes.
+ *
+ * It's scheduled on a timer_wheel, and finishes on the wheel's thread when the
+ * wheel expires it. Usually that wheel is event_loop::timers(), so the loop
+ * wakes up for it:
+ *
+ * \code
+ * auto timeout = timer_operation::create(loop.timers(),
+ *                                        steady_clock::now() + seconds(5));
+ * loop.run_until(timeout);
+ * \endcode
+ *
+ * The wheel doesn't hold a reference to the operation. Once nothing else does
+ * either the timer is cancelled, so abandoned timeouts cost nothing.
+ */
+class timer_operation : public operation<void>, private timer_wheel::timer {
+   struct private_cookie {
+   };
+ public:
+   //! The private_cookie ensures that you must use the create function.
+   explicit timer_operation(const private_cookie &) : operation<void>({}) { }
+
+   //! A shared_ptr to me!
+   typedef ::std::shared_ptr<timer_operation> ptr_t;
+   typedef timer_wheel::time_point time_point;
+
+   /*! \brief Make an operation that finishes at deadline.
+    *
+    * Must be called from the thread that owns wheel, which must outlive the
+    * operation or at least the time it's scheduled.
+    */
+   static ptr_t create(timer_wheel &wheel, time_point deadline) {
+      auto timer = ::std::make_shared<timer_operation>(private_cookie{});
+      wheel.schedule(*timer, deadline);
+      return timer;
+   }
+
+ private:
+   void expired() override {
+      set_result();
+   }
+
+   //! This should never be called since this class has no dependencies.
+   virtual void i_dependency_finished(const opbase_ptr_t &) {
+      throw ::std::runtime_error("This object should have no dependencies.");
+   }
+};
+
+} // namespace sparkles
@@ -0,0 +1,140 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+
+namespace sparkles {
+
+/*! \brief A hierarchical timing wheel, for lots of timers owned by one thread.
+ *
+ * Time is counted in ticks of resolution() since the wheel was made. There are
+ * eleven levels of 64 slots each, level n holding the timers that are due less
+ * than 64^(n+1) ticks from now, so every 64 bit tick count fits and nothing is
+ * ever out of range. A timer is put in a slot by looking at a few bits of its
+ * deadline, and each slot is an intrusive list, so scheduling or cancelling a
+ * timer is O(1) no matter how many there are. A timer migrates down a level
+ * when the time comes to look at its slot, and runs from level 0.
+ *
+ * Timers never run early. A deadline is rounded up to the next tick, and the
+ * time passed to expire is rounded down.
+ *
+ * A wheel belongs to one thread, which is the only one that may schedule or
+ * cancel its timers, destroy them, or call expire. Usually that's the thread
+ * running an event_loop, which owns a wheel and wakes up for it.
+ */
+class timer_wheel {
+ public:
+   typedef ::std::chrono::steady_clock clock;
+   typedef clock::time_point time_point;
+   typedef clock::duration duration;
+
+   /*! \brief Something that can be scheduled on a timer_wheel.
+    *
+    * Derive from this and implement expired. A timer can only be on one wheel
+    * at a time, and destroying it cancels it.
+    */
+   class timer {
+    public:
+      timer(const timer &) = delete;
+      timer &operator =(const timer &) = delete;
+
+      //! Is this waiting to expire?
+      bool scheduled() const { return pprev_ != nullptr; }
+
+    protected:
+      timer() = default;
+      virtual ~timer();
+
+    private:
+      friend class timer_wheel;
+
+      //! Called by timer_wheel::expire once the timer is no longer scheduled.
+      virtual void expired() = 0;
+
+      timer_wheel *wheel_ = nullptr;
+      timer *next_ = nullptr;
+      //! Whatever points at this timer, nullptr if it isn't scheduled.
+      timer **pprev_ = nullptr;
+      ::std::uint64_t expiry_ = 0;
+      unsigned char level_ = 0;
+      unsigned char slot_ = 0;
+   };
+
+   //! Make a wheel whose ticks are resolution long.
+   explicit timer_wheel(duration resolution = ::std::chrono::milliseconds(1));
+   timer_wheel(const timer_wheel &) = delete;
+   timer_wheel(timer_wheel &&) = delete;
+   const timer_wheel &operator =(const timer_wheel &) = delete;
+   const timer_wheel &operator =(timer_wheel &&) = delete;
+   //! Forget every timer, without running them.
+   ~timer_wheel();
+
+   //! How long a tick is.
+   duration resolution() const { return resolution_; }
+
+   //! How many timers are scheduled.
+   ::std::size_t size() const { return size_; }
+   bool empty() const { return size_ == 0; }
+
+   /*! \brief Schedule t to expire at deadline.
+    *
+    * If t is already scheduled, on this wheel or another, it's moved. A
+    * deadline that has already passed expires at the next call to expire.
+    */
+   void schedule(timer &t, time_point deadline);
+
+   //! Stop t from expiring, does nothing if it isn't scheduled.
+   void cancel(timer &t);
+
+   /*! \brief When expire will next have something to do.
+    *
+    * That's either the deadline of the next timer or earlier, when some timers
+    * need to be moved down a level. time_point::max() if there are no timers.
+    */
+   time_point next_deadline() const;
+
+   /*! \brief Run every timer whose deadline is no later than now.
+    *
+    * Timers run in deadline order, to within a tick. They may schedule or
+    * cancel any timer, including ones that were about to run. If one throws the
+    * exception propagates, and the rest run at the next call.
+    *
+    * \return How many timers ran.
+    */
+   ::std::size_t expire(time_point now = clock::now());
+
+ private:
+   static constexpr unsigned int level_bits = 6;
+   static constexpr unsigned int slots_per_level = 1U << level_bits;
+   static constexpr unsigned int num_levels =
+      (64 + level_bits - 1) / level_bits;
+   //! The level_ of a timer in due_.
+   static constexpr unsigned char due_level = num_levels;
+
+   const time_point epoch_;
+   const duration resolution_;
+   //! The tick everything has been expired up to.
+   ::std::uint64_t now_;
+   ::std::size_t size_;
+   //! Timers whose deadline has come.
+   timer *due_;
+   //! Which slots of each level have timers in them.
+   ::std::uint64_t occupied_[num_levels];
+   timer *slots_[num_levels][slots_per_level];
+
+   //! Put a timer whose expiry_ is set in the right list.
+   void link(timer &t);
+   void unlink(timer &t);
+   //! Run everything in due_.
+   ::std::size_t run_due();
+   /*! \brief The next tick at which a slot needs looking at, and which one.
+    *
+    * Only call this when there are timers and none of them are due.
+    */
+   ::std::uint64_t next_event(unsigned int &level, unsigned int &slot) const;
+   ::std::uint64_t deadline_tick(time_point deadline) const;
+   time_point tick_time(::std::uint64_t tick) const;
+};
+
+} // namespace sparkles
@@ -0,0 +1,137 @@
+#pragma once
+
+#include <cstddef>
+#include <memory>
+#include <new>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace sparkles {
+
+/*! \brief Which CPUs belong to which NUMA node, and how far apart the nodes
+ * are.
+ *
+ * This is read from sysfs, so it's Linux specific. On a machine that doesn't
+ * have NUMA, or if sysfs can't be read, there's a single node 0 with every CPU
+ * the process may run on, and everything that cares about nodes quietly does
+ * nothing special.
+ *
+ * Nodes are known by the kernel's numbers for them, which aren't necessarily
+ * consecutive.
+ */
+class topology {
+ public:
+   //! The topology of the machine this is running on, read once.
+   static const topology &system();
+
+   //! Read the topology from a directory laid out like sysfs_root.
+   explicit topology(const ::std::string &sysfs_root =
+                        "/sys/devices/system/node");
+
+   //! The nodes, in increasing order.
+   const ::std::vector<unsigned int> &nodes() const { return node_ids_; }
+
+   //! Is there more than one node?
+   bool is_numa() const { return node_ids_.size() > 1; }
+
+   //! The CPUs of a node. Throws ::std::out_of_range if there's no such node.
+   const ::std::vector<unsigned int> &cpus_of(unsigned int node) const;
+
+   //! The node a CPU belongs to, or -1 if it's not known.
+   int node_of(unsigned int cpu) const;
+
+   /*! \brief The node all of cpus belong to, or -1 if they're spread over
+    * several (or cpus is empty).
+    */
+   int node_of(const ::std::vector<unsigned int> &cpus) const;
+
+   /*! \brief The kernel's idea of the distance between two nodes.
+    *
+    * 10 means local. Throws ::std::out_of_range if there's no such node.
+    */
+   unsigned int distance(unsigned int from, unsigned int to) const;
+
+   //! Every node, nearest to node (so node itself) first.
+   ::std::vector<unsigned int> nodes_by_distance(unsigned int node) const;
+
+   //! The CPU the calling thread is running on right now, or -1.
+   static int current_cpu();
+
+   //! The node the calling thread is running on right now, or -1.
+   int current_node() const { return (current_cpu() < 0) ? -1 :
+         node_of(static_cast<unsigned int>(current_cpu())); }
+
+ private:
+   ::std::vector<unsigned int> node_ids_;
+   //! Indexed like node_ids_.
+   ::std::vector< ::std::vector<unsigned int> > cpus_;
+   //! distances_[i][j] is from node_ids_[i] to node_ids_[j].
+   ::std::vector< ::std::vector<unsigned int> > distances_;
+
+   ::std::size_t index_of(unsigned int node) const;
+};
+
+namespace priv {
+
+/*! \brief Allocate memory that's preferably on a NUMA node.
+ *
+ * If node is negative, or the machine doesn't have NUMA, this is just
+ * ::operator new. Otherwise the memory comes straight from mmap and the kernel
+ * is asked to prefer node for it, which it will do if it can. The result is
+ * at least as aligned as ::operator new's.
+ */
+void *numa_alloc(::std::size_t bytes, int node);
+
+//! Free memory from numa_alloc, which has to be given the same arguments.
+void numa_free(void *mem, ::std::size_t bytes, int node) noexcept;
+
+/*! \brief A fixed size array of default constructed T's, allocated with
+ * numa_alloc.
+ */
+template <class T>
+class numa_array {
+   static_assert(alignof(T) <= __STDCPP_DEFAULT_NEW_ALIGNMENT__,
+                 "numa_alloc isn't aligned enough for this type.");
+ public:
+   numa_array(::std::size_t size, int node)
+        : size_(size), node_(node), data_(nullptr)
+   {
+      void * const mem = numa_alloc(size * sizeof(T), node);
+      T * const data = static_cast<T *>(mem);
+      ::std::size_t made = 0;
+      try {
+         for (; made < size; ++made) {
+            new (data + made) T();
+         }
+      } catch (...) {
+         destroy(data, made);
+         numa_free(mem, size * sizeof(T), node);
+         throw;
+      }
+      data_ = data;
+   }
+   numa_array(const numa_array &) = delete;
+   numa_array &operator =(const numa_array &) = delete;
+   ~numa_array() {
+      destroy(data_, size_);
+      numa_free(data_, size_ * sizeof(T), node_);
+   }
+
+   T &operator [](::std::size_t i) const { return data_[i]; }
+   ::std::size_t size() const { return size_; }
+
+ private:
+   const ::std::size_t size_;
+   const int node_;
+   T *data_;
+
+   static void destroy(T *data, ::std::size_t count) {
+      while (count > 0) {
+         data[--count].~T();
+      }
+   }
+};
+
+} // namespace priv
+} // namespace sparkles
@@ -1,7 +1,16 @@
 #pragma once
 
-#include <functional>
+#include <sparkles/forward_decls.hpp>
+#include <sparkles/inplace_function.hpp>
+#include <sparkles/latency_histogram.hpp>
 #include <memory>
+#include <chrono>
+#include <utility>
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+#include <type_traits>
+#include <vector>
 #if __has_include(<optional>)
 #  include <optional>
 #elif __has_include(<experimental/optional>)
@@ -11,23 +20,84 @@
 #  error Some form of optional values from the C++17 spec is required.
 #endif
 
+#ifndef SPARKLES_WORK_ITEM_CAPACITY
+/*! \brief How many bytes a work_queue::work_item_t holds without allocating.
+ *
+ * The default is big enough for a remote_operation<T>::promise delivery of
+ * any T up to 48 bytes, which covers ::std::string, ::std::vector and the
+ * smart pointers. Every translation unit must agree on this value.
+ */
+#  define SPARKLES_WORK_ITEM_CAPACITY (12 * sizeof(void *))
+#endif
+
+#ifndef SPARKLES_WORK_QUEUE_STATS
+/*! \brief Set to 1 to have every work_queue keep the statistics that
+ * work_queue::stats() reports.
+ *
+ * When it's 0, the statistics code isn't compiled at all and stats() returns
+ * an empty snapshot. It changes the size of a work_queue, so every translation
+ * unit must agree on this value, see STATS in the Makefile.
+ */
+#  define SPARKLES_WORK_QUEUE_STATS 0
+#endif
+
 namespace sparkles {
 
-/*! \brief Multithreaded multiple writer, one reader queue.
+/*! \brief Multithreaded multiple writer, one (or optionally several) reader
+ * queue.
  *
- * Currently uses semaphores and mutexes. Hopefully this will use a lock-free
- * implementation in the future.
+ * Items are kept on lock-free intrusive linked lists, one for each priority
+ * class. Neither enqueue nor dequeue ever takes a mutex, a semaphore counts
+ * the items so the reader has something to block on.
+ *
+ * By default there are two priority classes, one for out of band items and one
+ * for regular items, and the out of band ones always go first. A queue may be
+ * configured with more classes using config::priority_classes, and given
+ * config::quotas so that a flood of urgent items can't starve the rest
+ * forever. Items of the same class are always dequeued first in, first out.
  *
  * Having multiple threads dequeueing things from this at the same time will
- * result in undefined behavior.
+ * result in undefined behavior, unless the queue was constructed with
+ * config::multiple_consumers set. Then any number of threads may dequeue or
+ * drain at once, which lets a pool of workers share one queue. Items are still
+ * handed out in the same order (out of band ones first, then first in, first
+ * out), but of course several readers may finish them in any order.
  *
  * Destroying the queue while someone is trying to read from it or write to it
  * in another thread also results in undefined behavior.
+ *
+ * A queue may instead be constructed with config::producer_lanes set, in which
+ * case long lived producers can each register a producer_lane and get a
+ * private ring to write to. Those producers then don't share anything with
+ * each other at all, and an item costs them one store and a check for a
+ * sleeping reader. The reader takes turns between the lanes and the regular
+ * queue, though out of band items still go before anything else.
+ *
+ * A queue constructed with config::pollable also has an eventfd that becomes
+ * readable when items arrive, so a reader that's also waiting on sockets or
+ * timers with epoll (or poll or select) can wait on the queue the same way. See
+ * event_fd() and drain_signalled().
+ *
+ * A queue can also be waited on together with other queues by putting it in a
+ * queue_set.
+ *
+ * A queue may be bounded, in which case it allocates room for all its items
+ * when it's constructed and never allocates again. Writers to a full bounded
+ * queue feel backpressure: enqueue waits for room, try_enqueue fails and
+ * enqueue_for gives up after a while. That includes the writes a
+ * remote_operation::promise does when it's fulfilled or destroyed.
  */
 class work_queue {
+   struct node_t;
+
  public:
-   //! A work item is a function-like object with a void (*)(void) signature.
-   typedef ::std::function<void ()> work_item_t;
+   /*! \brief A work item is a function-like object with a void (*)(void)
+    * signature.
+    *
+    * It only needs to be movable, and it's stored in the queue's nodes without
+    * allocating as long as it fits in SPARKLES_WORK_ITEM_CAPACITY bytes.
+    */
+   typedef inplace_function<void (), SPARKLES_WORK_ITEM_CAPACITY> work_item_t;
  #ifndef has_experimental_optional
    typedef ::std::optional<work_item_t> possible_work_item_t;
  #else
@@ -39,8 +109,112 @@ class work_queue {
    const work_queue &operator =(const work_queue &) = delete;
    const work_queue &operator =(work_queue &&) = delete;
 
-   //! Construct a new work_queue
+   //! Options for constructing a work_queue.
+   struct config {
+      /*! \brief The most items the queue may hold at once, or 0 for no limit.
+       *
+       * Out of band items count towards the limit too.
+       */
+      ::std::size_t capacity = 0;
+      //! Allow several threads to dequeue from the queue at once.
+      bool multiple_consumers = false;
+      /*! \brief Allow producers to register a producer_lane.
+       *
+       * Can't be combined with multiple_consumers.
+       */
+      bool producer_lanes = false;
+      /*! \brief Give the queue an eventfd to wait on, see event_fd().
+       *
+       * Can't be combined with multiple_consumers.
+       */
+      bool pollable = false;
+      /*! \brief How many priority classes there are.
+       *
+       * Class 0 is the most urgent, and is where enqueue puts out of band
+       * items. Regular items go in the least urgent class. With only one
+       * class the out of band flag is ignored.
+       */
+      unsigned int priority_classes = 2;
+      /*! \brief The most items in a row each class may have dequeued while
+       * a less urgent class is waiting.
+       *
+       * Empty, or one entry for every class. A quota of 0 means no limit, which
+       * is the default for every class. A class that reaches its quota lets
+       * one item from the next less urgent class that has any go before it
+       * gets another quota's worth. So quotas of {4, 0} mean at least one
+       * regular item for every four out of band ones when both are waiting.
+       */
+      ::std::vector<unsigned int> quotas;
+      /*! \brief The quota drain_until uses for classes that don't have one.
+       *
+       * So that even a queue with strict priorities doesn't spend a whole time
+       * slice on urgent items while regular ones wait.
+       */
+      unsigned int drain_quota = 8;
+      /*! \brief About how many unused nodes each thread keeps for its next
+       * enqueues into an unbounded queue.
+       *
+       * A thread that enqueues gets a private cache of nodes, and nodes go back
+       * to the cache of the thread that allocated them when they're
+       * dequeued. Past this many, they're freed instead, so memory goes back
+       * down after a burst. 0 means every node is freed.
+       */
+      ::std::size_t node_cache_limit = 1024;
+      /*! \brief The NUMA node the queue's consumer runs on, or -1 for none.
+       *
+       * The queue's nodes, and the rings of its producer lanes, are then
+       * allocated on that node, see topology. On a machine without NUMA this
+       * changes nothing.
+       */
+      int numa_node = -1;
+   };
+
+   /*! \brief One producer's private way into a work_queue.
+    *
+    * Only one thread at a time may enqueue through a given producer_lane, and
+    * the queue must have been constructed with config::producer_lanes. Items
+    * from one lane are dequeued in the order they were enqueued. There's no
+    * ordering between lanes, or between a lane and the queue's own
+    * enqueue. Items in a lane don't count towards the queue's capacity, the
+    * lane has its own.
+    *
+    * Items still in the lane when it's destroyed are still dequeued. Every
+    * producer_lane must be destroyed before the queue it belongs to.
+    */
+   class producer_lane {
+    public:
+      //! How many items a lane holds if not told otherwise.
+      static constexpr ::std::size_t default_capacity = 256;
+
+      //! Register a new lane into wq that holds at least capacity items.
+      explicit producer_lane(work_queue &wq,
+                             ::std::size_t capacity = default_capacity);
+      producer_lane(const producer_lane &) = delete;
+      producer_lane(producer_lane &&) = delete;
+      const producer_lane &operator =(const producer_lane &) = delete;
+      const producer_lane &operator =(producer_lane &&) = delete;
+      //! Tell the queue it can forget the lane once it's been emptied.
+      ~producer_lane();
+
+      //! Enqueue an item, waiting for room in the lane if it's full.
+      void enqueue(work_item_t item);
+
+      /*! \brief Enqueue an item if there's room in the lane right now.
+       *
+       * \return true if the item was queued. Item is left alone if it wasn't.
+       */
+      bool try_enqueue(work_item_t &&item);
+
+    private:
+      friend class work_queue;
+      struct lane_t;
+      lane_t * const lane_;
+   };
+
+   //! Construct a new, unbounded work_queue
    work_queue();
+   //! Construct a new work_queue configured by cfg
+   explicit work_queue(const config &cfg);
    //! Destroy the work_queue
    ~work_queue();
 
@@ -51,9 +225,250 @@ class work_queue {
     * \param[in] out_of_band This work item should be handled before all the
     *                        regular ones because it's a cancellation of a
     *                        previous work item or something similar.
+    *
+    * If the queue is bounded and full this waits until there's room.
     */
    void enqueue(work_item_t item, bool out_of_band = false);
 
+   /*! \brief Enqueue a work item only if there's room for it right now.
+    *
+    * \return true if the item was queued, false if the queue was full. Item is
+    * left alone if it wasn't queued.
+    *
+    * Always succeeds on an unbounded queue.
+    */
+   bool try_enqueue(work_item_t &&item, bool out_of_band = false);
+
+   /*! \brief Enqueue a work item, waiting at most timeout for room.
+    *
+    * \return true if the item was queued, false if the queue stayed full
+    * until the timeout. Item is left alone if it wasn't queued.
+    */
+   template <class Rep, class Period>
+   bool enqueue_for(work_item_t &&item,
+                    const ::std::chrono::duration<Rep, Period> &timeout,
+                    bool out_of_band = false)
+   {
+      using ::std::chrono::steady_clock;
+      return enqueue_until(
+         ::std::move(item),
+         steady_clock::now() +
+         ::std::chrono::duration_cast<steady_clock::duration>(timeout),
+         out_of_band);
+   }
+
+   //! Like enqueue_for, but with a deadline instead of a timeout.
+   bool enqueue_until(work_item_t &&item,
+                      ::std::chrono::steady_clock::time_point deadline,
+                      bool out_of_band = false);
+
+   //! The most items this queue can hold, 0 if it's unbounded.
+   ::std::size_t capacity() const;
+
+   //! The NUMA node the queue was put on, -1 if it wasn't.
+   int numa_node() const;
+
+   /*! \brief Enqueue a work item in a particular priority class.
+    *
+    * \param[in] item     The work item to be queued.
+    * \param[in] priority The class to put it in, 0 being the most urgent.
+    *                     Throws ::std::invalid_argument if there's no such
+    *                     class.
+    *
+    * If the queue is bounded and full this waits until there's room.
+    */
+   void enqueue_at(work_item_t item, unsigned int priority);
+
+   //! Like enqueue_at, but give up and return false if the queue is full.
+   bool try_enqueue_at(work_item_t &&item, unsigned int priority);
+
+   //! How many priority classes the queue was constructed with.
+   unsigned int priority_classes() const;
+
+   /*! \brief A way to take back an item that hasn't been dequeued yet.
+    *
+    * Tickets are cheap to copy, but only one copy can cancel. A ticket must
+    * not be used after its queue is destroyed.
+    */
+   class ticket {
+    public:
+      //! A ticket for nothing, cancel always fails.
+      ticket() noexcept : node_(nullptr), state_(0) {}
+
+      /*! \brief Revoke the item if it hasn't been dequeued yet.
+       *
+       * \return true if the item was revoked, false if it was already
+       * dequeued (or this ticket was already used).
+       *
+       * This takes constant time no matter how long the queue is. The item
+       * is destroyed before this returns. Its place in the queue is given
+       * back when the reader gets to it, which costs the reader a little, but
+       * not a call to the item.
+       */
+      bool cancel();
+
+      //! Is this a ticket for something?
+      explicit operator bool() const noexcept { return node_ != nullptr; }
+
+    private:
+      friend class work_queue;
+      ticket(node_t *node, ::std::uint64_t state) noexcept
+           : node_(node), state_(state)
+      {
+      }
+
+      node_t *node_;
+      ::std::uint64_t state_;
+   };
+
+   /*! \brief Enqueue a work item like enqueue does, and get a ticket that can
+    * cancel it.
+    *
+    * Revoked items are never handed out by dequeue or drain. An item is
+    * handed out by dequeue once the ticket can no longer cancel it, so
+    * cancelling and dequeueing never both succeed.
+    */
+   ticket enqueue_with_ticket(work_item_t item, bool out_of_band = false);
+
+   /*! \brief Enqueue an item that supersedes any pending item with the same
+    * key.
+    *
+    * \param[in] key         Identifies what the item is about.
+    * \param[in] item        The work item to be queued.
+    * \param[in] out_of_band Same as for enqueue, if the item is new.
+    * \return true if the item replaced one already in the queue.
+    *
+    * If an item enqueued by enqueue_coalesced with the same key hasn't been
+    * dequeued yet, it's replaced by this one, which takes its place in the
+    * queue (and its priority class). The replaced item is destroyed without
+    * being called, and the reader isn't woken up again. Otherwise this works
+    * like enqueue.
+    *
+    * The keys of pending items are kept in a map guarded by a mutex, so this
+    * costs more than enqueue. It's meant for notifications like "this
+    * changed, go recompute" where only the latest one matters.
+    */
+   bool enqueue_coalesced(::std::uint64_t key, work_item_t item,
+                          bool out_of_band = false);
+
+   //! How many items enqueue_coalesced has replaced so far.
+   ::std::uint64_t coalesced_count() const;
+
+   //! What stats() reports.
+   struct stats_snapshot {
+      //! How deep one priority class has been.
+      struct depth {
+         //! How many items are in the class now.
+         ::std::uint64_t current;
+         //! The most items that have been in the class at once.
+         ::std::uint64_t high_water;
+      };
+
+      //! False if SPARKLES_WORK_QUEUE_STATS was 0, and everything else is 0.
+      bool enabled = false;
+      //! Items enqueued, including through producer lanes.
+      ::std::uint64_t enqueued = 0;
+      //! Items dequeued (or drained), including from producer lanes.
+      ::std::uint64_t dequeued = 0;
+      //! Items cancelled through a ticket that the reader has passed.
+      ::std::uint64_t cancelled = 0;
+      //! One entry for each priority class, producer lanes aren't included.
+      ::std::vector<depth> class_depths;
+      /*! \brief How many nanoseconds items spent in the queue, from enqueue
+       * to dequeue.
+       *
+       * Items that went through producer lanes aren't included.
+       */
+      latency_histogram::snapshot latency;
+   };
+
+   /*! \brief A snapshot of the queue's counters, depths and latencies.
+    *
+    * These are only kept if the library was built with
+    * SPARKLES_WORK_QUEUE_STATS set to 1. Keeping them costs a couple of atomic
+    * operations and a clock read at each end for every item.
+    */
+   stats_snapshot stats() const;
+
+   //! How many inline items set_owner allows inside each other by default.
+   static constexpr unsigned int default_inline_depth = 8;
+
+   /*! \brief Make the calling thread the queue's owner, which lets it run
+    * items meant for the queue right away with try_run_inline.
+    *
+    * remote_operation::promise uses this, so a promise fulfilled on the
+    * thread that owns its queue finishes its operation immediately instead of
+    * at the next dequeue. That skips ahead of anything already queued, which is
+    * why it's off until this is called.
+    *
+    * An inline item may fulfill another promise, and so on, so at most
+    * max_depth of them run inside each other. Past that, items are left to be
+    * enqueued. A max_depth of 0 is the same as clear_owner().
+    */
+   void set_owner(unsigned int max_depth = default_inline_depth);
+
+   //! Go back to never running items inline. Only the owner may call this.
+   void clear_owner();
+
+   /*! \brief Run item right here, if this is the owner's thread and it isn't
+    * too deep in inline items already.
+    *
+    * \return true if item was run, false if it was left alone and should be
+    * enqueued. Anything item throws propagates, after which it has been run.
+    */
+   bool try_run_inline(work_item_t &item);
+
+   /*! \brief Enqueue a whole batch of work items at once.
+    *
+    * \param[in] items       Any range of things convertible to work_item_t.
+    *                        The elements are moved from.
+    * \param[in] out_of_band Whether the whole batch is out of band.
+    *
+    * The batch is linked together privately and then added to the queue with
+    * a single atomic operation, and the reader is told about all of it with a
+    * single post to the semaphore. The items will be dequeued in the order
+    * they appear in the range, and no item enqueued by another thread will
+    * appear in the middle of them.
+    *
+    * On a bounded queue, room for the whole batch is claimed before any of it
+    * is queued. Only one batch at a time claims room, so two batches can't
+    * each hold part of what the other needs. A batch bigger than the capacity
+    * could never fit, so it throws ::std::invalid_argument. A range that can
+    * only be read once is moved into a vector first, to count it.
+    *
+    * If converting an item throws, nothing from the batch is enqueued.
+    */
+   template <class Range>
+   void enqueue_bulk(Range &&items, bool out_of_band = false) {
+      typedef typename ::std::iterator_traits<
+         decltype(::std::begin(items))>::iterator_category category_t;
+      item_chain chain;
+      if constexpr (::std::is_base_of< ::std::forward_iterator_tag,
+                                       category_t>::value) {
+         if (capacity() != 0) {
+            chain_reserve(chain, static_cast< ::std::size_t>(
+                             ::std::distance(::std::begin(items),
+                                             ::std::end(items))));
+         }
+      } else if (capacity() != 0) {
+         ::std::vector<work_item_t> counted;
+         for (auto &&item: items) {
+            counted.emplace_back(::std::move(item));
+         }
+         enqueue_bulk(counted, out_of_band);
+         return;
+      }
+      try {
+         for (auto &&item: items) {
+            chain_append(chain, work_item_t(::std::move(item)));
+         }
+      } catch (...) {
+         chain_discard(chain);
+         throw;
+      }
+      chain_commit(chain, out_of_band);
+   }
+
    /*! \brief Deqeue a work item, blocking or not as requested.
     *
     * \param[in] block Wait for a work item to be available.
@@ -67,14 +482,159 @@ class work_queue {
     */
    possible_work_item_t dequeue(bool block);
 
+   /*! \brief Dequeue a work item, waiting for one until deadline at the most.
+    *
+    * \return The work item that was dequeued, or nothing if the deadline
+    * passed first.
+    */
+   possible_work_item_t
+   dequeue_until(::std::chrono::steady_clock::time_point deadline);
+
+   //! Like dequeue_until, but with a timeout instead of a deadline.
+   template <class Rep, class Period>
+   possible_work_item_t
+   dequeue_for(const ::std::chrono::duration<Rep, Period> &timeout) {
+      using ::std::chrono::steady_clock;
+      return dequeue_until(
+         steady_clock::now() +
+         ::std::chrono::duration_cast<steady_clock::duration>(timeout)
+         );
+   }
+
+   /*! \brief Hand every currently available item (up to max_items) to
+    * visitor, without blocking.
+    *
+    * \param[in] visitor   Called as visitor(work_item_t &) for each item, in
+    *                      the order dequeue would have returned them. The item
+    *                      is destroyed after the visitor returns, so it's fine
+    *                      to move from it.
+    * \param[in] max_items The most items to hand out.
+    * \return The number of items handed to visitor.
+    *
+    * This claims all the available items from the semaphore at once, and the
+    * items are visited where they sit instead of being moved into a
+    * possible_work_item_t first.
+    *
+    * If visitor throws, the item it threw on is discarded and every item not
+    * yet visited stays on the queue.
+    */
+   template <class Visitor>
+   ::std::size_t drain(Visitor &&visitor, ::std::size_t max_items) {
+      typedef typename ::std::remove_reference<Visitor>::type visitor_t;
+      return drain_impl([](void *v, work_item_t &item) -> void {
+            (*static_cast<visitor_t *>(v))(item);
+         }, const_cast<void *>(static_cast<const void *>(&visitor)), max_items);
+   }
+
+   //! Execute up to max_items of the currently available items.
+   ::std::size_t drain(::std::size_t max_items) {
+      return drain([](work_item_t &item) -> void { item(); }, max_items);
+   }
+
+   //! What drain_until and drain_for did.
+   struct drain_report {
+      //! How many items were run.
+      ::std::size_t ran;
+      //! Roughly how many items are still waiting, see backlog().
+      ::std::size_t backlog;
+   };
+
+   /*! \brief Run available items until deadline passes or max_items have
+    * been run, whichever comes first, without blocking.
+    *
+    * This is for a reader that has other things to do and wants to work
+    * through a backlog a slice at a time. The clock is checked after every
+    * item, so a slice can overrun by at most the time one item takes.
+    *
+    * Less urgent priority classes aren't starved during a slice. Classes
+    * without a quota of their own are given config::drain_quota, so regular
+    * items keep moving even while out of band items pour in.
+    *
+    * If an item throws, the exception propagates and the rest of the slice is
+    * abandoned.
+    */
+   drain_report drain_until(::std::chrono::steady_clock::time_point deadline,
+                            ::std::size_t max_items = SIZE_MAX);
+
+   //! drain_until with a time budget instead of a deadline.
+   template <class Rep, class Period>
+   drain_report drain_for(const ::std::chrono::duration<Rep, Period> &budget,
+                          ::std::size_t max_items = SIZE_MAX)
+   {
+      using ::std::chrono::steady_clock;
+      return drain_until(
+         steady_clock::now() +
+         ::std::chrono::duration_cast<steady_clock::duration>(budget),
+         max_items);
+   }
+
+   /*! \brief About how many items are waiting to be dequeued.
+    *
+    * Only the reader should call this, and even then it's out of date as soon
+    * as it returns. Cancelled items that the reader hasn't passed yet are
+    * counted.
+    */
+   ::std::size_t backlog() const;
+
+   /*! \brief A file descriptor that's readable when there may be items, or -1
+    * if the queue isn't pollable.
+    *
+    * The descriptor is an eventfd owned by the queue. Don't read it, write it
+    * or close it. It's meant to be watched edge triggered (EPOLLET), and
+    * drain_signalled() called whenever it fires. It's only written to when
+    * the queue goes from having no new items to having some, not once per
+    * item, and it may occasionally be readable when there's nothing to
+    * dequeue.
+    */
+   int event_fd() const;
+
+   /*! \brief Handle event_fd() becoming readable.
+    *
+    * Resets event_fd(), then does drain(visitor, max_items). If that may
+    * have left items behind, event_fd() is made readable again so that the
+    * next epoll_wait returns straight away instead of sleeping on them.
+    */
+   template <class Visitor>
+   ::std::size_t drain_signalled(Visitor &&visitor, ::std::size_t max_items) {
+      reset_signal();
+      ::std::size_t drained = 0;
+      try {
+         drained = drain(::std::forward<Visitor>(visitor), max_items);
+      } catch (...) {
+         raise_signal();
+         throw;
+      }
+      if (drained >= max_items) {
+         raise_signal();
+      }
+      return drained;
+   }
+
+   //! drain_signalled, executing the items.
+   ::std::size_t drain_signalled(::std::size_t max_items) {
+      return drain_signalled([](work_item_t &item) -> void { item(); },
+                             max_items);
+   }
+
  private:
    struct impl_t;
-   struct node_t;
+   //! A batch of items being put together by enqueue_bulk.
+   struct item_chain {
+      node_t *first_ = nullptr;
+      node_t *last_ = nullptr;
+      ::std::size_t count_ = 0;
+      //! Room already claimed on a bounded queue and not yet used.
+      ::std::size_t reserved_ = 0;
+   };
+   typedef void (*visit_func_t)(void *visitor, work_item_t &item);
+   //! How big impl_t is, the statistics take a little more room.
+   static constexpr ::std::size_t impl_size =
+      SPARKLES_WORK_QUEUE_STATS ? 624 : 616;
    //! Ugly private thing to make Fast Pimpl work.
    union impl_data {
       long long alignment1;
       void *alignment2;
-      char data[192];
+      char data[impl_size];
    };
 
    //! Implements the Fast Pimpl idiom from http://www.gotw.ca/gotw/028.htm
@@ -83,9 +643,32 @@ class work_queue {
    inline impl_t &impl_();
    inline const impl_t &impl_() const;
    inline node_t *make_new_node(impl_t &imp);
-   inline void free_queue(node_t *head);
-   inline node_t *remove_from_queue(node_t *&head, node_t *&tail);
-   work_item_t real_dequeue(impl_t &impl);
+   inline void free_node(impl_t &impl, node_t *node);
+   inline void push_node(impl_t &impl, node_t *node, work_item_t &&item,
+                         unsigned int priority);
+   inline void recycle_node(impl_t &impl, node_t *node);
+   inline node_t *try_pop_node(impl_t &impl, bool fair);
+   inline void served_from(impl_t &impl, unsigned int priority);
+   static void check_priority(const impl_t &impl, unsigned int priority);
+   inline node_t *pop_node(impl_t &impl, bool fair = false);
+   bool claim_node(impl_t &impl, node_t *node);
+   bool real_dequeue(impl_t &impl, work_item_t &item, bool fair = false);
+   bool take_shared(impl_t &impl, work_item_t &item, bool fair = false);
+   friend class queue_set;
+   //! Also notify listener whenever an item is added.
+   void attach_listener(eventcount *listener);
+   //! Stop notifying the listener, and wait for anyone still doing so.
+   void detach_listener();
+   void reset_signal();
+   void raise_signal();
+   void refresh_lanes(impl_t &impl);
+   bool lane_take(impl_t &impl, work_item_t &item, bool fair = false);
+   void chain_reserve(item_chain &chain, ::std::size_t count);
+   void chain_append(item_chain &chain, work_item_t item);
+   void chain_discard(item_chain &chain) noexcept;
+   void chain_commit(item_chain &chain, bool out_of_band);
+   ::std::size_t drain_impl(visit_func_t visit, void *visitor,
+                            ::std::size_t max_items);
 };
 
 } // namespace sparkles
@@ -0,0 +1,79 @@
+#pragma once
+
+#include <sparkles/event_loop.hpp>
+#include <sparkles/work_queue.hpp>
+#include <atomic>
+#include <thread>
+#include <vector>
+
+namespace sparkles {
+
+/*! \brief A thread of its own that runs the items of its own work_queue,
+ * optionally pinned to some CPUs.
+ *
+ * The thread runs an event_loop on queue() until the worker_thread is
+ * destroyed. When it's given CPUs that all belong to one NUMA node, the queue
+ * is put on that node too (see work_queue::config::numa_node), so the memory
+ * the worker reads its items from is local to it. Without CPUs, or on a machine
+ * without NUMA, it's just a thread with a queue.
+ *
+ * A worker near whoever will consume a result is a good place to fulfill a
+ * promise from, nearest() finds one:
+ *
+ * \code
+ * worker_thread *near = worker_thread::nearest(workers, consumer.numa_node());
+ * near->queue().enqueue([promise]() { promise->set_result(compute()); });
+ * \endcode
+ *
+ * Items still in the queue when the worker is destroyed are destroyed without
+ * being run. An item that throws ends the program, like any other exception
+ * that escapes a thread.
+ */
+class worker_thread {
+ public:
+   /*! \brief Start a thread pinned to cpus, or not pinned at all if cpus is
+    * empty, with a queue made from cfg.
+    *
+    * cfg.numa_node is overridden with the node of cpus. Throws
+    * ::std::system_error if the thread can't be pinned.
+    */
+   explicit worker_thread(::std::vector<unsigned int> cpus = {},
+                          work_queue::config cfg = work_queue::config{});
+   worker_thread(const worker_thread &) = delete;
+   worker_thread(worker_thread &&) = delete;
+   const worker_thread &operator =(const worker_thread &) = delete;
+   const worker_thread &operator =(worker_thread &&) = delete;
+   //! Stops the thread once the item it's running returns, and waits for it.
+   ~worker_thread();
+
+   //! The queue the thread runs items from.
+   work_queue &queue() { return queue_; }
+
+   //! The NUMA node the thread runs on, or -1 if it's not just one.
+   int numa_node() const { return queue_.numa_node(); }
+
+   //! The CPUs the thread is pinned to, empty if it isn't.
+   const ::std::vector<unsigned int> &cpus() const { return cpus_; }
+
+   ::std::thread::id id() const { return thread_.get_id(); }
+
+   /*! \brief The worker nearest to numa_node, by topology::system()'s
+    * distances, or nullptr if there are no workers.
+    *
+    * Workers that aren't on one node, and any numa_node that's negative, are
+    * taken to be far from everything. Ties go to the earliest worker.
+    */
+   static worker_thread *nearest(const ::std::vector<worker_thread *> &workers,
+                                 int numa_node);
+
+ private:
+   const ::std::vector<unsigned int> cpus_;
+   work_queue queue_;
+   event_loop loop_;
+   ::std::atomic<bool> done_;
+   ::std::thread thread_;
+
+   void run();
+};
+
+} // namespace sparkles
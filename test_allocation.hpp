@@ -0,0 +1,38 @@
+#pragma once
+
+namespace sparkles {
+namespace test {
+
+/*! \brief While one of these exists, the global operator new fails on this
+ * thread.
+ *
+ * inplace_function_test.cpp replaces operator new for the whole test binary,
+ * and this and allocation_counter are defined there.
+ */
+class allocation_failure {
+ public:
+   allocation_failure();
+   allocation_failure(const allocation_failure &) = delete;
+   const allocation_failure &operator =(const allocation_failure &) = delete;
+   ~allocation_failure();
+};
+
+/*! \brief Counts the calls to the global operator new this thread makes while
+ * it exists.
+ */
+class allocation_counter {
+ public:
+   allocation_counter();
+   allocation_counter(const allocation_counter &) = delete;
+   const allocation_counter &operator =(const allocation_counter &) = delete;
+   ~allocation_counter();
+
+   unsigned long count() const { return count_; }
+
+ private:
+   unsigned long count_;
+   unsigned long * const saved_;
+};
+
+} // namespace test
+} // namespace sparkles
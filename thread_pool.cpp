@@ -0,0 +1,333 @@
+#include <sparkles/thread_pool.hpp>
+#include <sparkles/chase_lev_deque.hpp>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <stdexcept>
+
+namespace sparkles {
+
+namespace {
+
+::std::int64_t now_ticks()
+{
+   return ::std::chrono::steady_clock::now().time_since_epoch().count();
+}
+
+} // Anonymous namespace
+
+/*! \brief One of the pool's threads, and the deque of tasks it owns.
+ *
+ * The tasks in the deque are allocated with new, since the deque only holds
+ * pointers. rng_ is an xorshift generator for picking who to steal from, it
+ * doesn't need to be any good, just different for every worker.
+ *
+ * A worker is stopped until the pool starts a thread for it, and when that
+ * thread retires it's exited until the supervisor joins it, and then it's
+ * stopped again and can be started again. Only the owning thread pushes onto
+ * the deque, and a thread only retires when it's empty, so whoever owns it
+ * next starts with it empty.
+ */
+struct thread_pool::worker {
+   enum state_t { stopped, running, exited };
+
+   worker(thread_pool &pool, ::std::uint64_t seed)
+        : pool_(pool), rng_(seed | 1), state_(stopped), idle_since_(0)
+   {
+   }
+   ~worker() {
+      while (work_item_t * const task = tasks_.pop()) {
+         delete task;
+      }
+   }
+
+   ::std::uint64_t random() {
+      rng_ ^= rng_ << 13;
+      rng_ ^= rng_ >> 7;
+      rng_ ^= rng_ << 17;
+      return rng_;
+   }
+
+   //! Note that the thread has run out of things to do, if it hadn't already.
+   void idle() {
+      if (idle_since_.load(::std::memory_order_relaxed) == 0) {
+         idle_since_.store(now_ticks(), ::std::memory_order_relaxed);
+      }
+   }
+   void busy() {
+      idle_since_.store(0, ::std::memory_order_relaxed);
+   }
+
+   thread_pool &pool_;
+   priv::chase_lev_deque<work_item_t *> tasks_;
+   ::std::uint64_t rng_;
+   ::std::atomic<int> state_;
+   //! When the thread went idle, in steady_clock ticks, or 0 if it's busy.
+   ::std::atomic< ::std::int64_t> idle_since_;
+   ::std::thread thread_;
+};
+
+thread_local thread_pool::worker *thread_pool::current_ = nullptr;
+
+unsigned int thread_pool::default_size()
+{
+   const unsigned int cpus = ::std::thread::hardware_concurrency();
+   return (cpus > 0) ? cpus : 1;
+}
+
+work_queue::config thread_pool::queue_config()
+{
+   work_queue::config cfg;
+   cfg.multiple_consumers = true;
+   return cfg;
+}
+
+thread_pool::config thread_pool::fixed(unsigned int threads)
+{
+   config cfg;
+   cfg.min_threads = threads;
+   cfg.max_threads = threads;
+   return cfg;
+}
+
+thread_pool::thread_pool(unsigned int threads)
+     : thread_pool(fixed(threads))
+{
+}
+
+thread_pool::thread_pool(const config &cfg)
+     : cfg_(cfg), queue_(queue_config()), done_(false), running_(0),
+       target_(cfg.min_threads), short_samples_(0)
+{
+   if (cfg_.min_threads == 0) {
+      throw ::std::invalid_argument("A thread_pool needs at least one thread.");
+   } else if (cfg_.min_threads > cfg_.max_threads) {
+      throw ::std::invalid_argument("A thread_pool's min_threads can't be more "
+                                    "than its max_threads.");
+   }
+   // Every worker has to exist before any thread starts stealing from them.
+   workers_.reserve(cfg_.max_threads);
+   for (unsigned int i = 0; i < cfg_.max_threads; ++i) {
+      workers_.emplace_back(
+         new worker(*this, 0x9e3779b97f4a7c15ULL * (i + 1)));
+   }
+   try {
+      for (unsigned int i = 0; i < cfg_.min_threads; ++i) {
+         start_worker();
+      }
+      if (cfg_.min_threads < cfg_.max_threads) {
+         supervisor_ = ::std::thread(&thread_pool::supervise, this);
+      }
+   } catch (...) {
+      stop();
+      throw;
+   }
+}
+
+thread_pool::~thread_pool()
+{
+   stop();
+}
+
+void thread_pool::stop()
+{
+   done_.store(true, ::std::memory_order_seq_cst);
+   // The supervisor first, so nothing starts a thread behind our back.
+   stop_supervisor_.release();
+   if (supervisor_.joinable()) {
+      supervisor_.join();
+   }
+   idle_.notify_all();
+   for (const auto &w: workers_) {
+      if (w->thread_.joinable()) {
+         w->thread_.join();
+      }
+   }
+   workers_.clear();
+}
+
+void thread_pool::post(work_item_t task)
+{
+   worker * const me = current_;
+   if ((me != nullptr) && (&me->pool_ == this)) {
+      me->tasks_.push(new work_item_t(::std::move(task)));
+   } else {
+      queue_.enqueue(::std::move(task));
+   }
+   idle_.notify_one();
+}
+
+thread_pool::metrics_snapshot thread_pool::metrics() const
+{
+   metrics_snapshot result;
+   result.current_threads = running_.load(::std::memory_order_relaxed);
+   result.target_threads = target_.load(::std::memory_order_relaxed);
+   result.idle_threads = 0;
+   // The queue has no producer lanes, so its backlog is just a counter and
+   // anyone can read it.
+   result.backlog = queue_.backlog();
+   for (const auto &w: workers_) {
+      result.backlog += w->tasks_.size();
+      if ((w->state_.load(::std::memory_order_relaxed) == worker::running) &&
+          (w->idle_since_.load(::std::memory_order_relaxed) != 0))
+      {
+         ++result.idle_threads;
+      }
+   }
+   return result;
+}
+
+void thread_pool::run(worker &me)
+{
+   current_ = &me;
+   work_item_t task;
+   while (!done_.load(::std::memory_order_acquire)) {
+      if (find_task(me, task)) {
+         me.busy();
+         task();
+         task = nullptr;
+         continue;
+      }
+      // My deque is empty, and only I put things in it.
+      if (retire()) {
+         break;
+      }
+      me.idle();
+      const eventcount::key_t key = idle_.prepare_wait();
+      if (done_.load(::std::memory_order_acquire) || find_task(me, task)) {
+         idle_.cancel_wait();
+         if (task) {
+            me.busy();
+            task();
+            task = nullptr;
+         }
+      } else {
+         idle_.wait(key);
+      }
+   }
+   current_ = nullptr;
+   me.state_.store(worker::exited, ::std::memory_order_release);
+}
+
+bool thread_pool::find_task(worker &me, work_item_t &task)
+{
+   if (work_item_t * const mine = me.tasks_.pop()) {
+      task = ::std::move(*mine);
+      delete mine;
+      return true;
+   }
+   if (auto queued = queue_.dequeue(false)) {
+      task = ::std::move(queued.value());
+      return true;
+   }
+   return steal(me, task);
+}
+
+bool thread_pool::steal(worker &me, work_item_t &task)
+{
+   const ::std::size_t count = workers_.size();
+   const ::std::size_t first = me.random() % count;
+   for (::std::size_t i = 0; i < count; ++i) {
+      worker &victim = *workers_[(first + i) % count];
+      if (&victim == &me) {
+         continue;
+      }
+      if (work_item_t * const stolen = victim.tasks_.steal()) {
+         task = ::std::move(*stolen);
+         delete stolen;
+         return true;
+      }
+   }
+   return false;
+}
+
+bool thread_pool::retire()
+{
+   unsigned int running = running_.load(::std::memory_order_relaxed);
+   while (running > target_.load(::std::memory_order_relaxed)) {
+      if (running_.compare_exchange_weak(running, running - 1,
+                                         ::std::memory_order_relaxed))
+      {
+         return true;
+      }
+   }
+   return false;
+}
+
+bool thread_pool::start_worker()
+{
+   for (const auto &w: workers_) {
+      if (w->state_.load(::std::memory_order_acquire) == worker::stopped) {
+         w->busy();
+         w->state_.store(worker::running, ::std::memory_order_relaxed);
+         w->thread_ = ::std::thread(&thread_pool::run, this, ::std::ref(*w));
+         running_.fetch_add(1, ::std::memory_order_relaxed);
+         return true;
+      }
+   }
+   return false;
+}
+
+void thread_pool::supervise()
+{
+   const auto interval = cfg_.sample_interval;
+   while (!stop_supervisor_.acquire_for(interval)) {
+      sample();
+   }
+}
+
+void thread_pool::sample()
+{
+   for (const auto &w: workers_) {
+      if (w->state_.load(::std::memory_order_acquire) == worker::exited) {
+         w->thread_.join();
+         w->state_.store(worker::stopped, ::std::memory_order_relaxed);
+      }
+   }
+   const metrics_snapshot now = metrics();
+   unsigned int target = now.target_threads;
+   const ::std::int64_t idle_timeout =
+      ::std::chrono::duration_cast< ::std::chrono::steady_clock::duration>(
+         cfg_.idle_timeout).count();
+   const ::std::int64_t ticks = now_ticks();
+   bool idle_long = false;
+   for (const auto &w: workers_) {
+      const ::std::int64_t since =
+         w->idle_since_.load(::std::memory_order_relaxed);
+      if ((w->state_.load(::std::memory_order_relaxed) == worker::running) &&
+          (since != 0) && (ticks - since >= idle_timeout))
+      {
+         idle_long = true;
+      }
+   }
+   if ((now.idle_threads == 0) &&
+       (now.backlog > ::std::size_t(cfg_.grow_backlog) * now.current_threads))
+   {
+      // Only grow if it's been short of threads twice in a row, so a burst
+      // that's over by the next sample doesn't start a thread.
+      if ((++short_samples_ >= 2) && (target < cfg_.max_threads)) {
+         ++target;
+         short_samples_ = 0;
+      }
+   } else {
+      short_samples_ = 0;
+      if ((now.backlog == 0) && idle_long && (target > cfg_.min_threads)) {
+         --target;
+      }
+   }
+   if (target != now.target_threads) {
+      target_.store(target, ::std::memory_order_relaxed);
+      if (target < now.target_threads) {
+         // Wake the idle ones so one of them notices and leaves.
+         idle_.notify_all();
+      }
+   }
+   // A thread that's retiring but hasn't exited yet still has its worker, so
+   // there may not be one free until the next sample.
+   while ((running_.load(::std::memory_order_relaxed) < target) &&
+          start_worker())
+   {
+   }
+}
+
+} // namespace sparkles
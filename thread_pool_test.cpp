@@ -0,0 +1,254 @@
+#include <sparkles/thread_pool.hpp>
+#include <sparkles/event_loop.hpp>
+#include <sparkles/semaphore.hpp>
+
+#include <boost/test/unit_test.hpp>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <stdexcept>
+#include <system_error>
+#include <thread>
+#include <vector>
+
+namespace sparkles {
+namespace test {
+
+BOOST_AUTO_TEST_SUITE(thread_pool_test)
+
+BOOST_AUTO_TEST_CASE( results )
+{
+   using ::std::chrono::seconds;
+   thread_pool pool(3);
+   BOOST_CHECK_EQUAL(pool.size(), 3U);
+   BOOST_CHECK_THROW(thread_pool none(0), ::std::invalid_argument);
+   work_queue wq;
+   event_loop loop(wq);
+
+   ::std::unique_ptr<int> moveonly(new int(6));
+   auto value = pool.submit(wq, [p = ::std::move(moveonly)]() {
+         return *p * 7;
+      });
+   BOOST_REQUIRE(loop.run_for(value, seconds(10)));
+   BOOST_CHECK_EQUAL(value->result(), 42);
+
+   ::std::thread::id ran_on;
+   auto nothing = pool.submit(wq, [&ran_on]() {
+         ran_on = ::std::this_thread::get_id();
+      });
+   BOOST_REQUIRE(loop.run_for(nothing, seconds(10)));
+   BOOST_CHECK(nothing->is_valid());
+   BOOST_CHECK(ran_on != ::std::this_thread::get_id());
+
+   auto thrown = pool.submit(wq, []() -> int {
+         throw ::std::out_of_range("Out of range!");
+      });
+   BOOST_REQUIRE(loop.run_for(thrown, seconds(10)));
+   BOOST_CHECK(thrown->is_exception());
+   BOOST_CHECK_THROW(thrown->result(), ::std::out_of_range);
+
+   auto errored = pool.submit(wq, []() {
+         op_result<int> result;
+         result.set_bad_result(::std::make_error_code(::std::errc::timed_out));
+         return result;
+      });
+   BOOST_REQUIRE(loop.run_for(errored, seconds(10)));
+   BOOST_REQUIRE(errored->is_error());
+   BOOST_CHECK(errored->error() == ::std::errc::timed_out);
+}
+
+BOOST_AUTO_TEST_CASE( dropped_tasks_skipped )
+{
+   thread_pool pool(1);
+   work_queue wq;
+   event_loop loop(wq);
+   semaphore go;
+   ::std::atomic<int> ran(0);
+   // Keep the only thread busy while the next task is dropped.
+   auto blocker = pool.submit(wq, [&go, &ran]() { go.acquire(); ++ran; });
+   auto dropped = pool.submit(wq, [&ran]() { ran += 10; });
+   dropped.reset();
+   auto last = pool.submit(wq, [&ran]() { ran += 100; });
+   go.release();
+   BOOST_REQUIRE(loop.run_for(last, ::std::chrono::seconds(10)));
+   BOOST_CHECK(blocker->finished());
+   BOOST_CHECK_EQUAL(ran.load(), 101);
+}
+
+BOOST_AUTO_TEST_CASE( broken_promises )
+{
+   work_queue wq;
+   event_loop loop(wq);
+   semaphore started, go;
+   operation<void>::ptr_t blocker;
+   operation<int>::ptr_t never_started;
+   ::std::thread releaser;
+   {
+      thread_pool pool(1);
+      blocker = pool.submit(wq, [&started, &go]() {
+            started.release();
+            go.acquire();
+         });
+      never_started = pool.submit(wq, []() { return 1; });
+      started.acquire();
+      // Long enough for the pool to be told to stop first.
+      releaser = ::std::thread([&go]() {
+            ::std::this_thread::sleep_for(::std::chrono::milliseconds(50));
+            go.release();
+         });
+   }
+   releaser.join();
+   BOOST_REQUIRE(loop.run_for(blocker, ::std::chrono::seconds(10)));
+   BOOST_CHECK(blocker->is_valid());
+   BOOST_REQUIRE(loop.run_for(never_started, ::std::chrono::seconds(10)));
+   BOOST_CHECK_THROW(never_started->result(), broken_promise);
+}
+
+BOOST_AUTO_TEST_CASE( many_tasks )
+{
+   thread_pool pool(4);
+   work_queue wq;
+   event_loop loop(wq);
+   ::std::vector<operation<int>::ptr_t> ops;
+   for (int i = 0; i < 1000; ++i) {
+      ops.push_back(pool.submit(wq, [i]() { return i * 2; }));
+   }
+   for (int i = 0; i < 1000; ++i) {
+      BOOST_REQUIRE(loop.run_for(ops[i], ::std::chrono::seconds(10)));
+      BOOST_CHECK_EQUAL(ops[i]->result(), i * 2);
+   }
+}
+
+BOOST_AUTO_TEST_CASE( local_tasks_lifo )
+{
+   thread_pool pool(1);
+   work_queue wq;
+   event_loop loop(wq);
+   ::std::vector<int> order;
+   auto parent = pool.submit(wq, [&pool, &order]() {
+         for (int i = 0; i < 3; ++i) {
+            pool.post([&order, i]() { order.push_back(i); });
+         }
+      });
+   BOOST_REQUIRE(loop.run_for(parent, ::std::chrono::seconds(10)));
+   // Posted from a pool thread, so they're that thread's next tasks, newest
+   // first.
+   auto last = pool.submit(wq, []() {});
+   BOOST_REQUIRE(loop.run_for(last, ::std::chrono::seconds(10)));
+   BOOST_CHECK((order == ::std::vector<int>{2, 1, 0}));
+}
+
+namespace {
+
+//! Count the leaves of a binary tree of tasks depth deep.
+void fan_out(thread_pool &pool, int depth, ::std::atomic<int> &leaves,
+             semaphore &done, int total)
+{
+   if (depth == 0) {
+      if (leaves.fetch_add(1) + 1 == total) {
+         done.release();
+      }
+      return;
+   }
+   for (int i = 0; i < 2; ++i) {
+      pool.post([&pool, depth, &leaves, &done, total]() {
+            fan_out(pool, depth - 1, leaves, done, total);
+         });
+   }
+}
+
+} // Anonymous namespace
+
+BOOST_AUTO_TEST_CASE( recursive_fan_out )
+{
+   thread_pool pool(4);
+   ::std::atomic<int> leaves(0);
+   semaphore done;
+   const int depth = 12;
+   pool.post([&pool, &leaves, &done]() {
+         fan_out(pool, depth, leaves, done, 1 << depth);
+      });
+   BOOST_REQUIRE(done.acquire_until(::std::chrono::steady_clock::now() +
+                                    ::std::chrono::seconds(30)));
+   BOOST_CHECK_EQUAL(leaves.load(), 1 << depth);
+}
+
+BOOST_AUTO_TEST_CASE( sizes_checked )
+{
+   thread_pool::config cfg;
+   cfg.min_threads = 0;
+   BOOST_CHECK_THROW(thread_pool none(cfg), ::std::invalid_argument);
+   cfg.min_threads = 3;
+   cfg.max_threads = 2;
+   BOOST_CHECK_THROW(thread_pool backwards(cfg), ::std::invalid_argument);
+
+   thread_pool fixed(3);
+   const thread_pool::metrics_snapshot m = fixed.metrics();
+   BOOST_CHECK_EQUAL(m.current_threads, 3U);
+   BOOST_CHECK_EQUAL(m.target_threads, 3U);
+}
+
+namespace {
+
+//! Wait up to 10 seconds for pool to have threads threads.
+bool wait_for_size(const thread_pool &pool, unsigned int threads)
+{
+   const auto deadline =
+      ::std::chrono::steady_clock::now() + ::std::chrono::seconds(10);
+   while (pool.size() != threads) {
+      if (::std::chrono::steady_clock::now() > deadline) {
+         return false;
+      }
+      ::std::this_thread::sleep_for(::std::chrono::milliseconds(5));
+   }
+   return true;
+}
+
+} // Anonymous namespace
+
+BOOST_AUTO_TEST_CASE( grows_and_shrinks )
+{
+   thread_pool::config cfg;
+   cfg.min_threads = 1;
+   cfg.max_threads = 3;
+   cfg.sample_interval = ::std::chrono::milliseconds(5);
+   cfg.grow_backlog = 1;
+   cfg.idle_timeout = ::std::chrono::milliseconds(50);
+   thread_pool pool(cfg);
+   BOOST_CHECK_EQUAL(pool.size(), 1U);
+
+   // Tasks that block until they're let go leave a backlog until it's grown
+   // as far as it can.
+   const int tasks = 12;
+   semaphore go, finished;
+   for (int i = 0; i < tasks; ++i) {
+      pool.post([&go, &finished]() { go.acquire(); finished.release(); });
+   }
+   BOOST_CHECK(wait_for_size(pool, 3));
+   thread_pool::metrics_snapshot m = pool.metrics();
+   BOOST_CHECK_EQUAL(m.target_threads, 3U);
+   BOOST_CHECK_EQUAL(m.idle_threads, 0U);
+   BOOST_CHECK_GE(m.backlog, ::std::size_t(tasks - 3));
+
+   go.release(tasks);
+   for (int i = 0; i < tasks; ++i) {
+      BOOST_REQUIRE(finished.acquire_for(::std::chrono::seconds(10)));
+   }
+   // And with nothing to do it lets them go again.
+   BOOST_CHECK(wait_for_size(pool, 1));
+   m = pool.metrics();
+   BOOST_CHECK_EQUAL(m.target_threads, 1U);
+   BOOST_CHECK_EQUAL(m.backlog, 0U);
+
+   // What's left still works.
+   work_queue wq;
+   event_loop loop(wq);
+   auto answer = pool.submit(wq, []() { return 7; });
+   BOOST_REQUIRE(loop.run_for(answer, ::std::chrono::seconds(10)));
+   BOOST_CHECK_EQUAL(answer->result(), 7);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
+
+} // namespace test
+} // namespace sparkles
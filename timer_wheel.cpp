@@ -0,0 +1,195 @@
+#include <sparkles/timer_wheel.hpp>
+
+namespace sparkles {
+
+timer_wheel::timer::~timer()
+{
+   if (wheel_ != nullptr) {
+      wheel_->cancel(*this);
+   }
+}
+
+timer_wheel::timer_wheel(duration resolution)
+     : epoch_(clock::now()),
+       resolution_((resolution > duration::zero()) ? resolution : duration(1)),
+       now_(0), size_(0), due_(nullptr)
+{
+   for (unsigned int level = 0; level < num_levels; ++level) {
+      occupied_[level] = 0;
+      for (unsigned int slot = 0; slot < slots_per_level; ++slot) {
+         slots_[level][slot] = nullptr;
+      }
+   }
+}
+
+timer_wheel::~timer_wheel()
+{
+   auto forget = [](timer *t) {
+      while (t != nullptr) {
+         timer * const next = t->next_;
+         t->wheel_ = nullptr;
+         t->next_ = nullptr;
+         t->pprev_ = nullptr;
+         t = next;
+      }
+   };
+   forget(due_);
+   for (unsigned int level = 0; level < num_levels; ++level) {
+      for (unsigned int slot = 0; slot < slots_per_level; ++slot) {
+         forget(slots_[level][slot]);
+      }
+   }
+}
+
+void timer_wheel::schedule(timer &t, time_point deadline)
+{
+   if (t.wheel_ != nullptr) {
+      t.wheel_->cancel(t);
+   }
+   t.wheel_ = this;
+   t.expiry_ = deadline_tick(deadline);
+   link(t);
+   ++size_;
+}
+
+void timer_wheel::cancel(timer &t)
+{
+   if ((t.wheel_ == this) && t.scheduled()) {
+      unlink(t);
+      --size_;
+   }
+   t.wheel_ = nullptr;
+}
+
+timer_wheel::time_point timer_wheel::next_deadline() const
+{
+   if (due_ != nullptr) {
+      return tick_time(now_);
+   } else if (size_ == 0) {
+      return time_point::max();
+   } else {
+      unsigned int level, slot;
+      return tick_time(next_event(level, slot));
+   }
+}
+
+::std::size_t timer_wheel::expire(time_point now)
+{
+   ::std::size_t ran = run_due();
+   const ::std::uint64_t target = (now > epoch_) ?
+      static_cast< ::std::uint64_t>((now - epoch_) / resolution_) : 0;
+   while ((size_ > 0) && (now_ < target)) {
+      unsigned int level, slot;
+      const ::std::uint64_t next = next_event(level, slot);
+      if (next > target) {
+         break;
+      }
+      now_ = next;
+      timer *t = slots_[level][slot];
+      slots_[level][slot] = nullptr;
+      occupied_[level] &= ~(::std::uint64_t(1) << slot);
+      while (t != nullptr) {
+         timer * const following = t->next_;
+         link(*t);
+         t = following;
+      }
+      ran += run_due();
+   }
+   if (now_ < target) {
+      now_ = target;
+   }
+   return ran;
+}
+
+void timer_wheel::link(timer &t)
+{
+   timer **head;
+   if (t.expiry_ <= now_) {
+      t.level_ = due_level;
+      head = &due_;
+   } else {
+      const unsigned int highest = 63 - __builtin_clzll(t.expiry_ ^ now_);
+      const unsigned int level = highest / level_bits;
+      const unsigned int slot =
+         (t.expiry_ >> (level * level_bits)) & (slots_per_level - 1);
+      t.level_ = static_cast<unsigned char>(level);
+      t.slot_ = static_cast<unsigned char>(slot);
+      occupied_[level] |= ::std::uint64_t(1) << slot;
+      head = &slots_[level][slot];
+   }
+   t.next_ = *head;
+   if (t.next_ != nullptr) {
+      t.next_->pprev_ = &t.next_;
+   }
+   *head = &t;
+   t.pprev_ = head;
+}
+
+void timer_wheel::unlink(timer &t)
+{
+   *t.pprev_ = t.next_;
+   if (t.next_ != nullptr) {
+      t.next_->pprev_ = t.pprev_;
+   }
+   if ((t.level_ != due_level) && (slots_[t.level_][t.slot_] == nullptr)) {
+      occupied_[t.level_] &= ~(::std::uint64_t(1) << t.slot_);
+   }
+   t.next_ = nullptr;
+   t.pprev_ = nullptr;
+}
+
+::std::size_t timer_wheel::run_due()
+{
+   ::std::size_t ran = 0;
+   while (due_ != nullptr) {
+      timer &t = *due_;
+      unlink(t);
+      --size_;
+      t.wheel_ = nullptr;
+      ++ran;
+      t.expired();
+   }
+   return ran;
+}
+
+::std::uint64_t timer_wheel::next_event(unsigned int &level,
+                                        unsigned int &slot) const
+{
+   // Every timer in level n is in a slot past the nth digit of now_, and the
+   // lowest level that has any timers has the earliest one.
+   for (level = 0; level < num_levels; ++level) {
+      if (occupied_[level] != 0) {
+         const unsigned int shift = level * level_bits;
+         const unsigned int digit = (now_ >> shift) & (slots_per_level - 1);
+         const ::std::uint64_t later =
+            occupied_[level] & ~((::std::uint64_t(2) << digit) - 1);
+         slot = __builtin_ctzll(later);
+         const unsigned int above = shift + level_bits;
+         const ::std::uint64_t base = (above < 64) ? (now_ >> above) << above : 0;
+         return base | (::std::uint64_t(slot) << shift);
+      }
+   }
+   return UINT64_MAX;
+}
+
+::std::uint64_t timer_wheel::deadline_tick(time_point deadline) const
+{
+   if (deadline <= epoch_) {
+      return 0;
+   }
+   const duration since = deadline - epoch_;
+   const ::std::uint64_t ticks = since / resolution_;
+   return (since % resolution_ != duration::zero()) ? ticks + 1 : ticks;
+}
+
+timer_wheel::time_point timer_wheel::tick_time(::std::uint64_t tick) const
+{
+   const ::std::uint64_t most =
+      static_cast< ::std::uint64_t>((time_point::max() - epoch_) / resolution_);
+   if (tick >= most) {
+      return time_point::max();
+   }
+   return epoch_ + resolution_ * static_cast<duration::rep>(tick);
+}
+
+} // namespace sparkles
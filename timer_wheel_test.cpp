@@ -0,0 +1,186 @@
+#include <sparkles/timer_wheel.hpp>
+#include <sparkles/timer_operation.hpp>
+
+#include <boost/test/unit_test.hpp>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <random>
+#include <stdexcept>
+#include <vector>
+
+namespace sparkles {
+namespace test {
+
+namespace {
+
+using ::std::chrono::milliseconds;
+typedef timer_wheel::time_point time_point;
+
+//! Records when and in what order it expired.
+class test_timer : public timer_wheel::timer {
+ public:
+   test_timer(::std::vector<int> &log, int id) : log_(log), id_(id) {}
+
+   ::std::function<void ()> on_expired;
+
+ private:
+   ::std::vector<int> &log_;
+   const int id_;
+
+   void expired() override {
+      log_.push_back(id_);
+      if (on_expired) {
+         on_expired();
+      }
+   }
+};
+
+} // anonymous namespace
+
+BOOST_AUTO_TEST_SUITE(timer_wheel_test)
+
+BOOST_AUTO_TEST_CASE( expire_in_order )
+{
+   timer_wheel wheel;
+   const time_point start = timer_wheel::clock::now();
+   ::std::vector<int> log;
+   test_timer a(log, 1), b(log, 2), c(log, 3), d(log, 4);
+   wheel.schedule(c, start + milliseconds(5000));
+   wheel.schedule(a, start + milliseconds(3));
+   wheel.schedule(d, start + ::std::chrono::hours(24 * 400));
+   wheel.schedule(b, start + milliseconds(70));
+   BOOST_CHECK_EQUAL(wheel.size(), 4U);
+   BOOST_CHECK(wheel.next_deadline() <= start + milliseconds(3) + milliseconds(1));
+   BOOST_CHECK_EQUAL(wheel.expire(start), 0U);
+   BOOST_CHECK_EQUAL(wheel.expire(start + milliseconds(100)), 2U);
+   BOOST_CHECK((log == ::std::vector<int>{1, 2}));
+   BOOST_CHECK(!a.scheduled());
+   BOOST_CHECK(c.scheduled());
+   // Never early.
+   BOOST_CHECK_EQUAL(wheel.expire(start + milliseconds(4998)), 0U);
+   BOOST_CHECK_EQUAL(wheel.expire(start + milliseconds(5001)), 1U);
+   BOOST_CHECK_EQUAL(wheel.expire(start + ::std::chrono::hours(24 * 401)), 1U);
+   BOOST_CHECK((log == ::std::vector<int>{1, 2, 3, 4}));
+   BOOST_CHECK(wheel.empty());
+   BOOST_CHECK(wheel.next_deadline() == time_point::max());
+}
+
+BOOST_AUTO_TEST_CASE( cancel_and_reschedule )
+{
+   timer_wheel wheel;
+   const time_point start = timer_wheel::clock::now();
+   ::std::vector<int> log;
+   test_timer a(log, 1), b(log, 2);
+   {
+      test_timer dropped(log, 3);
+      wheel.schedule(dropped, start + milliseconds(10));
+   }
+   wheel.schedule(a, start + milliseconds(10));
+   wheel.schedule(b, start + milliseconds(20));
+   wheel.cancel(a);
+   wheel.schedule(b, start + milliseconds(5));
+   BOOST_CHECK_EQUAL(wheel.size(), 1U);
+   // A deadline in the past expires at the next chance.
+   wheel.schedule(a, start - milliseconds(5));
+   BOOST_CHECK(wheel.next_deadline() <= timer_wheel::clock::now());
+   BOOST_CHECK_EQUAL(wheel.expire(start + milliseconds(30)), 2U);
+   BOOST_CHECK((log == ::std::vector<int>{1, 2}));
+}
+
+BOOST_AUTO_TEST_CASE( expired_may_reschedule )
+{
+   timer_wheel wheel;
+   const time_point start = timer_wheel::clock::now();
+   ::std::vector<int> log;
+   test_timer a(log, 1), b(log, 2);
+   int repeats = 0;
+   a.on_expired = [&]() {
+      wheel.cancel(b);
+      if (++repeats < 3) {
+         wheel.schedule(a, start + milliseconds(10 * (repeats + 1)));
+      }
+   };
+   b.on_expired = []() { throw ::std::runtime_error("Shouldn't run."); };
+   wheel.schedule(a, start + milliseconds(10));
+   wheel.schedule(b, start + milliseconds(10));
+   BOOST_CHECK_EQUAL(wheel.expire(start + milliseconds(100)), 3U);
+   BOOST_CHECK((log == ::std::vector<int>{1, 1, 1}));
+}
+
+BOOST_AUTO_TEST_CASE( outlives_wheel )
+{
+   ::std::vector<int> log;
+   test_timer a(log, 1);
+   {
+      timer_wheel wheel;
+      wheel.schedule(a, timer_wheel::clock::now() + milliseconds(10));
+   }
+   BOOST_CHECK(!a.scheduled());
+}
+
+BOOST_AUTO_TEST_CASE( many_timers )
+{
+   timer_wheel wheel;
+   const time_point start = timer_wheel::clock::now();
+   ::std::vector<int> log;
+   ::std::vector< ::std::unique_ptr<test_timer> > timers;
+   ::std::vector<time_point> deadlines;
+   ::std::mt19937 gen(17);
+   ::std::uniform_int_distribution<int> spread(0, 3600000);
+   const int count = 200000;
+   for (int i = 0; i < count; ++i) {
+      timers.emplace_back(new test_timer(log, i));
+      deadlines.push_back(start + milliseconds(spread(gen)));
+      wheel.schedule(*timers.back(), deadlines.back());
+   }
+   for (int i = 0; i < count; i += 2) {
+      timers[i].reset();
+   }
+   BOOST_CHECK_EQUAL(wheel.size(), ::std::size_t(count / 2));
+   // Expire in a series of steps, checking nothing is early or late.
+   for (int step = 1; step <= 100; ++step) {
+      const time_point now = start + milliseconds(36001 * step);
+      const ::std::size_t before = log.size();
+      wheel.expire(now);
+      for (::std::size_t i = before; i < log.size(); ++i) {
+         BOOST_REQUIRE(deadlines[log[i]] <= now);
+         if (i > before) {
+            BOOST_REQUIRE(deadlines[log[i - 1]] <=
+                          deadlines[log[i]] + milliseconds(1));
+         }
+      }
+      int late = 0;
+      for (int i = 1; i < count; i += 2) {
+         // Rounding can make a timer up to a tick late, but no more.
+         if (timers[i]->scheduled() &&
+             (deadlines[i] + milliseconds(1) <= now))
+         {
+            ++late;
+         }
+      }
+      BOOST_REQUIRE_EQUAL(late, 0);
+   }
+   BOOST_CHECK_EQUAL(log.size(), ::std::size_t(count / 2));
+   BOOST_CHECK(wheel.empty());
+}
+
+BOOST_AUTO_TEST_CASE( timer_operation_finishes )
+{
+   timer_wheel wheel;
+   const time_point start = timer_wheel::clock::now();
+   auto fred = timer_operation::create(wheel, start + milliseconds(10));
+   auto joe = timer_operation::create(wheel, start + milliseconds(20));
+   BOOST_CHECK_EQUAL(wheel.size(), 2U);
+   joe.reset();
+   BOOST_CHECK_EQUAL(wheel.size(), 1U);
+   BOOST_CHECK(!fred->finished());
+   BOOST_CHECK_EQUAL(wheel.expire(start + milliseconds(30)), 1U);
+   BOOST_CHECK(fred->finished());
+   BOOST_CHECK(fred->is_valid());
+}
+
+BOOST_AUTO_TEST_SUITE_END()
+
+} // namespace test
+} // namespace sparkles
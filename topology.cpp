@@ -0,0 +1,253 @@
+#include <sparkles/topology.hpp>
+
+#include <dirent.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <linux/mempolicy.h>
+#include <algorithm>
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <thread>
+
+namespace {
+
+//! Parse a sysfs CPU list like "0-3,8,10-11".
+::std::vector<unsigned int> parse_cpulist(const ::std::string &list)
+{
+   ::std::vector<unsigned int> cpus;
+   ::std::istringstream in(list);
+   ::std::string range;
+   while (::std::getline(in, range, ',')) {
+      const ::std::string::size_type dash = range.find('-');
+      char *end;
+      const unsigned long first = ::std::strtoul(range.c_str(), &end, 10);
+      if (end == range.c_str()) {
+         continue;
+      }
+      const unsigned long last = (dash == ::std::string::npos) ? first :
+         ::std::strtoul(range.c_str() + dash + 1, nullptr, 10);
+      for (unsigned long cpu = first; cpu <= last; ++cpu) {
+         cpus.push_back(static_cast<unsigned int>(cpu));
+      }
+   }
+   return cpus;
+}
+
+::std::string read_line(const ::std::string &path)
+{
+   ::std::ifstream in(path);
+   ::std::string line;
+   ::std::getline(in, line);
+   return line;
+}
+
+//! The CPUs this process may run on.
+::std::vector<unsigned int> allowed_cpus()
+{
+   ::std::vector<unsigned int> cpus;
+   ::cpu_set_t set;
+   CPU_ZERO(&set);
+   if (::sched_getaffinity(0, sizeof(set), &set) == 0) {
+      for (unsigned int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+         if (CPU_ISSET(cpu, &set)) {
+            cpus.push_back(cpu);
+         }
+      }
+   }
+   if (cpus.empty()) {
+      const unsigned int count =
+         ::std::max(1U, ::std::thread::hardware_concurrency());
+      for (unsigned int cpu = 0; cpu < count; ++cpu) {
+         cpus.push_back(cpu);
+      }
+   }
+   return cpus;
+}
+
+constexpr unsigned int local_distance = 10;
+constexpr unsigned int remote_distance = 20;
+
+} // Anonymous namespace
+
+namespace sparkles {
+
+const topology &topology::system()
+{
+   static const topology the_system;
+   return the_system;
+}
+
+topology::topology(const ::std::string &sysfs_root)
+{
+   if (DIR * const dir = ::opendir(sysfs_root.c_str())) {
+      while (const struct dirent * const entry = ::readdir(dir)) {
+         const ::std::string name(entry->d_name);
+         if ((name.size() > 4) && (name.compare(0, 4, "node") == 0) &&
+             (name.find_first_not_of("0123456789", 4) == ::std::string::npos))
+         {
+            node_ids_.push_back(
+               static_cast<unsigned int>(::std::stoul(name.substr(4))));
+         }
+      }
+      ::closedir(dir);
+   }
+   ::std::sort(node_ids_.begin(), node_ids_.end());
+   if (node_ids_.empty()) {
+      node_ids_.push_back(0);
+      cpus_.push_back(allowed_cpus());
+      distances_.push_back(::std::vector<unsigned int>{local_distance});
+      return;
+   }
+   for (unsigned int node: node_ids_) {
+      const ::std::string dir = sysfs_root + "/node" + ::std::to_string(node);
+      cpus_.push_back(parse_cpulist(read_line(dir + "/cpulist")));
+      // One distance per node, in the same order as the node numbers.
+      ::std::vector<unsigned int> distances;
+      ::std::istringstream in(read_line(dir + "/distance"));
+      unsigned int distance;
+      while (in >> distance) {
+         distances.push_back(distance);
+      }
+      if (distances.size() != node_ids_.size()) {
+         distances.clear();
+         for (unsigned int other: node_ids_) {
+            distances.push_back((other == node) ? local_distance
+                                                : remote_distance);
+         }
+      }
+      distances_.push_back(::std::move(distances));
+   }
+}
+
+::std::size_t topology::index_of(unsigned int node) const
+{
+   const auto found = ::std::lower_bound(node_ids_.begin(), node_ids_.end(),
+                                         node);
+   if ((found == node_ids_.end()) || (*found != node)) {
+      throw ::std::out_of_range("No such NUMA node.");
+   }
+   return found - node_ids_.begin();
+}
+
+const ::std::vector<unsigned int> &topology::cpus_of(unsigned int node) const
+{
+   return cpus_[index_of(node)];
+}
+
+int topology::node_of(unsigned int cpu) const
+{
+   for (::std::size_t i = 0; i < node_ids_.size(); ++i) {
+      const auto &cpus = cpus_[i];
+      if (::std::find(cpus.begin(), cpus.end(), cpu) != cpus.end()) {
+         return static_cast<int>(node_ids_[i]);
+      }
+   }
+   return -1;
+}
+
+int topology::node_of(const ::std::vector<unsigned int> &cpus) const
+{
+   int node = -1;
+   for (unsigned int cpu: cpus) {
+      const int cpu_node = node_of(cpu);
+      if ((cpu_node < 0) || ((node >= 0) && (cpu_node != node))) {
+         return -1;
+      }
+      node = cpu_node;
+   }
+   return node;
+}
+
+unsigned int topology::distance(unsigned int from, unsigned int to) const
+{
+   return distances_[index_of(from)][index_of(to)];
+}
+
+::std::vector<unsigned int> topology::nodes_by_distance(unsigned int node) const
+{
+   const ::std::vector<unsigned int> &distances = distances_[index_of(node)];
+   ::std::vector< ::std::size_t> order(node_ids_.size());
+   for (::std::size_t i = 0; i < order.size(); ++i) {
+      order[i] = i;
+   }
+   // The node itself sorts first even if the table is odd.
+   ::std::stable_sort(order.begin(), order.end(),
+                      [&](::std::size_t a, ::std::size_t b) {
+                         const bool a_self = node_ids_[a] == node;
+                         const bool b_self = node_ids_[b] == node;
+                         if (a_self != b_self) {
+                            return a_self;
+                         }
+                         return distances[a] < distances[b];
+                      });
+   ::std::vector<unsigned int> result;
+   for (::std::size_t i: order) {
+      result.push_back(node_ids_[i]);
+   }
+   return result;
+}
+
+int topology::current_cpu()
+{
+   return ::sched_getcpu();
+}
+
+namespace priv {
+
+namespace {
+
+bool placed(int node)
+{
+   return (node >= 0) && topology::system().is_numa();
+}
+
+::std::size_t page_rounded(::std::size_t bytes)
+{
+   const ::std::size_t page =
+      static_cast< ::std::size_t>(::sysconf(_SC_PAGESIZE));
+   bytes = ::std::max< ::std::size_t>(bytes, 1);
+   return ((bytes + page - 1) / page) * page;
+}
+
+} // Anonymous namespace
+
+void *numa_alloc(::std::size_t bytes, int node)
+{
+   if (!placed(node)) {
+      return ::operator new(bytes);
+   }
+   const ::std::size_t length = page_rounded(bytes);
+   void * const mem = ::mmap(nullptr, length, PROT_READ | PROT_WRITE,
+                             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+   if (mem == MAP_FAILED) {
+      throw ::std::bad_alloc();
+   }
+   // Nothing's been touched yet, so nothing has been placed. If the kernel
+   // won't do it the memory is still perfectly good, just not local.
+   constexpr unsigned int mask_bits = 8 * sizeof(unsigned long);
+   unsigned long mask[4] = {0, 0, 0, 0};
+   if (static_cast<unsigned int>(node) < 4 * mask_bits) {
+      mask[node / mask_bits] = 1UL << (node % mask_bits);
+      ::syscall(SYS_mbind, mem, length, MPOL_PREFERRED, mask, 4 * mask_bits,
+                0);
+   }
+   return mem;
+}
+
+void numa_free(void *mem, ::std::size_t bytes, int node) noexcept
+{
+   if (mem == nullptr) {
+      return;
+   } else if (!placed(node)) {
+      ::operator delete(mem);
+   } else {
+      ::munmap(mem, page_rounded(bytes));
+   }
+}
+
+} // namespace priv
+} // namespace sparkles
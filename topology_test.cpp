@@ -0,0 +1,145 @@
+#include <sparkles/topology.hpp>
+
+#include <boost/test/unit_test.hpp>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace sparkles {
+namespace test {
+
+namespace {
+
+//! A made up sysfs node directory that cleans up after itself.
+class fake_sysfs {
+ public:
+   fake_sysfs() {
+      char name[] = "/tmp/sparkles_topology_XXXXXX";
+      if (::mkdtemp(name) == nullptr) {
+         throw ::std::runtime_error("Can't make a temporary directory.");
+      }
+      root_ = name;
+   }
+   ~fake_sysfs() {
+      for (auto i = files_.rbegin(); i != files_.rend(); ++i) {
+         ::unlink(i->c_str());
+      }
+      for (auto i = dirs_.rbegin(); i != dirs_.rend(); ++i) {
+         ::rmdir(i->c_str());
+      }
+      ::rmdir(root_.c_str());
+   }
+
+   const ::std::string &root() const { return root_; }
+
+   void add_node(unsigned int node, const char *cpulist,
+                 const char *distance) {
+      const ::std::string dir = root_ + "/node" + ::std::to_string(node);
+      ::mkdir(dir.c_str(), 0700);
+      dirs_.push_back(dir);
+      write(dir + "/cpulist", cpulist);
+      write(dir + "/distance", distance);
+   }
+
+   void write(const ::std::string &path, const char *contents) {
+      ::std::ofstream(path) << contents << '\n';
+      files_.push_back(path);
+   }
+
+ private:
+   ::std::string root_;
+   ::std::vector< ::std::string> dirs_;
+   ::std::vector< ::std::string> files_;
+};
+
+typedef ::std::vector<unsigned int> cpus_t;
+
+} // Anonymous namespace
+
+BOOST_AUTO_TEST_SUITE(topology_test)
+
+BOOST_AUTO_TEST_CASE( parses_sysfs )
+{
+   fake_sysfs sysfs;
+   sysfs.add_node(0, "0-1,4", "10 21 31");
+   sysfs.add_node(1, "2-3", "21 10 21");
+   // Nodes needn't be numbered consecutively.
+   sysfs.add_node(3, "5", "31 21 10");
+   sysfs.write(sysfs.root() + "/online", "0-1,3");
+   const topology machine(sysfs.root());
+   BOOST_CHECK(machine.is_numa());
+   BOOST_CHECK(machine.nodes() == (cpus_t{0, 1, 3}));
+   BOOST_CHECK(machine.cpus_of(0) == (cpus_t{0, 1, 4}));
+   BOOST_CHECK(machine.cpus_of(1) == (cpus_t{2, 3}));
+   BOOST_CHECK(machine.cpus_of(3) == (cpus_t{5}));
+   BOOST_CHECK_THROW(machine.cpus_of(2), ::std::out_of_range);
+   BOOST_CHECK_EQUAL(machine.node_of(4U), 0);
+   BOOST_CHECK_EQUAL(machine.node_of(3U), 1);
+   BOOST_CHECK_EQUAL(machine.node_of(9U), -1);
+   BOOST_CHECK_EQUAL(machine.node_of(cpus_t{2, 3}), 1);
+   BOOST_CHECK_EQUAL(machine.node_of(cpus_t{1, 2}), -1);
+   BOOST_CHECK_EQUAL(machine.node_of(cpus_t{}), -1);
+   BOOST_CHECK_EQUAL(machine.distance(0, 3), 31U);
+   BOOST_CHECK_EQUAL(machine.distance(3, 1), 21U);
+   BOOST_CHECK(machine.nodes_by_distance(0) == (cpus_t{0, 1, 3}));
+   BOOST_CHECK(machine.nodes_by_distance(3) == (cpus_t{3, 1, 0}));
+}
+
+BOOST_AUTO_TEST_CASE( bad_distances )
+{
+   fake_sysfs sysfs;
+   sysfs.add_node(0, "0", "10 20");
+   sysfs.add_node(1, "1", "garbage");
+   const topology machine(sysfs.root());
+   BOOST_CHECK_EQUAL(machine.distance(0, 1), 20U);
+   BOOST_CHECK_EQUAL(machine.distance(1, 1), 10U);
+   BOOST_CHECK_EQUAL(machine.distance(1, 0), 20U);
+}
+
+BOOST_AUTO_TEST_CASE( no_sysfs )
+{
+   const topology machine("/nonexistent/sparkles/node");
+   BOOST_CHECK(!machine.is_numa());
+   BOOST_CHECK(machine.nodes() == (cpus_t{0}));
+   BOOST_CHECK(!machine.cpus_of(0).empty());
+   BOOST_CHECK_EQUAL(machine.node_of(machine.cpus_of(0)), 0);
+   BOOST_CHECK_EQUAL(machine.distance(0, 0), 10U);
+}
+
+BOOST_AUTO_TEST_CASE( this_machine )
+{
+   const topology &machine = topology::system();
+   BOOST_REQUIRE(!machine.nodes().empty());
+   const int cpu = topology::current_cpu();
+   BOOST_REQUIRE(cpu >= 0);
+   BOOST_CHECK(machine.current_node() >= 0);
+   BOOST_CHECK_EQUAL(machine.nodes_by_distance(machine.nodes()[0])[0],
+                     machine.nodes()[0]);
+}
+
+BOOST_AUTO_TEST_CASE( numa_alloc )
+{
+   for (int node: {-1, 0}) {
+      for (::std::size_t bytes: {0, 1, 100000}) {
+         void * const mem = priv::numa_alloc(bytes, node);
+         BOOST_REQUIRE(mem != nullptr);
+         ::std::memset(mem, 0x5a, bytes);
+         priv::numa_free(mem, bytes, node);
+      }
+   }
+   priv::numa_array<int> ints(100, 0);
+   BOOST_CHECK_EQUAL(ints.size(), 100U);
+   BOOST_CHECK_EQUAL(ints[99], 0);
+   ints[99] = 5;
+   BOOST_CHECK_EQUAL(ints[99], 5);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
+
+} // namespace test
+} // namespace sparkles
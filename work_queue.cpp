@@ -1,13 +1,26 @@
 #include <sparkles/work_queue.hpp>
 #include <sparkles/semaphore.hpp>
+#include <sparkles/mpsc_queue.hpp>
+#include <sparkles/spsc_ring.hpp>
+#include <sparkles/eventcount.hpp>
+#include <sparkles/topology.hpp>
 
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include <atomic>
+#include <chrono>
 #include <mutex>
-#include <cassert>
+#include <thread>
+#include <algorithm>
+#include <climits>
+#include <cstdint>
 #include <utility>
 #include <memory>
-
-using ::std::mutex;
-typedef ::std::lock_guard<mutex> lock_guard;
+#include <stdexcept>
+#include <system_error>
+#include <cerrno>
+#include <unordered_map>
+#include <vector>
 
 namespace {
 
@@ -23,49 +36,726 @@ template <unsigned int foo> struct fake {
    no_type joe;
 };
 
+/*! \brief A lock-free stack of the unused nodes of a bounded queue.
+ *
+ * Any number of threads may push and pop at once. A plain Treiber stack
+ * suffers from the ABA problem when several threads pop, so the head pointer
+ * carries a 16 bit counter in the bits x86-64 and AArch64 don't use for
+ * addresses. Nodes whose addresses don't fit in 48 bits are simply not
+ * recycled.
+ *
+ * Nodes are never handed back to the allocator while they're in here, so it's
+ * always safe to read the next_ pointer of a node that another thread may have
+ * just popped. The CAS will fail in that case anyway.
+ */
+template <class Node>
+class tagged_freelist {
+ public:
+   tagged_freelist() : head_(0) {}
+   tagged_freelist(const tagged_freelist &) = delete;
+   tagged_freelist &operator =(const tagged_freelist &) = delete;
+
+   //! Add a node, returns false if the node can't be stored.
+   bool push(Node *node) {
+      const ::std::uintptr_t nodebits = reinterpret_cast< ::std::uintptr_t>(node);
+      if ((nodebits & ~ptr_mask) != 0) {
+         return false;
+      }
+      ::std::uintptr_t oldhead = head_.load(::std::memory_order_relaxed);
+      ::std::uintptr_t newhead;
+      do {
+         node->next_.store(to_node(oldhead), ::std::memory_order_relaxed);
+         newhead = nodebits | next_tag(oldhead);
+      } while (!head_.compare_exchange_weak(oldhead, newhead,
+                                            ::std::memory_order_release,
+                                            ::std::memory_order_relaxed));
+      return true;
+   }
+
+   //! Remove a node, or return nullptr if there are none.
+   Node *pop() {
+      ::std::uintptr_t oldhead = head_.load(::std::memory_order_acquire);
+      ::std::uintptr_t newhead;
+      Node *top;
+      do {
+         top = static_cast<Node *>(to_node(oldhead));
+         if (top == nullptr) {
+            return nullptr;
+         }
+         const ::std::uintptr_t nextbits = reinterpret_cast< ::std::uintptr_t>(
+            top->next_.load(::std::memory_order_relaxed)
+            );
+         newhead = nextbits | next_tag(oldhead);
+      } while (!head_.compare_exchange_weak(oldhead, newhead,
+                                            ::std::memory_order_acquire,
+                                            ::std::memory_order_acquire));
+      top->next_.store(nullptr, ::std::memory_order_relaxed);
+      return top;
+   }
+
+ private:
+   static_assert(sizeof(::std::uintptr_t) == 8,
+                 "tagged_freelist assumes 64 bit pointers.");
+   static constexpr ::std::uintptr_t ptr_mask = (::std::uintptr_t(1) << 48) - 1;
+
+   ::std::atomic< ::std::uintptr_t> head_;
+
+   static ::sparkles::priv::mpsc_node *to_node(::std::uintptr_t bits) {
+      return reinterpret_cast< ::sparkles::priv::mpsc_node *>(bits & ptr_mask);
+   }
+   static ::std::uintptr_t next_tag(::std::uintptr_t bits) {
+      return (bits & ~ptr_mask) + (ptr_mask + 1);
+   }
+};
+
+/*! \brief One thread's private stock of unused nodes for one unbounded queue.
+ *
+ * Only the thread that owns the cache takes nodes from it, and it takes them
+ * from spare_, which nobody else touches. Whoever frees a node pushes it onto
+ * returned_ instead. That's a lock-free stack the owner empties all at once with
+ * an exchange when spare_ runs dry, and since it's never popped one node at a
+ * time it doesn't have the ABA problem.
+ *
+ * held_ counts the nodes in both lists. give_back refuses a node when the
+ * cache already holds limit_ of them, unless the node is pinned, and the
+ * caller deletes it or finds it another home. Several threads giving back at
+ * once may overshoot the limit a little.
+ *
+ * When the owning thread exits, owned_ goes false and the next thread that
+ * needs a cache for the queue adopts this one, nodes and all. dead_ means the
+ * queue is gone and has already deleted the nodes.
+ */
+template <class Node>
+class node_cache {
+ public:
+   explicit node_cache(::std::size_t limit)
+        : spare_(nullptr), returned_(nullptr), held_(0), limit_(limit),
+          owned_(true), dead_(false)
+   {
+   }
+   node_cache(const node_cache &) = delete;
+   node_cache &operator =(const node_cache &) = delete;
+
+   //! Take a node, or return nullptr if there are none. Owner only.
+   Node *take() {
+      if (spare_ == nullptr) {
+         if (returned_.load(::std::memory_order_relaxed) == nullptr) {
+            return nullptr;
+         }
+         spare_ = returned_.exchange(nullptr, ::std::memory_order_acquire);
+      }
+      Node * const node = spare_;
+      spare_ = static_cast<Node *>(node->next_.load(::std::memory_order_relaxed));
+      node->next_.store(nullptr, ::std::memory_order_relaxed);
+      held_.fetch_sub(1, ::std::memory_order_relaxed);
+      return node;
+   }
+
+   //! Return a node from any thread, false if it should be deleted instead.
+   bool give_back(Node *node, bool pinned) {
+      if (!pinned && (held_.load(::std::memory_order_relaxed) >= limit_)) {
+         return false;
+      }
+      held_.fetch_add(1, ::std::memory_order_relaxed);
+      Node *head = returned_.load(::std::memory_order_relaxed);
+      do {
+         node->next_.store(head, ::std::memory_order_relaxed);
+      } while (!returned_.compare_exchange_weak(head, node,
+                                                ::std::memory_order_release,
+                                                ::std::memory_order_relaxed));
+      return true;
+   }
+
+   /*! \brief Hand every node to dispose. Only safe when nobody else is using
+    * the cache.
+    */
+   template <class Dispose>
+   void kill(Dispose dispose) {
+      dead_.store(true, ::std::memory_order_relaxed);
+      dispose_list(spare_, dispose);
+      spare_ = nullptr;
+      dispose_list(returned_.exchange(nullptr, ::std::memory_order_acquire),
+                   dispose);
+      held_.store(0, ::std::memory_order_relaxed);
+   }
+
+   //! Claim an orphaned cache for the calling thread.
+   bool adopt() {
+      bool expected = false;
+      return owned_.compare_exchange_strong(expected, true,
+                                            ::std::memory_order_acquire,
+                                            ::std::memory_order_relaxed);
+   }
+   //! The owning thread is exiting.
+   void orphan() { owned_.store(false, ::std::memory_order_release); }
+   bool dead() const { return dead_.load(::std::memory_order_relaxed); }
+
+ private:
+   Node *spare_;
+   ::std::atomic<Node *> returned_;
+   ::std::atomic< ::std::size_t> held_;
+   const ::std::size_t limit_;
+   ::std::atomic<bool> owned_;
+   ::std::atomic<bool> dead_;
+
+   template <class Dispose>
+   static void dispose_list(Node *node, Dispose &dispose) {
+      while (node != nullptr) {
+         Node * const next =
+            static_cast<Node *>(node->next_.load(::std::memory_order_relaxed));
+         dispose(node);
+         node = next;
+      }
+   }
+};
+
+/*! \brief Where the nodes of an unbounded queue on a NUMA node come from.
+ *
+ * Nodes are constructed chunk_nodes at a time in memory from numa_alloc, and
+ * aren't destroyed until the arena is. The caches still do all the everyday
+ * recycling, the arena only sees a node when a cache runs dry or won't take
+ * one back, so a plain mutex is good enough for its free list.
+ */
+template <class Node>
+class node_arena {
+   static_assert(alignof(Node) <= __STDCPP_DEFAULT_NEW_ALIGNMENT__,
+                 "numa_alloc isn't aligned enough for a node.");
+ public:
+   explicit node_arena(int numa_node)
+        : numa_node_(numa_node), free_(nullptr), used_(chunk_nodes)
+   {
+   }
+   node_arena(const node_arena &) = delete;
+   node_arena &operator =(const node_arena &) = delete;
+   ~node_arena() {
+      for (::std::size_t i = 0; i < chunks_.size(); ++i) {
+         Node * const chunk = static_cast<Node *>(chunks_[i]);
+         const ::std::size_t count =
+            (i + 1 == chunks_.size()) ? used_ : chunk_nodes;
+         for (::std::size_t j = 0; j < count; ++j) {
+            chunk[j].~Node();
+         }
+         ::sparkles::priv::numa_free(chunk, chunk_bytes, numa_node_);
+      }
+   }
+
+   Node *take() {
+      ::std::lock_guard< ::std::mutex> lock(mutex_);
+      if (free_ != nullptr) {
+         Node * const node = free_;
+         free_ =
+            static_cast<Node *>(node->next_.load(::std::memory_order_relaxed));
+         node->next_.store(nullptr, ::std::memory_order_relaxed);
+         return node;
+      }
+      if (used_ == chunk_nodes) {
+         chunks_.reserve(chunks_.size() + 1);
+         chunks_.push_back(
+            ::sparkles::priv::numa_alloc(chunk_bytes, numa_node_));
+         used_ = 0;
+      }
+      Node * const node = new (static_cast<Node *>(chunks_.back()) + used_) Node;
+      ++used_;
+      return node;
+   }
+
+   void give_back(Node *node) {
+      ::std::lock_guard< ::std::mutex> lock(mutex_);
+      node->next_.store(free_, ::std::memory_order_relaxed);
+      free_ = node;
+   }
+
+ private:
+   static constexpr ::std::size_t chunk_nodes = 64;
+   static constexpr ::std::size_t chunk_bytes = chunk_nodes * sizeof(Node);
+
+   const int numa_node_;
+   ::std::mutex mutex_;
+   Node *free_;
+   ::std::vector<void *> chunks_;
+   //! How many nodes of the last chunk have been constructed.
+   ::std::size_t used_;
+};
+
+/*! \brief The node caches one thread owns, one for each queue it has enqueued
+ * to, found by the queue's id.
+ *
+ * The caches are shared with their queues, so either may go away first. Entries
+ * for dead queues are dropped whenever a new one is added.
+ */
+template <class Cache>
+class cache_registry {
+ public:
+   cache_registry() = default;
+   cache_registry(const cache_registry &) = delete;
+   cache_registry &operator =(const cache_registry &) = delete;
+   ~cache_registry() {
+      for (entry &e: entries_) {
+         e.cache->orphan();
+      }
+   }
+
+   Cache *find(::std::uint64_t queue_id) const {
+      for (const entry &e: entries_) {
+         if (e.queue_id == queue_id) {
+            return e.cache.get();
+         }
+      }
+      return nullptr;
+   }
+
+   void add(::std::uint64_t queue_id, ::std::shared_ptr<Cache> cache) {
+      entries_.erase(::std::remove_if(entries_.begin(), entries_.end(),
+                                      [](const entry &e) {
+                                         return e.cache->dead();
+                                      }),
+                     entries_.end());
+      entries_.push_back(entry{queue_id, ::std::move(cache)});
+   }
+
+ private:
+   struct entry {
+      ::std::uint64_t queue_id;
+      ::std::shared_ptr<Cache> cache;
+   };
+   ::std::vector<entry> entries_;
+};
+
+//! Gives every work_queue a distinct id for cache_registry.
+::std::atomic< ::std::uint64_t> next_queue_id(1);
+
+#if SPARKLES_WORK_QUEUE_STATS
+/*! \brief The counters behind work_queue::stats().
+ *
+ * Everything is relaxed, the counters only have to add up once the queue has
+ * gone quiet.
+ */
+class queue_stats {
+ public:
+   typedef ::sparkles::work_queue::stats_snapshot snapshot_t;
+
+   explicit queue_stats(unsigned int num_classes)
+        : num_classes_(num_classes), depths_(new class_depth[num_classes]),
+          enqueued_(0), dequeued_(0), cancelled_(0)
+   {
+   }
+
+   //! The clock enqueue-to-dequeue latency is measured with, in nanoseconds.
+   static ::std::int64_t now() {
+      return ::std::chrono::duration_cast< ::std::chrono::nanoseconds>(
+         ::std::chrono::steady_clock::now().time_since_epoch()).count();
+   }
+
+   void enqueued(unsigned int priority) {
+      enqueued_.fetch_add(1, ::std::memory_order_relaxed);
+      class_depth &depth = depths_[priority];
+      const ::std::int64_t current =
+         depth.current_.fetch_add(1, ::std::memory_order_relaxed) + 1;
+      ::std::int64_t high = depth.high_water_.load(::std::memory_order_relaxed);
+      while ((current > high) &&
+             !depth.high_water_.compare_exchange_weak(
+                high, current, ::std::memory_order_relaxed))
+      {
+      }
+   }
+
+   void dequeued(unsigned int priority, ::std::int64_t enqueued_at) {
+      dequeued_.fetch_add(1, ::std::memory_order_relaxed);
+      depths_[priority].current_.fetch_sub(1, ::std::memory_order_relaxed);
+      const ::std::int64_t waited = now() - enqueued_at;
+      latency_.record((waited > 0) ? static_cast< ::std::uint64_t>(waited) : 0);
+   }
+
+   void cancelled(unsigned int priority) {
+      cancelled_.fetch_add(1, ::std::memory_order_relaxed);
+      depths_[priority].current_.fetch_sub(1, ::std::memory_order_relaxed);
+   }
+
+   //! Producer lanes only count items, they have no class and no timestamp.
+   void lane_enqueued() { enqueued_.fetch_add(1, ::std::memory_order_relaxed); }
+   void lane_dequeued() { dequeued_.fetch_add(1, ::std::memory_order_relaxed); }
+
+   snapshot_t snapshot() const {
+      snapshot_t result;
+      result.enabled = true;
+      result.enqueued = enqueued_.load(::std::memory_order_relaxed);
+      result.dequeued = dequeued_.load(::std::memory_order_relaxed);
+      result.cancelled = cancelled_.load(::std::memory_order_relaxed);
+      for (unsigned int i = 0; i < num_classes_; ++i) {
+         const ::std::int64_t current =
+            depths_[i].current_.load(::std::memory_order_relaxed);
+         result.class_depths.push_back(
+            snapshot_t::depth{
+               (current > 0) ? static_cast< ::std::uint64_t>(current) : 0,
+               static_cast< ::std::uint64_t>(
+                  depths_[i].high_water_.load(::std::memory_order_relaxed))
+            });
+      }
+      result.latency = latency_.take_snapshot();
+      return result;
+   }
+
+ private:
+   struct class_depth {
+      class_depth() : current_(0), high_water_(0) {}
+
+      ::std::atomic< ::std::int64_t> current_;
+      ::std::atomic< ::std::int64_t> high_water_;
+   };
+
+   const unsigned int num_classes_;
+   const ::std::unique_ptr<class_depth[]> depths_;
+   ::std::atomic< ::std::uint64_t> enqueued_;
+   ::std::atomic< ::std::uint64_t> dequeued_;
+   ::std::atomic< ::std::uint64_t> cancelled_;
+   ::sparkles::latency_histogram latency_;
+};
+#endif
+
 } // Anonymous namespace
 
 namespace sparkles {
 
-/*! \brief Yes, our own linked list node. Yes, I know ::std::list exists.
+/*! \brief A work item and the link that puts it on a queue.
  *
- * I'm implementing a new linked list because I want careful control over
- * exactly what is locked when and for how long. I want to carefully minimize
- * the amount of time mutexes are held for.
+ * The link is used by the lock-free queues and by the free list, a node is only
+ * ever in one of them at a time.
+ *
+ * state_ only matters for nodes enqueued with a ticket or a key. It holds a
+ * status in the low two bits, the ticketed and keyed flags, and a generation
+ * count above those that goes up every time a ticketed node is recycled. The
+ * generation is what stops a stale ticket from cancelling whatever the node is
+ * carrying now.
  */
-struct work_queue::node_t {
-   node_t *next_;
+struct work_queue::node_t : public priv::mpsc_node {
+   typedef ::std::uint64_t state_t;
+   //! Waiting to be dequeued.
+   static constexpr state_t queued = 0;
+   //! The consumer has it, it can't be cancelled any more.
+   static constexpr state_t claimed = 1;
+   //! A ticket holder is destroying the item.
+   static constexpr state_t cancelling = 2;
+   //! The item is gone, the consumer should just recycle the node.
+   static constexpr state_t cancelled = 3;
+   static constexpr state_t status_mask = 3;
+   static constexpr state_t ticketed = 4;
+   //! Still in pending_keys_ under key_.
+   static constexpr state_t keyed = 8;
+   static constexpr state_t generation_one = 16;
+
+   node_t() : state_(0), key_(0) {}
+
    work_item_t item_;
+   ::std::atomic<state_t> state_;
+   ::std::uint64_t key_;
+   //! The cache the node goes back to, nullptr for the nodes of a slab.
+   node_cache<node_t> *home_ = nullptr;
+   //! Belongs to the queue's node_arena, which destroys it.
+   bool in_arena_ = false;
+#if SPARKLES_WORK_QUEUE_STATS
+   //! When the item was enqueued, in queue_stats::now() nanoseconds.
+   ::std::int64_t enqueued_at_;
+   unsigned int priority_;
+#endif
+};
 
-   node_t() : next_(nullptr) {}
+/*! \brief The state shared between a producer_lane and its queue.
+ *
+ * The queue owns these, so a lane that's been closed by its producer_lane can
+ * linger until the consumer has emptied it.
+ */
+struct work_queue::producer_lane::lane_t {
+   lane_t(impl_t &queue, ::std::size_t capacity, int numa_node)
+        : queue_(queue), ring_(capacity, numa_node), closed_(false)
+   {
+   }
+
+   impl_t &queue_;
+   priv::spsc_ring<work_item_t> ring_;
+   //! The producer waits on this when ring_ is full.
+   eventcount spaces_;
+   ::std::atomic<bool> closed_;
 };
 
 /*! \brief The real type stored in storage_
  *
- * The basic goal here is to avoid contending on a lock.
+ * The basic goal here is to avoid contending on a lock. Producers only ever
+ * touch the head of one lane and the free list, and the consumer only touches
+ * the tails of the lanes, so nothing in enqueue or dequeue waits on anything
+ * but the semaphores. There's one lane per priority class, classes_[0] is the
+ * most urgent.
+ *
+ * served_ is how the consumer keeps track of the quotas. A class that has
+ * used up its quota is passed over, once, in favor of any lower class that has
+ * something. Serving a class resets the counts of every class above it.
+ *
+ * The other goal is to avoid allocating node_t's. So every thread that
+ * enqueues gets a node_cache of its own, and nodes are handed back to the
+ * cache they came from when they're freed. A producer doesn't share its spare
+ * nodes with anyone, and a consumer returning nodes to it doesn't take a lock.
+ * This saves calls to the allocator and hopefully also improves locality of
+ * refence. caches_ holds every cache the queue has handed out, so they can be
+ * adopted when their threads exit and emptied when the queue goes away.
+ *
+ * The lanes can only be popped by one thread at a time. When the queue has
+ * multiple consumers they take turns with consumer_mutex_, which is only held
+ * while a node is unlinked. Producers never touch it.
+ *
+ * With producer lanes the single consumer waits on ready_ instead of numitems_,
+ * so everything that adds an item has to notify it as well. numitems_ is still
+ * what counts the items in the regular lanes. The list of producer lanes is
+ * only changed under lanes_mutex_, and the consumer keeps its own copy of it
+ * that it refreshes when lanes_changed_ says it's out of date.
+ *
+ * pending_keys_ maps the key of every coalescing item that hasn't been claimed
+ * by a consumer to its node. Both the map and the items of those nodes are
+ * guarded by keys_mutex_, so a consumer has to take the node out of the map
+ * before it can look at the item.
+ *
+ * A pollable queue writes to event_fd_ when signalled_ goes from false to true,
+ * and drain_signalled clears signalled_ before it looks for items. That's the
+ * same store, fence, load dance the eventcount does, so either the consumer
+ * sees a new item or its producer sees signalled_ is false and writes.
+ *
+ * owner_ is the thread set_owner was called from, if any. inline_limit_ and
+ * inline_depth_ are only touched by that thread, everybody else stops at
+ * owner_.
  *
- * The other goal is to avoid allocating node_t's. So the work_queue never
- * deletes a node_t until it's deleted. It just re-uses old ones. This saves
- * calls to the allocator and hopefully also improves locality of refence.
+ * A bounded queue takes that one step further and allocates every node it will
+ * ever use up front, in one array. spaces_ counts the nodes on the free list,
+ * so a producer that gets past it is guaranteed to find a node there.
+ *
+ * A queue with a numa_node_ puts the slab and the rings of its producer lanes
+ * on that node. An unbounded one gets its nodes from arena_ instead of new, so
+ * they're there too. Those nodes are never deleted, arena_ destroys them.
+ *
+ * A node that's ever carried a ticket can't be deleted while the queue lives
+ * either, since the ticket may still look at it. When its cache is full it goes
+ * to pinned_, or back to arena_, and every thread takes from there before
+ * allocating. So those nodes never add up to more than the queue has ever
+ * had in flight at once, instead of that much for every producer thread.
+ *
+ * The note_ functions keep stats_ up to date. They're empty unless
+ * SPARKLES_WORK_QUEUE_STATS is set, and stats_ doesn't even exist.
  */
 struct work_queue::impl_t {
+   typedef priv::intrusive_mpsc_queue<node_t> lane_t;
+   typedef node_cache<node_t> cache_t;
+   typedef node_arena<node_t> arena_t;
+
+   const unsigned int num_classes_;
+   const ::std::unique_ptr<lane_t[]> classes_;
+   const ::std::vector<unsigned int> quotas_;
+   const unsigned int drain_quota_;
+   // How many items in a row each class has had, only touched while popping.
+   ::std::vector<unsigned int> served_;
+   tagged_freelist<node_t> deleted_;
+   //! Nodes that have carried a ticket and didn't fit in their cache.
+   tagged_freelist<node_t> pinned_;
    semaphore numitems_;
-   ::std::mutex queue_mutex_;
-   ::std::mutex oob_queue_mutex_;
-   ::std::mutex deleted_queue_mutex_;
-   node_t *queue_head_;
-   node_t *queue_tail_;
-   node_t *oob_queue_head_;
-   node_t *oob_queue_tail_;
-   node_t *deleted_head_;
-
-   impl_t() : queue_head_(nullptr), queue_tail_(nullptr),
-              oob_queue_head_(nullptr), oob_queue_tail_(nullptr),
-              deleted_head_(nullptr)
+   const ::std::size_t capacity_;
+   const int numa_node_;
+   const priv::numa_array<node_t> slab_;
+   const ::std::unique_ptr<arena_t> arena_;
+   semaphore spaces_;
+   //! Held while a batch claims its room in spaces_.
+   ::std::mutex bulk_mutex_;
+   const bool multiple_consumers_;
+   ::std::mutex consumer_mutex_;
+   const bool producer_lanes_;
+   eventcount ready_;
+   ::std::mutex lanes_mutex_;
+   ::std::vector< ::std::unique_ptr<producer_lane::lane_t> > lanes_;
+   ::std::atomic<bool> lanes_changed_;
+   // Only touched by the consumer.
+   ::std::vector<producer_lane::lane_t *> consumer_lanes_;
+   ::std::size_t next_lane_;
+   int event_fd_;
+   ::std::atomic<bool> signalled_;
+   ::std::mutex keys_mutex_;
+   ::std::unordered_map< ::std::uint64_t, node_t *> pending_keys_;
+   ::std::atomic< ::std::uint64_t> coalesced_;
+   ::std::atomic<eventcount *> listener_;
+   ::std::atomic<unsigned int> notifying_listener_;
+   ::std::atomic< ::std::thread::id> owner_;
+   unsigned int inline_limit_;
+   unsigned int inline_depth_;
+   const ::std::uint64_t id_;
+   const ::std::size_t node_cache_limit_;
+   ::std::mutex caches_mutex_;
+   ::std::vector< ::std::shared_ptr<cache_t> > caches_;
+#if SPARKLES_WORK_QUEUE_STATS
+   const ::std::unique_ptr<queue_stats> stats_;
+#endif
+
+   static thread_local cache_registry<cache_t> thread_caches_;
+
+   explicit impl_t(const config &cfg)
+        : num_classes_(cfg.priority_classes),
+          classes_(new lane_t[cfg.priority_classes]),
+          quotas_(cfg.quotas.empty() ?
+                  ::std::vector<unsigned int>(cfg.priority_classes, 0) :
+                  cfg.quotas),
+          drain_quota_((cfg.drain_quota > 0) ? cfg.drain_quota : 1),
+          served_(cfg.priority_classes, 0),
+          capacity_(cfg.capacity),
+          numa_node_((cfg.numa_node >= 0) ? cfg.numa_node : -1),
+          slab_(cfg.capacity, numa_node_),
+          arena_(((cfg.capacity == 0) && (numa_node_ >= 0)) ?
+                 new arena_t(numa_node_) : nullptr),
+          spaces_(0), multiple_consumers_(cfg.multiple_consumers),
+          producer_lanes_(cfg.producer_lanes), lanes_changed_(false),
+          next_lane_(0), event_fd_(-1), signalled_(false), coalesced_(0),
+          listener_(nullptr), notifying_listener_(0), owner_(),
+          inline_limit_(0), inline_depth_(0),
+          id_(next_queue_id.fetch_add(1, ::std::memory_order_relaxed)),
+          node_cache_limit_(cfg.node_cache_limit)
+#if SPARKLES_WORK_QUEUE_STATS
+          , stats_(new queue_stats(cfg.priority_classes))
+#endif
    {
+      for (::std::size_t i = 0; i < capacity_; ++i) {
+         if (!deleted_.push(&slab_[i])) {
+            throw ::std::runtime_error("Can't put the nodes of a bounded "
+                                       "work_queue on its free list.");
+         }
+      }
+      spaces_.release(static_cast<unsigned int>(capacity_));
+      if (cfg.pollable) {
+         event_fd_ = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+         if (event_fd_ < 0) {
+            throw ::std::system_error(errno, ::std::system_category(),
+                                      "Can't create a work_queue eventfd.");
+         }
+      }
+   }
+   ~impl_t() {
+      if (event_fd_ >= 0) {
+         ::close(event_fd_);
+      }
+      for (const auto &cache: caches_) {
+         cache->kill(dispose);
+      }
+      while (node_t * const node = pinned_.pop()) {
+         delete node;
+      }
+   }
+
+   //! Get rid of a node nobody will use again, when the queue goes away.
+   static void dispose(node_t *node) {
+      if (!node->in_arena_) {
+         delete node;
+      }
+   }
+
+   bool bounded() const { return capacity_ > 0; }
+
+   //! The priority class enqueue uses.
+   unsigned int class_of(bool out_of_band) const {
+      return out_of_band ? 0 : num_classes_ - 1;
+   }
+
+   //! The calling thread's node cache for this queue.
+   cache_t &my_cache() {
+      if (cache_t * const found = thread_caches_.find(id_)) {
+         return *found;
+      }
+      ::std::shared_ptr<cache_t> cache;
+      {
+         ::std::lock_guard< ::std::mutex> lock(caches_mutex_);
+         for (const auto &orphan: caches_) {
+            if (orphan->adopt()) {
+               cache = orphan;
+               break;
+            }
+         }
+         if (!cache) {
+            cache = ::std::make_shared<cache_t>(node_cache_limit_);
+            caches_.push_back(cache);
+         }
+      }
+      cache_t &result = *cache;
+      thread_caches_.add(id_, ::std::move(cache));
+      return result;
+   }
+
+   //! Is anything waiting in a class above the lowest one?
+   bool urgent_pending() const {
+      for (unsigned int i = 0; i + 1 < num_classes_; ++i) {
+         if (!classes_[i].empty()) {
+            return true;
+         }
+      }
+      return false;
+   }
+
+   //! Tell the consumer count more items are in the regular lanes.
+   void post_items(unsigned int count) {
+      numitems_.release(count);
+      wake_consumer(count);
+   }
+
+   //! Wake the consumer up however it's waiting for count new items.
+   void wake_consumer(unsigned int count) {
+      if (producer_lanes_) {
+         ready_.notify(count);
+      }
+      if (event_fd_ >= 0) {
+         ::std::atomic_thread_fence(::std::memory_order_seq_cst);
+         if (!signalled_.load(::std::memory_order_relaxed) &&
+             !signalled_.exchange(true, ::std::memory_order_relaxed))
+         {
+            write_event();
+         }
+      }
+      if (listener_.load(::std::memory_order_relaxed) != nullptr) {
+         notify_listener();
+      }
    }
+
+   void notify_listener() {
+      // detach_listener waits for notifying_listener_ to drop to 0 after it
+      // clears listener_, so the listener can't go away while it's used here.
+      notifying_listener_.fetch_add(1, ::std::memory_order_seq_cst);
+      eventcount * const listener = listener_.load(::std::memory_order_seq_cst);
+      if (listener != nullptr) {
+         listener->notify_one();
+      }
+      notifying_listener_.fetch_sub(1, ::std::memory_order_release);
+   }
+
+   void write_event() {
+      // The only possible failure is the counter overflowing, and then it's
+      // readable anyway.
+      ::eventfd_write(event_fd_, 1);
+   }
+
+#if SPARKLES_WORK_QUEUE_STATS
+   void note_enqueued(node_t *node, unsigned int priority) {
+      node->enqueued_at_ = queue_stats::now();
+      node->priority_ = priority;
+      stats_->enqueued(priority);
+   }
+   void note_dequeued(const node_t *node) {
+      stats_->dequeued(node->priority_, node->enqueued_at_);
+   }
+   void note_cancelled(const node_t *node) {
+      stats_->cancelled(node->priority_);
+   }
+   void note_lane_enqueued() { stats_->lane_enqueued(); }
+   void note_lane_dequeued() { stats_->lane_dequeued(); }
+#else
+   void note_enqueued(node_t *, unsigned int) {}
+   void note_dequeued(const node_t *) {}
+   void note_cancelled(const node_t *) {}
+   void note_lane_enqueued() {}
+   void note_lane_dequeued() {}
+#endif
 };
 
+thread_local cache_registry<work_queue::impl_t::cache_t>
+   work_queue::impl_t::thread_caches_;
+
 inline work_queue::impl_t &work_queue::impl_()
 {
    return *(reinterpret_cast<impl_t *>(&storage_));
@@ -78,48 +768,72 @@ inline const work_queue::impl_t &work_queue::impl_() const
 
 inline work_queue::node_t *work_queue::make_new_node(impl_t &impl)
 {
-   {
-      node_t *newnode = nullptr;
-      {
-         lock_guard lock(impl.deleted_queue_mutex_);
-         newnode = impl.deleted_head_;
-         if (newnode != nullptr) {
-            impl.deleted_head_ = newnode->next_;
-         }
-      }
-      if (newnode != nullptr) {
-         newnode->next_ = nullptr;
-         return newnode;
+   if (impl.bounded()) {
+      // The free list is never empty here, the caller has already claimed one
+      // of its nodes from spaces_.
+      return impl.deleted_.pop();
+   }
+   impl_t::cache_t &cache = impl.my_cache();
+   node_t *newnode = cache.take();
+   if (newnode == nullptr) {
+      newnode = impl.pinned_.pop();
+   }
+   if (newnode == nullptr) {
+      if (impl.arena_) {
+         newnode = impl.arena_->take();
+         newnode->in_arena_ = true;
+      } else {
+         newnode = new node_t;
       }
    }
-   return new node_t;
+   newnode->home_ = &cache;
+   return newnode;
 }
 
-inline void work_queue::free_queue(node_t *head)
+inline void work_queue::free_node(impl_t &impl, node_t *node)
 {
-   while (head != nullptr) {
-      node_t *tmp = head;
-      head = head->next_;
-      delete tmp;
+   const node_t::state_t state = node->state_.load(::std::memory_order_relaxed);
+   if ((state & node_t::ticketed) != 0) {
+      // Start a new generation, so the old ticket can't touch the node.
+      node->state_.store((state & ~(node_t::generation_one - 1)) +
+                         node_t::generation_one,
+                         ::std::memory_order_relaxed);
    }
-}
-
-inline work_queue::node_t *
-work_queue::remove_from_queue(node_t *&head, node_t *&tail)
-{
-   if (head == nullptr) {
-      return nullptr;
+   if (impl.bounded()) {
+      // The constructor made sure every node of the slab fits on the list.
+      impl.deleted_.push(node);
+      impl.spaces_.release();
    } else {
-      node_t *tmp = head;
-      head = head->next_;
-      if (head == nullptr) {
-         tail = nullptr;
+      // A node that's ever had a ticket is never deleted, the ticket may still
+      // look at it. It's kept where any thread can reuse it.
+      const bool pinned = ((state & node_t::ticketed) != 0) ||
+         (state >= node_t::generation_one);
+      if (!node->home_->give_back(node, false)) {
+         if (node->in_arena_) {
+            impl.arena_->give_back(node);
+         } else if (!pinned) {
+            delete node;
+         } else if (!impl.pinned_.push(node)) {
+            node->home_->give_back(node, true);
+         }
       }
-      return tmp;
    }
 }
 
-work_queue::work_queue()
+inline void work_queue::push_node(impl_t &impl, node_t *node,
+                                  work_item_t &&item, unsigned int priority)
+{
+   node->item_ = ::std::move(item);
+   impl.note_enqueued(node, priority);
+   impl.classes_[priority].push(node);
+   impl.post_items(1);
+}
+
+work_queue::work_queue() : work_queue(config{})
+{
+}
+
+work_queue::work_queue(const config &cfg)
 {
 //   fake<sizeof(impl_data)> me; // Discover the new size if it's wrong.
 //   fake<alignof(impl_data)> me; // Discovers the new slignment if it's wrong.
@@ -127,10 +841,34 @@ work_queue::work_queue()
    // fail at compile time. No runtime testing is needed.
    static_assert(alignof(impl_data) >= alignof(impl_t),
                  "Alignment too loose for impl_data.");
+#if SPARKLES_WORK_QUEUE_STATS
    static_assert(sizeof(impl_data) >= sizeof(impl_t),
-                 "impl_data too small.");
+                 "impl_size too small with SPARKLES_WORK_QUEUE_STATS.");
+#else
+   static_assert(sizeof(impl_data) >= sizeof(impl_t),
+                 "impl_size too small without SPARKLES_WORK_QUEUE_STATS.");
+#endif
+   if (cfg.priority_classes == 0) {
+      throw ::std::invalid_argument("A work_queue needs at least one priority "
+                                    "class.");
+   }
+   if (!cfg.quotas.empty() && (cfg.quotas.size() != cfg.priority_classes)) {
+      throw ::std::invalid_argument("There must be a quota for every priority "
+                                    "class or none.");
+   }
+   if (cfg.capacity > INT_MAX) {
+      throw ::std::invalid_argument("work_queue capacity is too large.");
+   }
+   if (cfg.multiple_consumers && cfg.producer_lanes) {
+      throw ::std::invalid_argument("A work_queue with producer lanes can only "
+                                    "have one consumer.");
+   }
+   if (cfg.multiple_consumers && cfg.pollable) {
+      throw ::std::invalid_argument("A pollable work_queue can only have one "
+                                    "consumer.");
+   }
    void *storage = &storage_;
-   impl_t * const myimpl = new(storage) impl_t;
+   impl_t * const myimpl = new(storage) impl_t(cfg);
    if (myimpl != &impl_()) {
       throw ::std::logic_error("Addresses that must match do not!");
    }
@@ -139,76 +877,732 @@ work_queue::work_queue()
 work_queue::~work_queue()
 {
    impl_t &impl = impl_();
-   {
-      lock_guard dlock(impl.deleted_queue_mutex_);
-      lock_guard qlock(impl.queue_mutex_);
-      lock_guard olock(impl.oob_queue_mutex_);
-      free_queue(impl.deleted_head_);
-      impl.deleted_head_ = nullptr;
-      free_queue(impl.queue_head_);
-      impl.queue_head_ = impl.queue_tail_ = nullptr;
-      free_queue(impl.oob_queue_head_);
-      impl.oob_queue_head_ = impl.oob_queue_tail_ = nullptr;
+   // Nobody may be using the queue now, so everything pushed is linked in and
+   // pop will find all of it. The nodes of a bounded queue all go away with
+   // its slab, and the spare nodes of an unbounded one with its caches or its
+   // arena.
+   for (unsigned int i = 0; i < impl.num_classes_; ++i) {
+      impl_t::lane_t * const lane = &impl.classes_[i];
+      for (node_t *node = lane->pop(); node != nullptr; node = lane->pop()) {
+         if (impl.bounded()) {
+            node->item_ = nullptr;
+         } else {
+            impl_t::dispose(node);
+         }
+      }
    }
    (&impl)->~impl_t();
 }
 
+inline void work_queue::recycle_node(impl_t &impl, node_t *node)
+{
+   node->item_ = nullptr;
+   free_node(impl, node);
+}
+
+inline work_queue::node_t *work_queue::try_pop_node(impl_t &impl, bool fair)
+{
+   const unsigned int classes = impl.num_classes_;
+   unsigned int first_passed = classes;
+   for (unsigned int i = 0; i < classes; ++i) {
+      const unsigned int quota = (fair && (impl.quotas_[i] == 0)) ?
+         impl.drain_quota_ : impl.quotas_[i];
+      if ((quota != 0) && (impl.served_[i] >= quota)) {
+         first_passed = ::std::min(first_passed, i);
+      } else if (node_t * const node = impl.classes_[i].pop()) {
+         served_from(impl, i);
+         return node;
+      }
+   }
+   // Only classes that have used up their quota have anything.
+   for (unsigned int i = first_passed; i < classes; ++i) {
+      if (node_t * const node = impl.classes_[i].pop()) {
+         impl.served_[i] = 0;
+         served_from(impl, i);
+         return node;
+      }
+   }
+   return nullptr;
+}
+
+inline void work_queue::served_from(impl_t &impl, unsigned int priority)
+{
+   ++impl.served_[priority];
+   for (unsigned int i = 0; i < priority; ++i) {
+      impl.served_[i] = 0;
+   }
+}
+
+inline work_queue::node_t *work_queue::pop_node(impl_t &impl, bool fair)
+{
+   // The semaphore says there's an item, but the producer who put it there
+   // might have been overtaken by one who's still linking in an earlier node.
+   // That window is only a couple of instructions wide, so just wait it out.
+   for (;;) {
+      node_t *removednode;
+      if (impl.multiple_consumers_) {
+         ::std::lock_guard< ::std::mutex> lock(impl.consumer_mutex_);
+         removednode = try_pop_node(impl, fair);
+      } else {
+         removednode = try_pop_node(impl, fair);
+      }
+      if (removednode != nullptr) {
+         return removednode;
+      }
+      ::std::this_thread::yield();
+   }
+}
+
 void work_queue::enqueue(work_item_t item, bool out_of_band)
 {
    impl_t &impl = impl_();
-   ::std::unique_ptr<node_t> newnode(make_new_node(impl));
+   if (impl.bounded()) {
+      impl.spaces_.acquire();
+   }
+   push_node(impl, make_new_node(impl), ::std::move(item),
+             impl.class_of(out_of_band));
+}
+
+bool work_queue::try_enqueue(work_item_t &&item, bool out_of_band)
+{
+   impl_t &impl = impl_();
+   if (impl.bounded() && !impl.spaces_.try_acquire()) {
+      return false;
+   }
+   push_node(impl, make_new_node(impl), ::std::move(item),
+             impl.class_of(out_of_band));
+   return true;
+}
+
+void work_queue::enqueue_at(work_item_t item, unsigned int priority)
+{
+   impl_t &impl = impl_();
+   check_priority(impl, priority);
+   if (impl.bounded()) {
+      impl.spaces_.acquire();
+   }
+   push_node(impl, make_new_node(impl), ::std::move(item), priority);
+}
+
+bool work_queue::try_enqueue_at(work_item_t &&item, unsigned int priority)
+{
+   impl_t &impl = impl_();
+   check_priority(impl, priority);
+   if (impl.bounded() && !impl.spaces_.try_acquire()) {
+      return false;
+   }
+   push_node(impl, make_new_node(impl), ::std::move(item), priority);
+   return true;
+}
+
+work_queue::ticket work_queue::enqueue_with_ticket(work_item_t item,
+                                                   bool out_of_band)
+{
+   impl_t &impl = impl_();
+   if (impl.bounded()) {
+      impl.spaces_.acquire();
+   }
+   node_t * const node = make_new_node(impl);
+   const node_t::state_t state =
+      (node->state_.load(::std::memory_order_relaxed) & ~node_t::status_mask) |
+      node_t::ticketed;
+   node->state_.store(state, ::std::memory_order_relaxed);
+   push_node(impl, node, ::std::move(item), impl.class_of(out_of_band));
+   return ticket(node, state);
+}
+
+bool work_queue::enqueue_coalesced(::std::uint64_t key, work_item_t item,
+                                   bool out_of_band)
+{
+   impl_t &impl = impl_();
+   work_item_t superseded;
+   // Only a new item needs space. Replacing a pending one never waits, so
+   // the owner can update its own full queue.
+   bool have_space = !impl.bounded();
+   for (;;) {
+      {
+         ::std::lock_guard< ::std::mutex> lock(impl.keys_mutex_);
+         const auto found = impl.pending_keys_.find(key);
+         if (found != impl.pending_keys_.end()) {
+            // The superseded item is destroyed outside the lock, in case its
+            // destructor enqueues something.
+            superseded.swap(found->second->item_);
+            found->second->item_ = ::std::move(item);
+            break;
+         }
+         if (have_space || impl.spaces_.try_acquire()) {
+            node_t * const node = make_new_node(impl);
+            try {
+               impl.pending_keys_.emplace(key, node);
+            } catch (...) {
+               free_node(impl, node);
+               if (impl.bounded()) {
+                  impl.spaces_.release();
+               }
+               throw;
+            }
+            node->key_ = key;
+            node->state_.store(
+               (node->state_.load(::std::memory_order_relaxed) &
+                ~node_t::status_mask) | node_t::keyed,
+               ::std::memory_order_relaxed);
+            push_node(impl, node, ::std::move(item),
+                      impl.class_of(out_of_band));
+            return false;
+         }
+      }
+      // Wait for space without the lock, then look again, since an item for
+      // the key may have turned up in the meantime.
+      impl.spaces_.acquire();
+      have_space = true;
+   }
+   impl.coalesced_.fetch_add(1, ::std::memory_order_relaxed);
+   if (impl.bounded() && have_space) {
+      impl.spaces_.release();
+   }
+   return true;
+}
+
+work_queue::drain_report
+work_queue::drain_until(::std::chrono::steady_clock::time_point deadline,
+                        ::std::size_t max_items)
+{
+   impl_t &impl = impl_();
+   drain_report report{0, 0};
+   work_item_t item;
+   while ((report.ran < max_items) &&
+          (impl.producer_lanes_ ? lane_take(impl, item, true)
+                                : take_shared(impl, item, true)))
    {
-      lock_guard lock(out_of_band ? impl.oob_queue_mutex_ : impl.queue_mutex_);
-      node_t *&head = out_of_band ? impl.oob_queue_head_ : impl.queue_head_;
-      node_t *&tail = out_of_band ? impl.oob_queue_tail_ : impl.queue_tail_;
-      if (tail != nullptr) {
-         tail->next_ = newnode.get();
-         tail = newnode.release();
-      } else {
-         head = tail = newnode.release();
+      ++report.ran;
+      item();
+      item = nullptr;
+      if (::std::chrono::steady_clock::now() >= deadline) {
+         break;
       }
-      tail->item_ = ::std::move(item);
    }
-   impl.numitems_.release();
+   report.backlog = backlog();
+   return report;
+}
+
+::std::size_t work_queue::backlog() const
+{
+   const impl_t &impl = impl_();
+   const int shared = impl.numitems_.getvalue();
+   ::std::size_t total = (shared > 0) ? static_cast< ::std::size_t>(shared) : 0;
+   for (const producer_lane::lane_t *lane: impl.consumer_lanes_) {
+      total += lane->ring_.size();
+   }
+   return total;
+}
+
+::std::uint64_t work_queue::coalesced_count() const
+{
+   return impl_().coalesced_.load(::std::memory_order_relaxed);
+}
+
+void work_queue::set_owner(unsigned int max_depth)
+{
+   impl_t &impl = impl_();
+   if (max_depth == 0) {
+      clear_owner();
+   } else {
+      impl.inline_limit_ = max_depth;
+      impl.owner_.store(::std::this_thread::get_id(),
+                        ::std::memory_order_relaxed);
+   }
+}
+
+void work_queue::clear_owner()
+{
+   impl_().owner_.store(::std::thread::id(), ::std::memory_order_relaxed);
+}
+
+bool work_queue::try_run_inline(work_item_t &item)
+{
+   impl_t &impl = impl_();
+   if ((impl.owner_.load(::std::memory_order_relaxed) !=
+        ::std::this_thread::get_id()) ||
+       (impl.inline_depth_ >= impl.inline_limit_))
+   {
+      return false;
+   }
+   struct depth_guard {
+      unsigned int &depth_;
+      explicit depth_guard(unsigned int &depth) : depth_(depth) { ++depth_; }
+      ~depth_guard() { --depth_; }
+   } guard(impl.inline_depth_);
+   item();
+   return true;
+}
+
+work_queue::stats_snapshot work_queue::stats() const
+{
+#if SPARKLES_WORK_QUEUE_STATS
+   return impl_().stats_->snapshot();
+#else
+   return stats_snapshot();
+#endif
 }
 
-work_queue::work_item_t work_queue::real_dequeue(impl_t &impl)
+bool work_queue::ticket::cancel()
 {
-   ::std::unique_ptr<node_t> removednode;
+   node_t * const node = node_;
+   if (node == nullptr) {
+      return false;
+   }
+   node_ = nullptr;
+   node_t::state_t expected = state_;
+   if (!node->state_.compare_exchange_strong(expected,
+                                             state_ | node_t::cancelling,
+                                             ::std::memory_order_acquire,
+                                             ::std::memory_order_relaxed))
    {
-      lock_guard lock(impl.oob_queue_mutex_);
-      removednode.reset(remove_from_queue(impl.oob_queue_head_,
-                                          impl.oob_queue_tail_));
+      return false;
    }
-   if (removednode == nullptr) {
-      lock_guard lock(impl.queue_mutex_);
-      removednode.reset(remove_from_queue(impl.queue_head_, impl.queue_tail_));
+   node->item_ = nullptr;
+   node->state_.store(state_ | node_t::cancelled, ::std::memory_order_release);
+   return true;
+}
+
+unsigned int work_queue::priority_classes() const
+{
+   return impl_().num_classes_;
+}
+
+void work_queue::check_priority(const impl_t &impl, unsigned int priority)
+{
+   if (priority >= impl.num_classes_) {
+      throw ::std::invalid_argument("No such work_queue priority class.");
    }
-   if (removednode != nullptr) {
-      work_item_t dequeued_item;
-      dequeued_item.swap(removednode->item_);
-      {
-         lock_guard lock(impl.deleted_queue_mutex_);
-         removednode->next_ = impl.deleted_head_;
-         impl.deleted_head_ = removednode.release();
+}
+
+bool work_queue::enqueue_until(work_item_t &&item,
+                               ::std::chrono::steady_clock::time_point deadline,
+                               bool out_of_band)
+{
+   impl_t &impl = impl_();
+   if (impl.bounded() && !impl.spaces_.acquire_until(deadline)) {
+      return false;
+   }
+   push_node(impl, make_new_node(impl), ::std::move(item),
+             impl.class_of(out_of_band));
+   return true;
+}
+
+::std::size_t work_queue::capacity() const
+{
+   return impl_().capacity_;
+}
+
+int work_queue::numa_node() const
+{
+   return impl_().numa_node_;
+}
+
+bool work_queue::claim_node(impl_t &impl, node_t *node)
+{
+   node_t::state_t state = node->state_.load(::std::memory_order_acquire);
+   if ((state & node_t::keyed) != 0) {
+      // Nobody may replace the item once this returns.
+      ::std::lock_guard< ::std::mutex> lock(impl.keys_mutex_);
+      impl.pending_keys_.erase(node->key_);
+      node->state_.store(state & ~node_t::keyed, ::std::memory_order_relaxed);
+      return true;
+   } else if ((state & node_t::ticketed) == 0) {
+      return true;
+   }
+   for (;;) {
+      switch (state & node_t::status_mask) {
+       case node_t::queued:
+         if (node->state_.compare_exchange_weak(state,
+                                                state | node_t::claimed,
+                                                ::std::memory_order_acquire,
+                                                ::std::memory_order_acquire))
+         {
+            return true;
+         }
+         break;
+       case node_t::cancelled:
+         // The ticket holder already destroyed the item.
+         impl.note_cancelled(node);
+         free_node(impl, node);
+         return false;
+       default:
+         // The ticket holder is part way through destroying the item.
+         ::std::this_thread::yield();
+         state = node->state_.load(::std::memory_order_acquire);
+         break;
       }
-      return dequeued_item;
+   }
+}
+
+bool work_queue::real_dequeue(impl_t &impl, work_item_t &item, bool fair)
+{
+   node_t * const removednode = pop_node(impl, fair);
+   if (!claim_node(impl, removednode)) {
+      return false;
+   }
+   impl.note_dequeued(removednode);
+   item.swap(removednode->item_);
+   free_node(impl, removednode);
+   return true;
+}
+
+bool work_queue::take_shared(impl_t &impl, work_item_t &item, bool fair)
+{
+   while (impl.numitems_.try_acquire()) {
+      if (real_dequeue(impl, item, fair)) {
+         return true;
+      }
+   }
+   return false;
+}
+
+void work_queue::attach_listener(eventcount *listener)
+{
+   eventcount *expected = nullptr;
+   if (!impl_().listener_.compare_exchange_strong(expected, listener)) {
+      throw ::std::logic_error("This work_queue is already in a queue_set.");
+   }
+}
+
+void work_queue::detach_listener()
+{
+   impl_t &impl = impl_();
+   impl.listener_.store(nullptr, ::std::memory_order_seq_cst);
+   while (impl.notifying_listener_.load(::std::memory_order_acquire) != 0) {
+      ::std::this_thread::yield();
+   }
+}
+
+int work_queue::event_fd() const
+{
+   return impl_().event_fd_;
+}
+
+void work_queue::reset_signal()
+{
+   impl_t &impl = impl_();
+   if (impl.event_fd_ >= 0) {
+      ::eventfd_t value;
+      ::eventfd_read(impl.event_fd_, &value);
+      impl.signalled_.store(false, ::std::memory_order_relaxed);
+      ::std::atomic_thread_fence(::std::memory_order_seq_cst);
+   }
+}
+
+void work_queue::raise_signal()
+{
+   impl_t &impl = impl_();
+   if ((impl.event_fd_ >= 0) &&
+       !impl.signalled_.exchange(true, ::std::memory_order_relaxed))
+   {
+      impl.write_event();
+   }
+}
+
+void work_queue::refresh_lanes(impl_t &impl)
+{
+   if (!impl.lanes_changed_.exchange(false, ::std::memory_order_acquire)) {
+      return;
+   }
+   ::std::lock_guard< ::std::mutex> lock(impl.lanes_mutex_);
+   bool lingering = false;
+   const auto dead = ::std::remove_if(
+      impl.lanes_.begin(), impl.lanes_.end(),
+      [&lingering](const ::std::unique_ptr<producer_lane::lane_t> &lane) {
+         if (!lane->closed_.load(::std::memory_order_acquire)) {
+            return false;
+         } else if (!lane->ring_.empty()) {
+            lingering = true;
+            return false;
+         } else {
+            return true;
+         }
+      });
+   impl.lanes_.erase(dead, impl.lanes_.end());
+   impl.consumer_lanes_.clear();
+   for (const auto &lane: impl.lanes_) {
+      impl.consumer_lanes_.push_back(lane.get());
+   }
+   if (impl.next_lane_ > impl.consumer_lanes_.size()) {
+      impl.next_lane_ = 0;
+   }
+   if (lingering) {
+      // Come back and get rid of them after they've been emptied.
+      impl.lanes_changed_.store(true, ::std::memory_order_relaxed);
+   }
+}
+
+bool work_queue::lane_take(impl_t &impl, work_item_t &item, bool fair)
+{
+   if (!fair && impl.urgent_pending() && take_shared(impl, item)) {
+      return true;
+   }
+   refresh_lanes(impl);
+   // The regular lanes take a turn after all the producer lanes.
+   const ::std::size_t turns = impl.consumer_lanes_.size() + 1;
+   for (::std::size_t i = 0; i < turns; ++i) {
+      const ::std::size_t turn = impl.next_lane_;
+      impl.next_lane_ = (turn + 1 < turns) ? turn + 1 : 0;
+      if (turn == impl.consumer_lanes_.size()) {
+         if (take_shared(impl, item, fair)) {
+            return true;
+         }
+      } else {
+         producer_lane::lane_t &lane = *impl.consumer_lanes_[turn];
+         if (lane.ring_.try_pop(item)) {
+            impl.note_lane_dequeued();
+            lane.spaces_.notify_one();
+            return true;
+         }
+      }
+   }
+   return false;
+}
+
+void work_queue::chain_reserve(item_chain &chain, ::std::size_t count)
+{
+   impl_t &impl = impl_();
+   if (!impl.bounded() || (count == 0)) {
+      return;
+   } else if (count > impl.capacity_) {
+      throw ::std::invalid_argument("A batch bigger than the work_queue's "
+                                    "capacity would never fit.");
+   }
+   // Room that's taken is either for an item that's been queued, and the
+   // reader will give it back, or for one that's just about to be. So one
+   // batch at a time always gets all it needs eventually.
+   ::std::lock_guard< ::std::mutex> lock(impl.bulk_mutex_);
+   while (chain.reserved_ < count) {
+      const ::std::size_t wanted =
+         ::std::min< ::std::size_t>(count - chain.reserved_, UINT_MAX);
+      const unsigned int got = impl.spaces_.try_acquire_up_to(
+         static_cast<unsigned int>(wanted));
+      if (got > 0) {
+         chain.reserved_ += got;
+      } else {
+         impl.spaces_.acquire();
+         ++chain.reserved_;
+      }
+   }
+}
+
+void work_queue::chain_append(item_chain &chain, work_item_t item)
+{
+   impl_t &impl = impl_();
+   if (chain.reserved_ > 0) {
+      --chain.reserved_;
+   } else if (impl.bounded()) {
+      impl.spaces_.acquire();
+   }
+   node_t * const newnode = make_new_node(impl);
+   newnode->item_ = ::std::move(item);
+   if (chain.last_ != nullptr) {
+      chain.last_->next_.store(newnode, ::std::memory_order_relaxed);
    } else {
-      throw ::std::logic_error("A queue that claims to have items is empty.");
+      chain.first_ = newnode;
    }
+   chain.last_ = newnode;
+   ++chain.count_;
+}
+
+void work_queue::chain_discard(item_chain &chain) noexcept
+{
+   impl_t &impl = impl_();
+   node_t *node = chain.first_;
+   while (chain.count_ > 0) {
+      node_t * const next = static_cast<node_t *>(node->next_.load());
+      recycle_node(impl, node);
+      node = next;
+      --chain.count_;
+   }
+   chain.first_ = chain.last_ = nullptr;
+   if (chain.reserved_ > 0) {
+      impl.spaces_.release(static_cast<unsigned int>(chain.reserved_));
+      chain.reserved_ = 0;
+   }
+}
+
+void work_queue::chain_commit(item_chain &chain, bool out_of_band)
+{
+   if (chain.reserved_ > 0) {
+      // The range was shorter than it said.
+      impl_().spaces_.release(static_cast<unsigned int>(chain.reserved_));
+      chain.reserved_ = 0;
+   }
+   if (chain.count_ > 0) {
+      impl_t &impl = impl_();
+      const unsigned int priority = impl.class_of(out_of_band);
+      node_t *node = chain.first_;
+      for (::std::size_t i = 0; i < chain.count_; ++i) {
+         impl.note_enqueued(node, priority);
+         node = static_cast<node_t *>(
+            node->next_.load(::std::memory_order_relaxed));
+      }
+      impl.classes_[priority].push_chain(chain.first_, chain.last_);
+      ::std::size_t count = chain.count_;
+      chain.first_ = chain.last_ = nullptr;
+      chain.count_ = 0;
+      while (count > 0) {
+         const unsigned int batch = ::std::min< ::std::size_t>(count, UINT_MAX);
+         impl.post_items(batch);
+         count -= batch;
+      }
+   }
+}
+
+::std::size_t work_queue::drain_impl(visit_func_t visit, void *visitor,
+                                     ::std::size_t max_items)
+{
+   impl_t &impl = impl_();
+   if (impl.producer_lanes_) {
+      ::std::size_t visited = 0;
+      work_item_t item;
+      while ((visited < max_items) && lane_take(impl, item)) {
+         ++visited;
+         visit(visitor, item);
+         item = nullptr;
+      }
+      return visited;
+   }
+   ::std::size_t visited = 0;
+   while (visited < max_items) {
+      // Cancelled items don't count, so this may take more than one go.
+      const unsigned int available = impl.numitems_.try_acquire_up_to(
+         ::std::min< ::std::size_t>(max_items - visited, UINT_MAX)
+         );
+      if (available == 0) {
+         break;
+      }
+      for (unsigned int taken = 0; taken < available; ++taken) {
+         node_t * const node = pop_node(impl);
+         if (!claim_node(impl, node)) {
+            continue;
+         }
+         impl.note_dequeued(node);
+         try {
+            visit(visitor, node->item_);
+         } catch (...) {
+            recycle_node(impl, node);
+            impl.numitems_.release(available - taken - 1);
+            throw;
+         }
+         recycle_node(impl, node);
+         ++visited;
+      }
+   }
+   return visited;
 }
 
 work_queue::possible_work_item_t work_queue::dequeue(bool block)
 {
    impl_t &impl = impl_();
+   if (impl.producer_lanes_) {
+      work_item_t item;
+      if (lane_take(impl, item)) {
+         return possible_work_item_t(::std::move(item));
+      } else if (!block) {
+         return {};
+      }
+      for (;;) {
+         const eventcount::key_t key = impl.ready_.prepare_wait();
+         if (lane_take(impl, item)) {
+            impl.ready_.cancel_wait();
+            return possible_work_item_t(::std::move(item));
+         }
+         impl.ready_.wait(key);
+      }
+   }
+   work_item_t item;
    if (block) {
-      impl.numitems_.acquire();
-      return real_dequeue(impl);
-   } else if (impl.numitems_.try_acquire()) {
-      return real_dequeue(impl);
+      do {
+         impl.numitems_.acquire();
+      } while (!real_dequeue(impl, item));
+      return possible_work_item_t(::std::move(item));
+   } else if (take_shared(impl, item)) {
+      return possible_work_item_t(::std::move(item));
    } else {
       return {};
    }
 }
 
+work_queue::possible_work_item_t
+work_queue::dequeue_until(::std::chrono::steady_clock::time_point deadline)
+{
+   impl_t &impl = impl_();
+   work_item_t item;
+   if (impl.producer_lanes_) {
+      bool waiting = true;
+      while (!lane_take(impl, item)) {
+         if (!waiting) {
+            return {};
+         }
+         const eventcount::key_t key = impl.ready_.prepare_wait();
+         if (lane_take(impl, item)) {
+            impl.ready_.cancel_wait();
+            break;
+         }
+         waiting = impl.ready_.wait_until(key, deadline);
+      }
+      return possible_work_item_t(::std::move(item));
+   }
+   do {
+      if (!impl.numitems_.acquire_until(deadline)) {
+         return {};
+      }
+   } while (!real_dequeue(impl, item));
+   return possible_work_item_t(::std::move(item));
+}
+
+work_queue::producer_lane::producer_lane(work_queue &wq, ::std::size_t capacity)
+     : lane_(nullptr)
+{
+   impl_t &impl = wq.impl_();
+   if (!impl.producer_lanes_) {
+      throw ::std::logic_error("This work_queue wasn't constructed with "
+                               "producer lanes.");
+   } else if (capacity == 0) {
+      throw ::std::invalid_argument("A producer_lane must hold something.");
+   }
+   ::std::unique_ptr<lane_t> lane(new lane_t(impl, capacity, impl.numa_node_));
+   const_cast<lane_t *&>(lane_) = lane.get();
+   ::std::lock_guard< ::std::mutex> lock(impl.lanes_mutex_);
+   impl.lanes_.push_back(::std::move(lane));
+   impl.lanes_changed_.store(true, ::std::memory_order_release);
+}
+
+work_queue::producer_lane::~producer_lane()
+{
+   lane_->closed_.store(true, ::std::memory_order_release);
+   lane_->queue_.lanes_changed_.store(true, ::std::memory_order_release);
+}
+
+void work_queue::producer_lane::enqueue(work_item_t item)
+{
+   lane_t &lane = *lane_;
+   while (!lane.ring_.try_push(item)) {
+      const eventcount::key_t key = lane.spaces_.prepare_wait();
+      if (lane.ring_.try_push(item)) {
+         lane.spaces_.cancel_wait();
+         break;
+      }
+      lane.spaces_.wait(key);
+   }
+   lane.queue_.note_lane_enqueued();
+   lane.queue_.wake_consumer(1);
+}
+
+bool work_queue::producer_lane::try_enqueue(work_item_t &&item)
+{
+   lane_t &lane = *lane_;
+   if (!lane.ring_.try_push(item)) {
+      return false;
+   }
+   lane.queue_.note_lane_enqueued();
+   lane.queue_.wake_consumer(1);
+   return true;
+}
+
 } // namespace sparkles
@@ -0,0 +1,102 @@
+// A contention benchmark for work_queue.
+//
+// One consumer thread drains a fixed number of items that are enqueued by 1 to
+// N producer threads at once. The interesting number is how the per item cost
+// changes as producers are added, a queue that serializes its producers on a
+// lock falls apart much faster than one that doesn't.
+//
+// Each run is done twice, once with every producer using the shared enqueue and
+// once with each producer writing to its own producer_lane.
+//
+// Usage: work_queue_bench [max_producers [total_items]]
+
+#include <sparkles/work_queue.hpp>
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <thread>
+#include <vector>
+
+namespace {
+
+using ::sparkles::work_queue;
+typedef ::std::chrono::steady_clock clock_type;
+
+double run_once(unsigned int producers, unsigned long total_items,
+                bool use_lanes)
+{
+   work_queue::config cfg;
+   cfg.producer_lanes = use_lanes;
+   work_queue wq(cfg);
+   ::std::atomic<bool> go{false};
+   unsigned long sum = 0;
+   const unsigned long per_producer = total_items / producers;
+   auto produce = [&wq, &go, &sum, per_producer,
+                   use_lanes](unsigned int which) {
+      ::std::unique_ptr<work_queue::producer_lane> lane;
+      if (use_lanes) {
+         lane.reset(new work_queue::producer_lane(wq));
+      }
+      while (!go.load()) {
+         ::std::this_thread::yield();
+      }
+      for (unsigned long i = 0; i < per_producer; ++i) {
+         if (lane) {
+            lane->enqueue([&sum]() { ++sum; });
+         } else {
+            // Every seventh item is out of band, like in the stress test.
+            wq.enqueue([&sum]() { ++sum; }, ((i + which) % 7) == 6);
+         }
+      }
+   };
+   ::std::vector< ::std::thread> threads;
+   for (unsigned int i = 0; i < producers; ++i) {
+      threads.emplace_back(produce, i);
+   }
+   const auto start = clock_type::now();
+   go.store(true);
+   const unsigned long expected = per_producer * producers;
+   for (unsigned long i = 0; i < expected; ++i) {
+      wq.dequeue(true).value()();
+   }
+   const auto end = clock_type::now();
+   for (auto &thread: threads) {
+      thread.join();
+   }
+   if (sum != expected) {
+      ::std::fprintf(stderr, "Lost items! %lu != %lu\n", sum, expected);
+      ::std::exit(1);
+   }
+   const ::std::chrono::duration<double, ::std::nano> elapsed = end - start;
+   return elapsed.count() / expected;
+}
+
+} // anonymous namespace
+
+int main(int argc, char *argv[])
+{
+   unsigned int max_producers = ::std::thread::hardware_concurrency();
+   unsigned long total_items = 1UL << 21;
+   if (argc > 1) {
+      max_producers = ::std::strtoul(argv[1], nullptr, 10);
+   }
+   if (argc > 2) {
+      total_items = ::std::strtoul(argv[2], nullptr, 10);
+   }
+   if (max_producers < 1) {
+      max_producers = 1;
+   }
+   ::std::printf("work_queue: %lu items, 1 consumer\n", total_items);
+   ::std::printf("%10s %12s %14s %12s %14s\n", "producers",
+                 "ns/item", "Mitems/s", "lane ns/item", "lane Mitems/s");
+   for (unsigned int producers = 1; producers <= max_producers; ++producers) {
+      const double ns = run_once(producers, total_items, false);
+      const double lane_ns = run_once(producers, total_items, true);
+      ::std::printf("%10u %12.1f %14.2f %12.1f %14.2f\n", producers,
+                    ns, 1000.0 / ns, lane_ns, 1000.0 / lane_ns);
+   }
+   return 0;
+}
@@ -3,10 +3,15 @@
 // Required to make ::std::this_thread::yield work.
 #define _GLIBCXX_USE_SCHED_YIELD
 
+#include "test_allocation.hpp"
+
 #include <sparkles/work_queue.hpp>
 
 #include <boost/test/unit_test.hpp>
 
+#include <sys/epoll.h>
+#include <unistd.h>
+
 #include <functional>
 #include <atomic>
 #include <thread>
@@ -14,6 +19,9 @@
 #include <chrono>
 #include <vector>
 #include <algorithm>
+#include <iterator>
+#include <memory>
+#include <stdexcept>
 
 namespace sparkles {
 namespace test {
@@ -109,6 +117,839 @@ BOOST_AUTO_TEST_CASE( oob_first )
    BOOST_CHECK(!wq.dequeue(false));
 }
 
+BOOST_AUTO_TEST_CASE( priority_classes )
+{
+   ::std::vector<int> order;
+   auto record = [&order](int which) -> work_queue::work_item_t {
+      return [&order, which]() { order.push_back(which); };
+   };
+   work_queue::config cfg;
+   cfg.priority_classes = 3;
+   work_queue wq(cfg);
+   BOOST_CHECK_EQUAL(wq.priority_classes(), 3U);
+   BOOST_CHECK_THROW(wq.enqueue_at(record(0), 3), ::std::invalid_argument);
+   wq.enqueue(record(20));
+   wq.enqueue_at(record(10), 1);
+   wq.enqueue_at(record(11), 1);
+   wq.enqueue_at(record(21), 2);
+   BOOST_CHECK(wq.try_enqueue_at(record(0), 0));
+   wq.enqueue(record(1), true);
+   BOOST_CHECK_EQUAL(wq.drain(100), 6U);
+   BOOST_CHECK((order == ::std::vector<int>{0, 1, 10, 11, 20, 21}));
+}
+
+BOOST_AUTO_TEST_CASE( priority_quotas )
+{
+   ::std::vector<int> order;
+   auto record = [&order](int which) -> work_queue::work_item_t {
+      return [&order, which]() { order.push_back(which); };
+   };
+   work_queue::config cfg;
+   cfg.priority_classes = 3;
+   cfg.quotas = {2, 0};
+   BOOST_CHECK_THROW(work_queue bad(cfg), ::std::invalid_argument);
+   cfg.quotas = {2, 1, 0};
+   work_queue wq(cfg);
+   for (int i = 0; i < 6; ++i) {
+      wq.enqueue_at(record(i), 0);
+   }
+   wq.enqueue_at(record(10), 1);
+   wq.enqueue_at(record(11), 1);
+   wq.enqueue_at(record(20), 2);
+   BOOST_CHECK_EQUAL(wq.drain(100), 9U);
+   // Class 0 gets two in a row, then class 1 gets one. Class 1 has then used
+   // its quota, so when class 0 next runs out of quota, class 2 goes.
+   BOOST_CHECK((order == ::std::vector<int>{0, 1, 10, 2, 3, 20, 4, 5, 11}));
+}
+
+BOOST_AUTO_TEST_CASE( bulk_enqueue )
+{
+   ::std::vector<int> executed;
+   auto execute = [&executed](int which) -> void {
+      executed.push_back(which);
+   };
+   work_queue wq;
+   ::std::vector<work_queue::work_item_t> batch;
+   for (int i = 0; i < 5; ++i) {
+      batch.emplace_back(::std::bind(execute, i));
+   }
+   wq.enqueue(::std::bind(execute, 100));
+   wq.enqueue_bulk(batch);
+   batch.clear();
+   batch.emplace_back(::std::bind(execute, 200));
+   batch.emplace_back(::std::bind(execute, 201));
+   wq.enqueue_bulk(::std::move(batch), true);
+   wq.enqueue_bulk(::std::vector<work_queue::work_item_t>{});
+   for (int i = 0; i < 8; ++i) {
+      wq.dequeue(false).value()();
+   }
+   BOOST_CHECK(!wq.dequeue(false));
+   const ::std::vector<int> expected{200, 201, 100, 0, 1, 2, 3, 4};
+   BOOST_CHECK_EQUAL_COLLECTIONS(executed.begin(), executed.end(),
+                                 expected.begin(), expected.end());
+}
+
+BOOST_AUTO_TEST_CASE( bulk_enqueue_too_big )
+{
+   work_queue::config cfg;
+   cfg.capacity = 4;
+   work_queue wq(cfg);
+   ::std::vector<work_queue::work_item_t> batch(5);
+   for (auto &item: batch) {
+      item = []() {};
+   }
+   BOOST_CHECK_THROW(wq.enqueue_bulk(batch), ::std::invalid_argument);
+   // None of the room was kept.
+   for (int i = 0; i < 4; ++i) {
+      BOOST_CHECK(wq.try_enqueue([]() {}));
+   }
+   BOOST_CHECK(!wq.try_enqueue([]() {}));
+}
+
+BOOST_AUTO_TEST_CASE( bulk_enqueue_waits_for_room )
+{
+   // Two batches that each need more than half the room, on a queue that
+   // already has something in it.
+   work_queue::config cfg;
+   cfg.capacity = 4;
+   work_queue wq(cfg);
+   ::std::vector<int> executed;
+   wq.enqueue([&executed]() { executed.push_back(0); });
+   auto producer = [&wq, &executed](int first) {
+      ::std::vector<work_queue::work_item_t> batch;
+      for (int i = first; i < first + 3; ++i) {
+         batch.emplace_back([&executed, i]() { executed.push_back(i); });
+      }
+      wq.enqueue_bulk(::std::move(batch));
+   };
+   ::std::thread first(producer, 10);
+   ::std::thread second(producer, 20);
+   while (executed.size() < 7) {
+      auto item = wq.dequeue_for(::std::chrono::seconds(10));
+      BOOST_REQUIRE(item);
+      item.value()();
+   }
+   first.join();
+   second.join();
+   BOOST_CHECK_EQUAL(executed[0], 0);
+   // Each batch came out in one piece.
+   const bool ten_first = (executed[1] == 10);
+   const ::std::vector<int> expected = ten_first ?
+      ::std::vector<int>{0, 10, 11, 12, 20, 21, 22} :
+      ::std::vector<int>{0, 20, 21, 22, 10, 11, 12};
+   BOOST_CHECK_EQUAL_COLLECTIONS(executed.begin(), executed.end(),
+                                 expected.begin(), expected.end());
+}
+
+BOOST_AUTO_TEST_CASE( drain_items )
+{
+   ::std::vector<int> executed;
+   auto execute = [&executed](int which) -> void {
+      executed.push_back(which);
+   };
+   work_queue wq;
+   BOOST_CHECK_EQUAL(wq.drain(10), 0U);
+   for (int i = 0; i < 6; ++i) {
+      wq.enqueue(::std::bind(execute, i), i == 4);
+   }
+   int visits = 0;
+   auto visitor = [&visits](work_queue::work_item_t &item) -> void {
+      ++visits;
+      item();
+   };
+   BOOST_CHECK_EQUAL(wq.drain(visitor, 2), 2U);
+   BOOST_CHECK_EQUAL(visits, 2);
+   BOOST_CHECK_EQUAL(wq.drain(10), 4U);
+   BOOST_CHECK(!wq.dequeue(false));
+   const ::std::vector<int> expected{4, 0, 1, 2, 3, 5};
+   BOOST_CHECK_EQUAL_COLLECTIONS(executed.begin(), executed.end(),
+                                 expected.begin(), expected.end());
+}
+
+BOOST_AUTO_TEST_CASE( drain_throws )
+{
+   int which_executed = -1;
+   auto execute = [&which_executed](int which) -> void {
+      which_executed = which;
+      if (which == 1) {
+         throw ::std::runtime_error("Item 1 throws.");
+      }
+   };
+   work_queue wq;
+   for (int i = 0; i < 4; ++i) {
+      wq.enqueue(::std::bind(execute, i));
+   }
+   BOOST_CHECK_THROW(wq.drain(10), ::std::runtime_error);
+   BOOST_CHECK_EQUAL(which_executed, 1);
+   wq.dequeue(false).value()();
+   BOOST_CHECK_EQUAL(which_executed, 2);
+   BOOST_CHECK_EQUAL(wq.drain(10), 1U);
+   BOOST_CHECK_EQUAL(which_executed, 3);
+   BOOST_CHECK(!wq.dequeue(false));
+}
+
+BOOST_AUTO_TEST_CASE( bounded_try_enqueue )
+{
+   int which_executed = -1;
+   auto execute = [&which_executed](int which) -> void {
+      which_executed = which;
+   };
+   work_queue::config cfg;
+   cfg.capacity = 3;
+   work_queue wq(cfg);
+   BOOST_CHECK_EQUAL(wq.capacity(), 3U);
+   BOOST_CHECK_EQUAL(work_queue().capacity(), 0U);
+   BOOST_CHECK(wq.try_enqueue(::std::bind(execute, 0)));
+   BOOST_CHECK(wq.try_enqueue(::std::bind(execute, 1)));
+   BOOST_CHECK(wq.try_enqueue(::std::bind(execute, 2), true));
+   work_queue::work_item_t extra{::std::bind(execute, 3)};
+   BOOST_CHECK(!wq.try_enqueue(::std::move(extra)));
+   BOOST_CHECK(!wq.try_enqueue(::std::move(extra), true));
+   BOOST_REQUIRE(extra);
+   BOOST_CHECK(!wq.enqueue_for(::std::move(extra),
+                               ::std::chrono::milliseconds(10)));
+   BOOST_REQUIRE(extra);
+   wq.dequeue(false).value()();
+   BOOST_CHECK_EQUAL(which_executed, 2);
+   BOOST_CHECK(wq.try_enqueue(::std::move(extra)));
+   BOOST_CHECK(!extra);
+   BOOST_CHECK(!wq.try_enqueue(::std::bind(execute, 4)));
+   BOOST_CHECK_EQUAL(wq.drain(10), 3U);
+   BOOST_CHECK_EQUAL(which_executed, 3);
+   for (int i = 0; i < 3; ++i) {
+      BOOST_CHECK(wq.enqueue_for(::std::bind(execute, 5 + i),
+                                 ::std::chrono::milliseconds(10)));
+   }
+   // Leave items in the queue to be cleaned up by the destructor.
+}
+
+BOOST_AUTO_TEST_CASE( bounded_enqueue_blocks )
+{
+   ::std::atomic<int> enqueued{0};
+   work_queue::config cfg;
+   cfg.capacity = 2;
+   work_queue wq(cfg);
+   auto writing_func = [&enqueued, &wq]() -> void {
+      for (int i = 0; i < 4; ++i) {
+         wq.enqueue([]() {});
+         ++enqueued;
+      }
+   };
+   ::std::thread writing_thread(writing_func);
+   ::std::this_thread::sleep_for(::std::chrono::milliseconds(20));
+   BOOST_CHECK_EQUAL(enqueued.load(), 2);
+   wq.dequeue(true).value()();
+   ::std::this_thread::sleep_for(::std::chrono::milliseconds(20));
+   BOOST_CHECK_EQUAL(enqueued.load(), 3);
+   for (int i = 0; i < 3; ++i) {
+      wq.dequeue(true).value()();
+   }
+   BOOST_REQUIRE(writing_thread.joinable());
+   writing_thread.join();
+   BOOST_CHECK_EQUAL(enqueued.load(), 4);
+   BOOST_CHECK(!wq.dequeue(false));
+}
+
+BOOST_AUTO_TEST_CASE( bounded_stress )
+{
+   constexpr int num_enqueues = 1 << 16;
+   ::std::atomic<long> sum{0};
+   work_queue::config cfg;
+   cfg.capacity = 64;
+   work_queue wq(cfg);
+   auto mass_enqueue = [&wq, &sum](int start) -> void {
+      for (int i = start; i < num_enqueues; i += 2) {
+         wq.enqueue([&sum, i]() { sum += i; }, (i % 7) == 6);
+      }
+   };
+   ::std::thread enqueueing_thread1(mass_enqueue, 0);
+   ::std::thread enqueueing_thread2(mass_enqueue, 1);
+   for (int i = 0; i < num_enqueues; ++i) {
+      wq.dequeue(true).value()();
+   }
+   enqueueing_thread1.join();
+   enqueueing_thread2.join();
+   BOOST_CHECK(!wq.dequeue(false));
+   BOOST_CHECK_EQUAL(sum.load(), (long(num_enqueues) * (num_enqueues - 1)) / 2);
+}
+
+BOOST_AUTO_TEST_CASE( multiple_consumers_order )
+{
+   ::std::vector<int> order;
+   work_queue::config cfg;
+   cfg.multiple_consumers = true;
+   work_queue wq(cfg);
+   for (int i = 0; i < 4; ++i) {
+      wq.enqueue([&order, i]() { order.push_back(i); });
+   }
+   wq.enqueue([&order]() { order.push_back(10); }, true);
+   while (auto item = wq.dequeue(false)) {
+      item.value()();
+   }
+   BOOST_CHECK((order == ::std::vector<int>{10, 0, 1, 2, 3}));
+}
+
+BOOST_AUTO_TEST_CASE( multiple_consumers_stress )
+{
+   constexpr int num_enqueues = 1 << 16;
+   constexpr int num_consumers = 3;
+   ::std::atomic<long> sum{0};
+   ::std::atomic<int> executed{0};
+   work_queue::config cfg;
+   cfg.multiple_consumers = true;
+   work_queue wq(cfg);
+   auto mass_enqueue = [&wq, &sum, &executed](int start) -> void {
+      for (int i = start; i < num_enqueues; i += 2) {
+         wq.enqueue([&sum, &executed, i]() { sum += i; ++executed; },
+                    (i % 7) == 6);
+      }
+   };
+   auto consume = [&wq]() -> void {
+      // An empty item is the signal to stop.
+      for (auto item = wq.dequeue(true); item.value(); item = wq.dequeue(true))
+      {
+         item.value()();
+      }
+   };
+   ::std::vector< ::std::thread> consumers;
+   for (int i = 0; i < num_consumers; ++i) {
+      consumers.emplace_back(consume);
+   }
+   ::std::thread enqueueing_thread1(mass_enqueue, 0);
+   ::std::thread enqueueing_thread2(mass_enqueue, 1);
+   enqueueing_thread1.join();
+   enqueueing_thread2.join();
+   for (int i = 0; i < num_consumers; ++i) {
+      wq.enqueue(nullptr);
+   }
+   for (auto &consumer: consumers) {
+      consumer.join();
+   }
+   BOOST_CHECK(!wq.dequeue(false));
+   BOOST_CHECK_EQUAL(executed.load(), num_enqueues);
+   BOOST_CHECK_EQUAL(sum.load(), (long(num_enqueues) * (num_enqueues - 1)) / 2);
+}
+
+BOOST_AUTO_TEST_CASE( producer_lane_config )
+{
+   work_queue plain;
+   BOOST_CHECK_THROW(work_queue::producer_lane lane(plain), ::std::logic_error);
+   work_queue::config cfg;
+   cfg.producer_lanes = true;
+   cfg.multiple_consumers = true;
+   BOOST_CHECK_THROW(work_queue wq(cfg), ::std::invalid_argument);
+   cfg.multiple_consumers = false;
+   work_queue wq(cfg);
+   BOOST_CHECK_THROW(work_queue::producer_lane lane(wq, 0),
+                     ::std::invalid_argument);
+}
+
+BOOST_AUTO_TEST_CASE( producer_lane_order )
+{
+   ::std::vector<int> order;
+   auto record = [&order](int which) -> work_queue::work_item_t {
+      return [&order, which]() { order.push_back(which); };
+   };
+   work_queue::config cfg;
+   cfg.producer_lanes = true;
+   work_queue wq(cfg);
+   {
+      work_queue::producer_lane lane(wq, 4);
+      for (int i = 0; i < 4; ++i) {
+         BOOST_CHECK(lane.try_enqueue(record(i)));
+      }
+      BOOST_CHECK(!lane.try_enqueue(record(4)));
+      wq.enqueue(record(10));
+      wq.enqueue(record(20), true);
+      wq.dequeue(true).value()();
+      BOOST_CHECK_EQUAL(order.back(), 20);
+      BOOST_CHECK(!lane.try_enqueue(record(4)));
+      wq.dequeue(true).value()();
+      BOOST_CHECK(lane.try_enqueue(record(4)));
+   }
+   // The lane is gone, but what was in it is still there.
+   BOOST_CHECK_EQUAL(wq.drain(100), 5U);
+   BOOST_CHECK(!wq.dequeue(false));
+   ::std::vector<int> from_lane;
+   ::std::copy_if(order.begin(), order.end(), ::std::back_inserter(from_lane),
+                  [](int which) { return which < 10; });
+   BOOST_CHECK((from_lane == ::std::vector<int>{0, 1, 2, 3, 4}));
+   BOOST_CHECK_EQUAL(::std::count(order.begin(), order.end(), 10), 1);
+   work_queue::producer_lane another(wq);
+   another.enqueue(record(5));
+   wq.dequeue(true).value()();
+   BOOST_CHECK_EQUAL(order.back(), 5);
+}
+
+BOOST_AUTO_TEST_CASE( producer_lane_stress )
+{
+   constexpr int num_lanes = 3;
+   constexpr int per_producer = 1 << 15;
+   ::std::atomic<long> sum{0};
+   ::std::vector<int> last_seen(num_lanes + 1, -1);
+   bool in_order = true;
+   work_queue::config cfg;
+   cfg.producer_lanes = true;
+   work_queue wq(cfg);
+   auto item = [&](int producer, int i) -> work_queue::work_item_t {
+      return [&, producer, i]() {
+         in_order = in_order && (last_seen[producer] == i - 1);
+         last_seen[producer] = i;
+         sum += i;
+      };
+   };
+   auto lane_producer = [&wq, &item](int producer) -> void {
+      // A small lane so the producer has to wait for room now and then.
+      work_queue::producer_lane lane(wq, 16);
+      for (int i = 0; i < per_producer; ++i) {
+         lane.enqueue(item(producer, i));
+      }
+   };
+   ::std::vector< ::std::thread> producers;
+   for (int i = 0; i < num_lanes; ++i) {
+      producers.emplace_back(lane_producer, i);
+   }
+   producers.emplace_back([&wq, &item]() -> void {
+         for (int i = 0; i < per_producer; ++i) {
+            wq.enqueue(item(num_lanes, i));
+         }
+      });
+   for (int i = 0; i < (num_lanes + 1) * per_producer; ++i) {
+      wq.dequeue(true).value()();
+   }
+   for (auto &producer: producers) {
+      producer.join();
+   }
+   BOOST_CHECK(!wq.dequeue(false));
+   BOOST_CHECK(in_order);
+   BOOST_CHECK_EQUAL(sum.load(), (num_lanes + 1) *
+                     ((long(per_producer) * (per_producer - 1)) / 2));
+}
+
+BOOST_AUTO_TEST_CASE( pollable )
+{
+   work_queue plain;
+   BOOST_CHECK_EQUAL(plain.event_fd(), -1);
+   work_queue::config cfg;
+   cfg.pollable = true;
+   work_queue wq(cfg);
+   BOOST_REQUIRE(wq.event_fd() >= 0);
+   const int epfd = ::epoll_create1(EPOLL_CLOEXEC);
+   BOOST_REQUIRE(epfd >= 0);
+   ::epoll_event event{};
+   event.events = EPOLLIN | EPOLLET;
+   BOOST_REQUIRE_EQUAL(::epoll_ctl(epfd, EPOLL_CTL_ADD, wq.event_fd(), &event),
+                       0);
+   BOOST_CHECK_EQUAL(::epoll_wait(epfd, &event, 1, 0), 0);
+   int executed = 0;
+   for (int i = 0; i < 3; ++i) {
+      wq.enqueue([&executed]() { ++executed; });
+   }
+   BOOST_CHECK_EQUAL(::epoll_wait(epfd, &event, 1, 0), 1);
+   BOOST_CHECK_EQUAL(wq.drain_signalled(2), 2U);
+   // There's one left, so it has to fire again.
+   BOOST_CHECK_EQUAL(::epoll_wait(epfd, &event, 1, 0), 1);
+   BOOST_CHECK_EQUAL(wq.drain_signalled(10), 1U);
+   BOOST_CHECK_EQUAL(::epoll_wait(epfd, &event, 1, 0), 0);
+   BOOST_CHECK_EQUAL(executed, 3);
+
+   // Now with another thread filling it.
+   constexpr int num_enqueues = 1 << 14;
+   ::std::thread producer([&wq, &executed]() {
+         for (int i = 0; i < num_enqueues; ++i) {
+            wq.enqueue([&executed]() { ++executed; });
+         }
+      });
+   while (executed < num_enqueues + 3) {
+      BOOST_REQUIRE_EQUAL(::epoll_wait(epfd, &event, 1, 10000), 1);
+      wq.drain_signalled(64);
+   }
+   producer.join();
+   BOOST_CHECK(!wq.dequeue(false));
+   ::close(epfd);
+   cfg.multiple_consumers = true;
+   BOOST_CHECK_THROW(work_queue bad(cfg), ::std::invalid_argument);
+}
+
+BOOST_AUTO_TEST_CASE( cancel_tickets )
+{
+   ::std::vector<int> order;
+   auto record = [&order](int which) -> work_queue::work_item_t {
+      return [&order, which]() { order.push_back(which); };
+   };
+   work_queue wq;
+   BOOST_CHECK(!work_queue::ticket().cancel());
+   auto first = wq.enqueue_with_ticket(record(0));
+   auto second = wq.enqueue_with_ticket(record(1));
+   auto third = wq.enqueue_with_ticket(record(2), true);
+   auto held = ::std::make_shared<int>(3);
+   auto fourth = wq.enqueue_with_ticket([&order, held]() {
+         order.push_back(*held);
+      });
+   BOOST_CHECK(second.cancel());
+   BOOST_CHECK(!second.cancel());
+   BOOST_CHECK(fourth.cancel());
+   // The item is destroyed right away, not when the reader gets to it.
+   BOOST_CHECK_EQUAL(held.use_count(), 1);
+   wq.dequeue(true).value()();
+   BOOST_CHECK(!third.cancel());
+   BOOST_CHECK_EQUAL(wq.drain(100), 1U);
+   BOOST_CHECK((order == ::std::vector<int>{2, 0}));
+   BOOST_CHECK(!wq.dequeue(false));
+   // first's node has been reused by now, first mustn't cancel the new item.
+   for (int i = 0; i < 4; ++i) {
+      wq.enqueue_with_ticket(record(10 + i));
+   }
+   BOOST_CHECK(!first.cancel());
+   BOOST_CHECK_EQUAL(wq.drain(100), 4U);
+   BOOST_CHECK_EQUAL(order.size(), 6U);
+}
+
+BOOST_AUTO_TEST_CASE( cancel_bounded )
+{
+   work_queue::config cfg;
+   cfg.capacity = 2;
+   work_queue wq(cfg);
+   int executed = 0;
+   auto ticket = wq.enqueue_with_ticket([&executed]() { ++executed; });
+   wq.enqueue([&executed]() { ++executed; });
+   BOOST_CHECK(ticket.cancel());
+   // The cancelled item's place comes back once the reader passes it.
+   BOOST_CHECK(!wq.try_enqueue([]() {}));
+   wq.dequeue(true).value()();
+   BOOST_CHECK_EQUAL(executed, 1);
+   BOOST_CHECK(wq.try_enqueue([&executed]() { ++executed; }));
+   BOOST_CHECK(wq.try_enqueue([&executed]() { ++executed; }));
+   BOOST_CHECK_EQUAL(wq.drain(100), 2U);
+   BOOST_CHECK_EQUAL(executed, 3);
+}
+
+BOOST_AUTO_TEST_CASE( cancel_stress )
+{
+   constexpr int num_enqueues = 1 << 15;
+   ::std::atomic<int> executed{0};
+   int cancelled = 0;
+   work_queue wq;
+   ::std::thread consumer([&wq]() {
+         // An empty item is the signal to stop.
+         for (auto item = wq.dequeue(true); item.value();
+              item = wq.dequeue(true))
+         {
+            item.value()();
+         }
+      });
+   for (int i = 0; i < num_enqueues; ++i) {
+      auto ticket = wq.enqueue_with_ticket([&executed]() { ++executed; });
+      if ((i % 3) == 0 && ticket.cancel()) {
+         ++cancelled;
+      }
+   }
+   wq.enqueue(nullptr);
+   consumer.join();
+   BOOST_CHECK(cancelled > 0);
+   BOOST_CHECK_EQUAL(executed.load() + cancelled, num_enqueues);
+}
+
+BOOST_AUTO_TEST_CASE( coalesced_enqueue )
+{
+   ::std::vector<int> order;
+   auto record = [&order](int which) -> work_queue::work_item_t {
+      return [&order, which]() { order.push_back(which); };
+   };
+   work_queue wq;
+   BOOST_CHECK(!wq.enqueue_coalesced(1, record(10)));
+   wq.enqueue(record(0));
+   BOOST_CHECK(!wq.enqueue_coalesced(2, record(20)));
+   BOOST_CHECK(wq.enqueue_coalesced(1, record(11)));
+   BOOST_CHECK(wq.enqueue_coalesced(1, record(12)));
+   BOOST_CHECK_EQUAL(wq.coalesced_count(), 2U);
+   wq.dequeue(true).value()();
+   // Key 1 has been dequeued, so this is a new item.
+   BOOST_CHECK(!wq.enqueue_coalesced(1, record(13)));
+   BOOST_CHECK(wq.enqueue_coalesced(2, record(21)));
+   BOOST_CHECK_EQUAL(wq.drain(100), 3U);
+   BOOST_CHECK((order == ::std::vector<int>{12, 0, 21, 13}));
+   BOOST_CHECK_EQUAL(wq.coalesced_count(), 3U);
+}
+
+BOOST_AUTO_TEST_CASE( coalesced_full_queue )
+{
+   int ran = 0;
+   work_queue::config cfg;
+   cfg.capacity = 1;
+   work_queue wq(cfg);
+   BOOST_CHECK(!wq.enqueue_coalesced(1, [&ran]() { ran = 1; }));
+   BOOST_CHECK(!wq.try_enqueue([]() {}));
+   // Replacing the pending item needs no space, so it mustn't wait for any.
+   ::std::atomic<bool> replaced(false);
+   ::std::thread updater([&wq, &ran, &replaced]() {
+         replaced = wq.enqueue_coalesced(1, [&ran]() { ran = 2; });
+      });
+   const auto deadline =
+      ::std::chrono::steady_clock::now() + ::std::chrono::seconds(10);
+   while (!replaced && (::std::chrono::steady_clock::now() < deadline)) {
+      ::std::this_thread::sleep_for(::std::chrono::milliseconds(1));
+   }
+   BOOST_CHECK(replaced);
+   // Let it go if it's stuck.
+   wq.dequeue(true).value()();
+   updater.join();
+   BOOST_CHECK_EQUAL(ran, 2);
+   BOOST_CHECK_EQUAL(wq.coalesced_count(), 1U);
+}
+
+BOOST_AUTO_TEST_CASE( coalesced_stress )
+{
+   constexpr int num_enqueues = 1 << 15;
+   constexpr int num_keys = 8;
+   ::std::vector<int> latest(num_keys, -1);
+   bool in_order = true;
+   work_queue::config cfg;
+   cfg.capacity = 16;
+   work_queue wq(cfg);
+   ::std::thread producer([&]() {
+         for (int i = 0; i < num_enqueues; ++i) {
+            const int key = i % num_keys;
+            wq.enqueue_coalesced(key, [&, key, i]() {
+                  in_order = in_order && (latest[key] < i);
+                  latest[key] = i;
+               });
+         }
+         wq.enqueue(nullptr);
+      });
+   long executed = 0;
+   for (auto item = wq.dequeue(true); item.value(); item = wq.dequeue(true)) {
+      item.value()();
+      ++executed;
+   }
+   producer.join();
+   BOOST_CHECK(in_order);
+   BOOST_CHECK_EQUAL(executed + long(wq.coalesced_count()), num_enqueues);
+   for (int key = 0; key < num_keys; ++key) {
+      // The last update for every key always gets through.
+      BOOST_CHECK_EQUAL(latest[key], num_enqueues - num_keys + key);
+   }
+}
+
+BOOST_AUTO_TEST_CASE( drain_budget )
+{
+   using ::std::chrono::milliseconds;
+   using ::std::chrono::steady_clock;
+   int ran = 0;
+   work_queue wq;
+   for (int i = 0; i < 10; ++i) {
+      wq.enqueue([&ran]() { ++ran; });
+   }
+   BOOST_CHECK_EQUAL(wq.backlog(), 10U);
+   auto report = wq.drain_for(milliseconds(100), 4);
+   BOOST_CHECK_EQUAL(report.ran, 4U);
+   BOOST_CHECK_EQUAL(report.backlog, 6U);
+   // Each of these takes 5ms, so a 12ms slice runs the 6 quick items left and
+   // 3 of these.
+   for (int i = 0; i < 6; ++i) {
+      wq.enqueue([]() { ::std::this_thread::sleep_for(milliseconds(5)); });
+   }
+   const auto start = steady_clock::now();
+   report = wq.drain_for(milliseconds(12));
+   BOOST_CHECK(steady_clock::now() - start < milliseconds(100));
+   BOOST_CHECK_EQUAL(report.ran, 9U);
+   BOOST_CHECK_EQUAL(report.backlog, 3U);
+   report = wq.drain_for(milliseconds(1000));
+   BOOST_CHECK_EQUAL(report.ran, 3U);
+   BOOST_CHECK_EQUAL(report.backlog, 0U);
+   BOOST_CHECK_EQUAL(ran, 10);
+}
+
+BOOST_AUTO_TEST_CASE( drain_budget_fair )
+{
+   ::std::vector<int> order;
+   auto record = [&order](int which) -> work_queue::work_item_t {
+      return [&order, which]() { order.push_back(which); };
+   };
+   work_queue::config cfg;
+   cfg.drain_quota = 3;
+   work_queue wq(cfg);
+   wq.enqueue(record(100));
+   wq.enqueue(record(101));
+   for (int i = 0; i < 7; ++i) {
+      wq.enqueue(record(i), true);
+   }
+   const auto report = wq.drain_for(::std::chrono::seconds(1), 8);
+   BOOST_CHECK_EQUAL(report.ran, 8U);
+   BOOST_CHECK_EQUAL(report.backlog, 1U);
+   BOOST_CHECK((order == ::std::vector<int>{0, 1, 2, 100, 3, 4, 5, 101}));
+   // Outside drain_until out of band items keep going first.
+   wq.enqueue(record(102));
+   wq.enqueue(record(7), true);
+   wq.drain(100);
+   BOOST_CHECK_EQUAL(order[9], 7);
+}
+
+BOOST_AUTO_TEST_CASE( node_caches )
+{
+   for (::std::size_t limit: {0, 4, 1024}) {
+      work_queue::config cfg;
+      cfg.node_cache_limit = limit;
+      work_queue wq(cfg);
+      int sum = 0;
+      for (int round = 0; round < 4; ++round) {
+         // Each producer exits before its nodes come back, so the next one
+         // adopts its cache.
+         ::std::thread producer([&wq, &sum]() {
+               for (int i = 0; i < 100; ++i) {
+                  wq.enqueue([&sum]() { ++sum; });
+               }
+            });
+         producer.join();
+         while (auto item = wq.dequeue(false)) {
+            item.value()();
+         }
+      }
+      BOOST_CHECK_EQUAL(sum, 400);
+      // A ticket can still look at its node after the item has run.
+      auto ticket = wq.enqueue_with_ticket([&sum]() { ++sum; });
+      wq.dequeue(false).value()();
+      BOOST_CHECK(!ticket.cancel());
+      BOOST_CHECK_EQUAL(sum, 401);
+   }
+   // This thread's cache for a queue that's gone doesn't get in the way.
+   ::std::unique_ptr<work_queue> first(new work_queue);
+   first->enqueue([]() {});
+   first.reset();
+   work_queue second;
+   int ran = 0;
+   second.enqueue([&ran]() { ++ran; });
+   second.dequeue(false).value()();
+   BOOST_CHECK_EQUAL(ran, 1);
+}
+
+BOOST_AUTO_TEST_CASE( ticketed_nodes_reused )
+{
+   work_queue::config cfg;
+   cfg.node_cache_limit = 4;
+   work_queue wq(cfg);
+   int sum = 0;
+   ::std::vector<work_queue::ticket> tickets;
+   tickets.reserve(200);
+   for (int i = 0; i < 100; ++i) {
+      tickets.push_back(wq.enqueue_with_ticket([&sum]() { ++sum; }));
+   }
+   while (auto item = wq.dequeue(false)) {
+      item.value()();
+   }
+   // This thread's cache only keeps 4 of those nodes, another producer gets
+   // the rest instead of allocating its own.
+   unsigned long allocations = 0;
+   ::std::thread producer([&]() {
+         ::sparkles::test::allocation_counter counter;
+         for (int i = 0; i < 100; ++i) {
+            tickets.push_back(wq.enqueue_with_ticket([&sum]() { ++sum; }));
+         }
+         allocations = counter.count();
+      });
+   producer.join();
+   BOOST_CHECK_LT(allocations, 10U);
+   while (auto item = wq.dequeue(false)) {
+      item.value()();
+   }
+   BOOST_CHECK_EQUAL(sum, 200);
+   for (auto &ticket: tickets) {
+      BOOST_CHECK(!ticket.cancel());
+   }
+}
+
+BOOST_AUTO_TEST_CASE( inline_depth )
+{
+   work_queue wq;
+   unsigned int deepest = 0;
+   unsigned int depth = 0;
+   ::std::function<void ()> nest = [&]() {
+      ++depth;
+      deepest = ::std::max(deepest, depth);
+      work_queue::work_item_t inner(nest);
+      if (!wq.try_run_inline(inner)) {
+         wq.enqueue(::std::move(inner));
+      }
+      --depth;
+   };
+   // Not the owner yet, so nothing runs inline.
+   work_queue::work_item_t first(nest);
+   BOOST_CHECK(!wq.try_run_inline(first));
+   wq.set_owner(3);
+   BOOST_CHECK(wq.try_run_inline(first));
+   BOOST_CHECK_EQUAL(deepest, 3U);
+   // The item that was too deep was queued instead.
+   BOOST_CHECK(wq.dequeue(false));
+   BOOST_CHECK(!wq.dequeue(false));
+   bool ran_elsewhere = true;
+   ::std::thread other([&wq, &first, &ran_elsewhere]() {
+         ran_elsewhere = wq.try_run_inline(first);
+      });
+   other.join();
+   BOOST_CHECK(!ran_elsewhere);
+}
+
+BOOST_AUTO_TEST_CASE( numa_node )
+{
+   BOOST_CHECK_EQUAL(work_queue().numa_node(), -1);
+   // Node 0 always exists, whether or not the machine has NUMA.
+   for (::std::size_t capacity: {0, 16}) {
+      work_queue::config cfg;
+      cfg.capacity = capacity;
+      cfg.numa_node = 0;
+      cfg.node_cache_limit = 8;
+      cfg.producer_lanes = true;
+      work_queue wq(cfg);
+      BOOST_CHECK_EQUAL(wq.numa_node(), 0);
+      int sum = 0;
+      for (int round = 0; round < 3; ++round) {
+         // More than a cache holds, so nodes go back to where they came from.
+         for (int i = 0; i < 16; ++i) {
+            wq.enqueue([&sum]() { ++sum; });
+         }
+         work_queue::producer_lane lane(wq, 4);
+         lane.enqueue([&sum]() { ++sum; });
+         while (auto item = wq.dequeue(false)) {
+            item.value()();
+         }
+      }
+      BOOST_CHECK_EQUAL(sum, 51);
+      // Left for the destructor.
+      wq.enqueue([]() {});
+   }
+}
+
+BOOST_AUTO_TEST_CASE( stats )
+{
+   work_queue wq;
+   for (int i = 0; i < 3; ++i) {
+      wq.enqueue([]() {});
+   }
+   wq.enqueue([]() {}, true);
+   auto ticket = wq.enqueue_with_ticket([]() {});
+   BOOST_CHECK(ticket.cancel());
+   while (wq.dequeue(false)) {
+   }
+   const work_queue::stats_snapshot stats = wq.stats();
+#if SPARKLES_WORK_QUEUE_STATS
+   BOOST_CHECK(stats.enabled);
+   BOOST_CHECK_EQUAL(stats.enqueued, 5U);
+   BOOST_CHECK_EQUAL(stats.dequeued, 4U);
+   BOOST_CHECK_EQUAL(stats.cancelled, 1U);
+   BOOST_REQUIRE_EQUAL(stats.class_depths.size(), 2U);
+   BOOST_CHECK_EQUAL(stats.class_depths[0].current, 0U);
+   BOOST_CHECK_EQUAL(stats.class_depths[0].high_water, 1U);
+   BOOST_CHECK_EQUAL(stats.class_depths[1].current, 0U);
+   BOOST_CHECK_EQUAL(stats.class_depths[1].high_water, 4U);
+   BOOST_CHECK_EQUAL(stats.latency.count(), 4U);
+#else
+   BOOST_CHECK(!stats.enabled);
+   BOOST_CHECK_EQUAL(stats.enqueued, 0U);
+   BOOST_CHECK(stats.class_depths.empty());
+   BOOST_CHECK_EQUAL(stats.latency.count(), 0U);
+#endif
+}
+
 BOOST_AUTO_TEST_CASE( dequeue_blocks )
 {
    ::std::atomic<bool> before{false};
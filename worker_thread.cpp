@@ -0,0 +1,90 @@
+#include <sparkles/worker_thread.hpp>
+#include <sparkles/topology.hpp>
+
+#include <pthread.h>
+#include <sched.h>
+#include <climits>
+#include <stdexcept>
+#include <system_error>
+#include <utility>
+
+namespace {
+
+::sparkles::work_queue::config
+on_node_of(const ::std::vector<unsigned int> &cpus,
+           ::sparkles::work_queue::config cfg)
+{
+   cfg.numa_node = ::sparkles::topology::system().node_of(cpus);
+   return cfg;
+}
+
+} // Anonymous namespace
+
+namespace sparkles {
+
+worker_thread::worker_thread(::std::vector<unsigned int> cpus,
+                             work_queue::config cfg)
+     : cpus_(::std::move(cpus)), queue_(on_node_of(cpus_, ::std::move(cfg))),
+       loop_(queue_), done_(false), thread_(&worker_thread::run, this)
+{
+   if (cpus_.empty()) {
+      return;
+   }
+   ::cpu_set_t set;
+   CPU_ZERO(&set);
+   for (unsigned int cpu: cpus_) {
+      if (cpu < CPU_SETSIZE) {
+         CPU_SET(cpu, &set);
+      }
+   }
+   const int error = ::pthread_setaffinity_np(thread_.native_handle(),
+                                              sizeof(set), &set);
+   if (error != 0) {
+      done_.store(true, ::std::memory_order_release);
+      loop_.stop();
+      thread_.join();
+      throw ::std::system_error(error, ::std::system_category(),
+                                "Can't pin a worker_thread to its CPUs.");
+   }
+}
+
+worker_thread::~worker_thread()
+{
+   done_.store(true, ::std::memory_order_release);
+   loop_.stop();
+   thread_.join();
+}
+
+void worker_thread::run()
+{
+   while (!done_.load(::std::memory_order_acquire)) {
+      loop_.run_until(event_loop::time_point::max());
+   }
+}
+
+worker_thread *
+worker_thread::nearest(const ::std::vector<worker_thread *> &workers,
+                       int numa_node)
+{
+   const topology &system = topology::system();
+   worker_thread *best = nullptr;
+   unsigned int best_distance = 0;
+   for (worker_thread *worker: workers) {
+      unsigned int distance = UINT_MAX;
+      if ((numa_node >= 0) && (worker->numa_node() >= 0)) {
+         try {
+            distance = system.distance(static_cast<unsigned int>(numa_node),
+                                       worker->numa_node());
+         } catch (const ::std::out_of_range &) {
+            // Not a node this machine has, so it's as far as can be.
+         }
+      }
+      if ((best == nullptr) || (distance < best_distance)) {
+         best = worker;
+         best_distance = distance;
+      }
+   }
+   return best;
+}
+
+} // namespace sparkles
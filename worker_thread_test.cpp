@@ -0,0 +1,69 @@
+#include <sparkles/worker_thread.hpp>
+#include <sparkles/remote_operation.hpp>
+#include <sparkles/topology.hpp>
+
+#include <boost/test/unit_test.hpp>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+namespace sparkles {
+namespace test {
+
+BOOST_AUTO_TEST_SUITE(worker_thread_test)
+
+BOOST_AUTO_TEST_CASE( runs_items )
+{
+   worker_thread worker;
+   BOOST_CHECK(worker.cpus().empty());
+   BOOST_CHECK_EQUAL(worker.numa_node(), -1);
+   BOOST_CHECK(worker.id() != ::std::this_thread::get_id());
+   // The worker fulfills a promise for this thread's loop.
+   work_queue wq;
+   event_loop loop(wq);
+   auto answer = remote_operation<::std::thread::id>::create(wq);
+   auto promise = answer.second;
+   worker.queue().enqueue([promise]() {
+         promise->set_result(::std::this_thread::get_id());
+      });
+   promise.reset();
+   answer.second.reset();
+   BOOST_REQUIRE(loop.run_for(answer.first, ::std::chrono::seconds(10)));
+   BOOST_CHECK(answer.first->result() == worker.id());
+}
+
+BOOST_AUTO_TEST_CASE( pinned )
+{
+   const topology &machine = topology::system();
+   const unsigned int cpu = machine.cpus_of(machine.nodes()[0])[0];
+   worker_thread worker({cpu});
+   BOOST_CHECK(worker.cpus() == ::std::vector<unsigned int>{cpu});
+   BOOST_CHECK_EQUAL(worker.numa_node(), machine.node_of(cpu));
+   work_queue wq;
+   event_loop loop(wq);
+   auto where = remote_operation<int>::create(wq);
+   auto promise = where.second;
+   where.second.reset();
+   worker.queue().enqueue([promise]() {
+         promise->set_result(topology::current_cpu());
+      });
+   promise.reset();
+   BOOST_REQUIRE(loop.run_for(where.first, ::std::chrono::seconds(10)));
+   BOOST_CHECK_EQUAL(where.first->result(), static_cast<int>(cpu));
+}
+
+BOOST_AUTO_TEST_CASE( nearest )
+{
+   BOOST_CHECK(worker_thread::nearest({}, 0) == nullptr);
+   const topology &machine = topology::system();
+   const unsigned int node = machine.nodes()[0];
+   worker_thread anywhere;
+   worker_thread local({machine.cpus_of(node)[0]});
+   BOOST_CHECK(worker_thread::nearest({&anywhere, &local}, node) == &local);
+   BOOST_CHECK(worker_thread::nearest({&anywhere, &local}, -1) == &anywhere);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
+
+} // namespace test
+} // namespace sparkles